@@ -44,31 +44,152 @@
 #include <string.h>
 #include <pthread.h>
 #include <assert.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <stdint.h>
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
 
 #include "pakchois.h"
 
+/* Slab allocator for fixed-size objects.  Objects are carved from
+ * chunks of SLAB_CHUNK objects and recycled through a free list;
+ * chunks are released only when the slab is destroyed, so a steady
+ * state of allocations and frees does not touch the heap.  A slab is
+ * not thread-safe; callers must provide locking. */
+#define SLAB_CHUNK (32)
+#define SLAB_ALIGN (16)
+
+struct slab {
+    size_t size; /* size of each object, rounded up to SLAB_ALIGN */
+    void *free; /* free objects, linked through their first word */
+    struct slab_chunk *chunks;
+};
+
+enum provider_state {
+    PROVIDER_UNLOADED, /* not loaded */
+    PROVIDER_LOADING, /* being loaded and initialized */
+    PROVIDER_READY, /* initialized and usable */
+    PROVIDER_FAILED, /* initialization failed; rv holds the error */
+    PROVIDER_FINALIZING /* being finalized and unloaded */
+};
+
+/* Provider structures are registered by name in a hash table, and
+ * once registered are never freed (until the library is unloaded);
+ * a provider which is unloaded returns to the UNLOADED state and is
+ * reused if loaded again.  The handle and fns fields are valid only
+ * in the READY state, which cannot be left whilst the refcount is
+ * non-zero.
+ *
+ * Slot events are read from the provider by a dispatcher thread,
+ * started on demand, which makes the only blocking call to
+ * C_WaitForSlotEvent and passes each event on to all modules and
+ * subscribers using the provider.  If the provider does not support
+ * blocking waits, the dispatcher instead polls for events.  The
+ * dispatcher runs until the provider is finalized; errors from the
+ * provider are retried after the poll interval.  Events are
+ * dispatched only by the dispatcher thread.
+ *
+ * The provider mutex may be held whilst a slot's cache_lock is taken,
+ * as dispatch_event() does to invalidate slots; the reverse order is
+ * never used. */
 struct provider {
-    char *name;
     void *handle;
+    /* Protects the event dispatch state below. */
     pthread_mutex_t mutex;
+    /* Broadcast whenever an event is dispatched, or the dispatcher
+     * stops. */
+    pthread_cond_t event_cond;
+    pakchois_module_t *modules; /* chained via module->pnext */
+    pakchois_subscription_t *subscribers;
+    int dispatching; /* dispatcher thread is running */
+    int dispatch_joinable; /* dispatcher thread must be joined */
+    int dispatch_stop; /* set when the provider is finalized */
+    pthread_t dispatcher;
     const struct ck_function_list *fns;
     unsigned int refcount;
-    struct provider *next, **prevref;
+    enum provider_state state;
+    ck_rv_t rv;
+    /* Time at which the refcount last reached zero, for a provider
+     * which is lingering. */
+    time_t idle_since;
+    struct provider *next;
+    unsigned int hash;
+    char name[1];
 };
 
+/* Slots with ids below SLOT_DENSE are indexed directly by id;
+ * others by hash. */
+#define SLOT_DENSE (64)
+
 struct pakchois_module_s {
-    struct slot *slots;
+    /* Slots are only ever added until the module is destroyed.
+     * Insertions take the write lock.  Lookups of dense slot ids are
+     * lock-free; lookups in the hash table take the read lock. */
+    pthread_rwlock_t slots_lock;
+    struct slot *slots; /* list of all slots */
+    struct slot *slot_dense[SLOT_DENSE];
+    struct slot **slot_hash; /* chained via slot->hnext */
+    unsigned int slot_hash_size, slot_hash_count;
+    struct slab slot_slab; /* protected by slots_lock */
     struct provider *provider;
+    /* Following fields protected by provider->mutex: */
+    pakchois_module_t *pnext;
+    /* Events queued for pakchois_wait_for_slot_event(). */
+    pakchois_subscription_t *events;
+    /* Mapped snapshot file, if loaded; see pakchois_load_snapshot(). */
+    const void *snapshot;
+    size_t snapshot_len;
 };
 
 static pthread_mutex_t provider_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-/* List of loaded providers; any modification to the list or any
- * individual module must performed whilst holding this mutex. */
-static struct provider *provider_list;
+/* Broadcast, with provider_mutex held, whenever a provider changes
+ * state. */
+static pthread_cond_t provider_cond = PTHREAD_COND_INITIALIZER;
+
+#define PROVIDER_BUCKETS (64)
+
+/* Hash table of registered providers.  Insertion into the table, and
+ * any change to the state of a provider, must be performed whilst
+ * holding provider_mutex.  Lookups in the table are lock-free: the
+ * bucket chains are only ever prepended to, using atomic stores, so
+ * may be walked concurrently.  Likewise the refcount of a provider
+ * may be incremented from non-zero without the mutex; incrementing
+ * it from zero requires the mutex.  Loading and unloading the
+ * provider DSOs, and calls to C_Initialize and C_Finalize, are done
+ * without the mutex held, so that unrelated providers can be loaded
+ * concurrently. */
+static struct provider *provider_table[PROVIDER_BUCKETS];
+
+/* Linger policy: a provider whose refcount drops to zero remains
+ * loaded ("lingers") for linger_timeout seconds, and at most
+ * linger_max providers (if non-zero) linger at once.  Lingering
+ * providers are finalized by the reaper thread, which is started
+ * when first needed.  All protected by provider_mutex. */
+static unsigned int linger_timeout, linger_max;
+static int linger_running, linger_shutdown;
+static pthread_t linger_thread;
+static pthread_cond_t linger_cond;
+
+/* Lifetime of cached slot and token information, in seconds; zero
+ * means cached information expires only on slot events. */
+static unsigned int info_ttl = 1;
+
+/* Bounds on the interval, in milliseconds, between polls for slot
+ * events from providers which do not support blocking waits, and
+ * between retries after errors; protected by poll_mutex. */
+static pthread_mutex_t poll_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned int poll_min = 100, poll_max = 5000;
 
 struct pakchois_session_s {
     pakchois_module_t *module;
+    struct slot *slot;
     ck_session_handle_t id;
     pakchois_notify_t notify;
     void *notify_data;
@@ -78,10 +199,75 @@ struct pakchois_session_s {
     pakchois_session_t *next;
 };
 
+/* Cached mechanism list and information for a slot.  The table is
+ * an open-addressed hash of mechanism types, each entry holding an
+ * index into the types and info arrays plus one, or zero if empty. */
+struct mech_cache {
+    unsigned long count;
+    ck_mechanism_type_t *types;
+    struct ck_mechanism_info *info;
+    unsigned int *table;
+    unsigned int table_size;
+};
+
+/* Cached result of C_GetSlotInfo or C_GetTokenInfo for a slot; rv
+ * is cached as well so a missing token is not queried repeatedly. */
+struct info_cache {
+    int valid;
+    ck_rv_t rv;
+    time_t fetched;
+    union {
+        struct ck_slot_info slot;
+        struct ck_token_info token;
+    } u;
+};
+
+/* Non-zero if the return value shows the slot holds no token. */
+#define TOKEN_MISSING(rv) ((rv) == CKR_TOKEN_NOT_PRESENT \
+                           || (rv) == CKR_DEVICE_REMOVED)
+
+/* Learned output length for an operation; see predict_len(). */
+struct len_entry {
+    unsigned char kind, cls; /* zero kind for an unused entry */
+    ck_mechanism_type_t mech;
+    ck_object_handle_t key;
+    unsigned long len;
+};
+
+#define LEN_CACHE_SIZE (256)
+
 struct slot {
     ck_slot_id_t id;
+    /* Protects the session list and session slab. */
+    pthread_mutex_t mutex;
     pakchois_session_t *sessions;
-    struct slot *next;
+    struct slab session_slab;
+    /* Protects the cached token state below; the caches are
+     * discarded, and the generation incremented, whenever a slot
+     * event is seen for the slot. */
+    pthread_rwlock_t cache_lock;
+    unsigned long generation;
+    struct mech_cache *mechs;
+    struct info_cache slot_info, token_info;
+    struct len_entry *lens; /* LEN_CACHE_SIZE entries */
+    int attr_caching;
+    /* The attribute cache, and a count of objects forgotten from it,
+     * so that attributes read concurrently with a change are not
+     * stored. */
+    struct attr_cache *attrs;
+    unsigned long attr_changes;
+    /* The object index, and a count of objects added to or removed
+     * from it, so that an index built, or a miss found, concurrently
+     * with a change is not installed. */
+    struct object_index *index;
+    unsigned long index_changes;
+    /* The certificate index survives slot events, and is refreshed
+     * on next use. */
+    struct cert_index *certs;
+    /* Parts of the module's snapshot already adopted or rejected for
+     * this slot since it was last invalidated; SNAP_* flags. */
+    int snap_state;
+    struct slot *next, *hnext;
 };
 
 static const char *suffix_prefixes[][2] = {
@@ -101,10 +287,409 @@ static const char *suffix_prefixes[][2] = {
 #define CALLS5(n, a, b, c, d, e) CALLS(n, (sess->id, a, b, c, d, e))
 #define CALLS7(n, a, b, c, d, e, f, g) CALLS(n, (sess->id, a, b, c, d, e, f, g))
 
+static time_t monotonic_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec;
+}
+
+/* Initialize a condition variable which uses the monotonic clock for
+ * timed waits.  Returns non-zero on failure. */
+static int monotonic_cond_init(pthread_cond_t *cond)
+{
+    pthread_condattr_t attr;
+    int ret;
+
+    if (pthread_condattr_init(&attr)) {
+        return -1;
+    }
+
+    ret = pthread_condattr_setclock(&attr, CLOCK_MONOTONIC)
+        || pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+    return ret;
+}
+
+/* Set *ts to the monotonic clock time msec milliseconds from now. */
+static void monotonic_deadline(struct timespec *ts, unsigned long msec)
+{
+    clock_gettime(CLOCK_MONOTONIC, ts);
+    ts->tv_sec += msec / 1000;
+    ts->tv_nsec += (msec % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+/* Allocator used for modules, slots, sessions and pools; see
+ * pakchois_set_allocator().  Process-global state (the provider
+ * registry and module path cache) always uses the C library. */
+static void *(*alloc_fn)(void *, size_t);
+static void (*free_fn)(void *, void *);
+static void *alloc_userdata;
+
+static void *pk_malloc(size_t size)
+{
+    return alloc_fn ? alloc_fn(alloc_userdata, size) : malloc(size);
+}
+
+static void *pk_calloc(size_t nmemb, size_t size)
+{
+    void *ptr;
+
+    if (size && nmemb > (size_t)-1 / size) {
+        return NULL;
+    }
+
+    ptr = pk_malloc(nmemb * size);
+    if (ptr) {
+        memset(ptr, 0, nmemb * size);
+    }
+    return ptr;
+}
+
+static void pk_free(void *ptr)
+{
+    if (alloc_fn) {
+        if (ptr) free_fn(alloc_userdata, ptr);
+    }
+    else {
+        free(ptr);
+    }
+}
+
+void pakchois_set_allocator(void *(*alloc)(void *userdata, size_t size),
+                            void (*release)(void *userdata, void *ptr),
+                            void *userdata)
+{
+    alloc_fn = release ? alloc : NULL;
+    free_fn = release;
+    alloc_userdata = userdata;
+}
+
+/* Slab allocator; see struct slab. */
+struct slab_chunk {
+    struct slab_chunk *next;
+};
+
+#define SLAB_HEADER ((sizeof(struct slab_chunk) + SLAB_ALIGN - 1) \
+                     & ~(size_t)(SLAB_ALIGN - 1))
+
+static void slab_init(struct slab *slab, size_t size)
+{
+    slab->size = (size + SLAB_ALIGN - 1) & ~(size_t)(SLAB_ALIGN - 1);
+    slab->free = NULL;
+    slab->chunks = NULL;
+}
+
+/* Returns a zeroed object, or NULL on allocation failure. */
+static void *slab_alloc(struct slab *slab)
+{
+    void *obj;
+
+    if (slab->free == NULL) {
+        struct slab_chunk *chunk;
+        char *base;
+        unsigned int n;
+
+        chunk = pk_malloc(SLAB_HEADER + SLAB_CHUNK * slab->size);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        chunk->next = slab->chunks;
+        slab->chunks = chunk;
+
+        base = (char *)chunk + SLAB_HEADER;
+        for (n = 0; n < SLAB_CHUNK; n++) {
+            *(void **)(base + n * slab->size) = slab->free;
+            slab->free = base + n * slab->size;
+        }
+    }
+
+    obj = slab->free;
+    slab->free = *(void **)obj;
+    memset(obj, 0, slab->size);
+    return obj;
+}
+
+static void slab_free(struct slab *slab, void *obj)
+{
+    *(void **)obj = slab->free;
+    slab->free = obj;
+}
+
+static void slab_destroy(struct slab *slab)
+{
+    while (slab->chunks) {
+        struct slab_chunk *chunk = slab->chunks;
+
+        slab->chunks = chunk->next;
+        pk_free(chunk);
+    }
+    slab->free = NULL;
+}
+
+/* Cache of module name to path resolutions.  Each entry records the
+ * modification time of the resolved DSO and a stamp derived from the
+ * modification times of the module path directories searched up to
+ * and including the one it was found in; if either changes (for
+ * example, because a module of the same name was installed in an
+ * earlier directory), the entry is ignored and the path is probed
+ * again. */
+struct modpath {
+    char *name, *path;
+    time_t mtime;
+    unsigned int ndirs;
+    unsigned long stamp;
+    struct modpath *next;
+};
+
+static pthread_mutex_t modpath_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* Cache entries, and the on-disk cache file (if any); both protected
+ * by modpath_mutex. */
+static struct modpath *modpath_cache;
+static char *modpath_file;
+
+/* Returns the stamp for the first ndirs directories of the module
+ * path. */
+static unsigned long modpath_stamp(unsigned int ndirs)
+{
+    char module_path[] = PAKCHOIS_MODPATH;
+    char *dir = module_path, *sep;
+    unsigned long stamp = 5381;
+
+    while (dir && ndirs--) {
+        struct stat st;
+
+        sep = strchr(dir, ':');
+        if (sep) {
+            *sep++ = '\0';
+        }
+
+        if (stat(dir, &st) == 0) {
+            stamp = stamp * 33 + (unsigned long)st.st_mtime;
+#ifdef HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC
+            stamp = stamp * 33 + (unsigned long)st.st_mtim.tv_nsec;
+#endif
+        }
+        else {
+            stamp = stamp * 33 + 1;
+        }
+
+        dir = sep;
+    }
+
+    return stamp;
+}
+
+/* Add or replace a cache entry.  Must be called with modpath_mutex
+ * held.  Returns non-zero on allocation failure. */
+static int modpath_insert(const char *name, const char *path,
+                          time_t mtime, unsigned int ndirs,
+                          unsigned long stamp)
+{
+    struct modpath *mp;
+    char *cpath = strdup(path);
+
+    if (cpath == NULL) {
+        return -1;
+    }
+
+    for (mp = modpath_cache; mp; mp = mp->next) {
+        if (strcmp(mp->name, name) == 0) {
+            break;
+        }
+    }
+
+    if (mp == NULL) {
+        mp = malloc(sizeof *mp);
+        if (mp == NULL || (mp->name = strdup(name)) == NULL) {
+            free(mp);
+            free(cpath);
+            return -1;
+        }
+        mp->next = modpath_cache;
+        modpath_cache = mp;
+    }
+    else {
+        free(mp->path);
+    }
+
+    mp->path = cpath;
+    mp->mtime = mtime;
+    mp->ndirs = ndirs;
+    mp->stamp = stamp;
+    return 0;
+}
+
+/* Read the on-disk cache file into the cache.  Must be called with
+ * modpath_mutex held.  Malformed lines are ignored. */
+static void modpath_read(void)
+{
+    char line[PATH_MAX * 2];
+    FILE *f = fopen(modpath_file, "r");
+
+    if (f == NULL) {
+        return;
+    }
+
+    while (fgets(line, sizeof line, f)) {
+        char *name = line, *path, *rest, *end;
+        unsigned long mtime, stamp, ndirs;
+
+        if ((path = strchr(name, '\t')) == NULL) continue;
+        *path++ = '\0';
+        if ((rest = strchr(path, '\t')) == NULL) continue;
+        *rest++ = '\0';
+
+        mtime = strtoul(rest, &end, 10);
+        if (*end != '\t') continue;
+        ndirs = strtoul(end + 1, &end, 10);
+        if (*end != '\t') continue;
+        stamp = strtoul(end + 1, &end, 10);
+        if (*end != '\n') continue;
+
+        modpath_insert(name, path, (time_t)mtime, ndirs, stamp);
+    }
+
+    fclose(f);
+}
+
+/* Rewrite the on-disk cache file from the cache, atomically
+ * replacing any existing file.  Must be called with modpath_mutex
+ * held.  Failure is not fatal; the file is only an optimisation. */
+static void modpath_write(void)
+{
+    size_t len = strlen(modpath_file);
+    struct modpath *mp;
+    char *tmp;
+    FILE *f;
+    int fd;
+
+    tmp = malloc(len + sizeof ".XXXXXX");
+    if (tmp == NULL) {
+        return;
+    }
+    memcpy(tmp, modpath_file, len);
+    memcpy(tmp + len, ".XXXXXX", sizeof ".XXXXXX");
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(tmp);
+        return;
+    }
+
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        unlink(tmp);
+        free(tmp);
+        return;
+    }
+
+    for (mp = modpath_cache; mp; mp = mp->next) {
+        /* A tab or newline in the name or path cannot be written in
+         * the file format; such entries are kept only in memory. */
+        if (strpbrk(mp->name, "\t\n") || strpbrk(mp->path, "\t\n")) {
+            continue;
+        }
+        fprintf(f, "%s\t%s\t%lu\t%u\t%lu\n", mp->name, mp->path,
+                (unsigned long)mp->mtime, mp->ndirs, mp->stamp);
+    }
+
+    if (fclose(f) != 0 || rename(tmp, modpath_file) != 0) {
+        unlink(tmp);
+    }
+    free(tmp);
+}
+
+ck_rv_t pakchois_set_module_cache(const char *filename)
+{
+    char *copy = NULL;
+
+    if (filename && (copy = strdup(filename)) == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_mutex_lock(&modpath_mutex)) {
+        free(copy);
+        return CKR_CANT_LOCK;
+    }
+
+    free(modpath_file);
+    modpath_file = copy;
+    if (modpath_file) {
+        modpath_read();
+    }
+
+    pthread_mutex_unlock(&modpath_mutex);
+    return CKR_OK;
+}
+
+static void *open_pkcs11_module(const char *path, CK_C_GetFunctionList *gfl)
+{
+    void *h = dlopen(path, RTLD_LOCAL|RTLD_NOW);
+
+    if (h != NULL) {
+        *gfl = dlsym(h, "C_GetFunctionList");
+        if (*gfl) {
+            return h;
+        }
+        dlclose(h);
+    }
+
+    return NULL;
+}
+
+/* Look up the module name in the cache; returns the handle on a valid
+ * cache hit, or NULL. */
+static void *find_cached_module(const char *name, CK_C_GetFunctionList *gfl)
+{
+    struct modpath *mp;
+    char path[PATH_MAX];
+    unsigned int ndirs = 0;
+    unsigned long stamp = 0;
+    time_t mtime = 0;
+    struct stat st;
+
+    if (pthread_mutex_lock(&modpath_mutex)) {
+        return NULL;
+    }
+
+    for (mp = modpath_cache; mp; mp = mp->next) {
+        if (strcmp(mp->name, name) == 0) {
+            snprintf(path, sizeof path, "%s", mp->path);
+            mtime = mp->mtime;
+            ndirs = mp->ndirs;
+            stamp = mp->stamp;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&modpath_mutex);
+
+    if (mp == NULL || stat(path, &st) || st.st_mtime != mtime
+        || modpath_stamp(ndirs) != stamp) {
+        return NULL;
+    }
+
+    return open_pkcs11_module(path, gfl);
+}
+
 static void *find_pkcs11_module(const char *name, CK_C_GetFunctionList *gfl)
 {
     char module_path[] = PAKCHOIS_MODPATH;
     char *next = module_path;
+    unsigned int ndirs = 0;
+    void *h;
+
+    h = find_cached_module(name, gfl);
+    if (h) {
+        return h;
+    }
     
     while (next) {
         char *dir = next, *sep = strchr(next, ':');
@@ -117,21 +702,27 @@ static void *find_pkcs11_module(const char *name, CK_C_GetFunctionList *gfl)
         else {
             next = NULL;
         }
+        ndirs++;
 
         for (i = 0; suffix_prefixes[i][0]; i++) {
             char path[PATH_MAX];
-            void *h;
+            struct stat st;
             
             snprintf(path, sizeof path, "%s/%s%s%s", dir,
                      suffix_prefixes[i][0], name, suffix_prefixes[i][1]);
 
-            h = dlopen(path, RTLD_LOCAL|RTLD_NOW);
+            h = open_pkcs11_module(path, gfl);
             if (h != NULL) {
-                *gfl = dlsym(h, "C_GetFunctionList");
-                if (*gfl) {
-                    return h;
+                if (stat(path, &st) == 0
+                    && pthread_mutex_lock(&modpath_mutex) == 0) {
+                    if (modpath_insert(name, path, st.st_mtime, ndirs,
+                                       modpath_stamp(ndirs)) == 0
+                        && modpath_file) {
+                        modpath_write();
+                    }
+                    pthread_mutex_unlock(&modpath_mutex);
                 }
-                dlclose(h);
+                return h;
             }
         }
     }
@@ -139,12 +730,27 @@ static void *find_pkcs11_module(const char *name, CK_C_GetFunctionList *gfl)
     return NULL;
 }            
 
-static struct provider *find_provider(const char *name)
+static unsigned int provider_hash(const char *name)
+{
+    unsigned int h = 2166136261U;
+
+    while (*name) {
+        h = (h ^ (unsigned char)*name++) * 16777619U;
+    }
+
+    return h;
+}
+
+/* Find a registered provider by name; may be called with or without
+ * the provider mutex held. */
+static struct provider *find_provider(const char *name, unsigned int hash)
 {
     struct provider *p;
 
-    for (p = provider_list; p; p = p->next) {
-        if (strcmp(name, p->name) == 0) {
+    p = __atomic_load_n(&provider_table[hash % PROVIDER_BUCKETS],
+                        __ATOMIC_ACQUIRE);
+    for (; p; p = __atomic_load_n(&p->next, __ATOMIC_ACQUIRE)) {
+        if (p->hash == hash && strcmp(name, p->name) == 0) {
             return p;
         }
     }
@@ -152,61 +758,84 @@ static struct provider *find_provider(const char *name)
     return NULL;    
 }
 
-static ck_rv_t load_provider(struct provider **provider, const char *name, 
-                             void *reserved)
+/* Register a new provider of given name, in the UNLOADED state.
+ * Must be called with the provider mutex held. */
+static struct provider *register_provider(const char *name, 
+                                          unsigned int hash)
 {
-    CK_C_GetFunctionList gfl;
+    struct provider **bucket = &provider_table[hash % PROVIDER_BUCKETS];
+    size_t len = strlen(name);
     struct provider *prov;
-    struct ck_function_list *fns;
-    struct ck_c_initialize_args args;
-    void *h;
-    ck_rv_t rv;
-    char *cname;
 
-    if (pthread_mutex_lock(&provider_mutex) != 0) {
-        return CKR_CANT_LOCK;
+    prov = calloc(1, sizeof *prov + len);
+    if (prov == NULL) {
+        return NULL;
     }
 
-    prov = find_provider(name);
-    if (prov) {
-        prov->refcount++;
-        *provider = prov;
-        pthread_mutex_unlock(&provider_mutex);
+    if (pthread_mutex_init(&prov->mutex, NULL)) {
+        free(prov);
+        return NULL;
+    }
+
+    if (monotonic_cond_init(&prov->event_cond)) {
+        pthread_mutex_destroy(&prov->mutex);
+        free(prov);
+        return NULL;
+    }
+
+    memcpy(prov->name, name, len + 1);
+    prov->hash = hash;
+    prov->state = PROVIDER_UNLOADED;
+    prov->next = *bucket;
+
+    __atomic_store_n(bucket, prov, __ATOMIC_RELEASE);
+    return prov;
+}
+
+static void set_provider_state(struct provider *prov,
+                               enum provider_state state)
+{
+    __atomic_store_n(&prov->state, state, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&provider_cond);
+}
+
+/* Wait for a provider, on which the caller holds a reference, to
+ * finish loading.  If the load fails, the reference is dropped and
+ * the error returned.  Must be called with the provider mutex
+ * held. */
+static ck_rv_t wait_provider(struct provider *prov)
+{
+    while (prov->state == PROVIDER_LOADING) {
+        pthread_cond_wait(&provider_cond, &provider_mutex);
+    }
+
+    if (prov->state == PROVIDER_READY) {
         return CKR_OK;
     }
 
-    h = find_pkcs11_module(name, &gfl);
+    __atomic_sub_fetch(&prov->refcount, 1, __ATOMIC_RELEASE);
+    return prov->rv;
+}
+
+/* Load and initialize the DSO for a provider which is in the LOADING
+ * state.  Must be called WITHOUT the provider mutex held. */
+static ck_rv_t init_provider(struct provider *prov, void *reserved)
+{
+    CK_C_GetFunctionList gfl;
+    struct ck_function_list *fns;
+    struct ck_c_initialize_args args;
+    void *h;
+    ck_rv_t rv;
+
+    h = find_pkcs11_module(prov->name, &gfl);
     if (!h) {
-        rv = CKR_GENERAL_ERROR;
-        goto fail_locked;
+        return CKR_GENERAL_ERROR;
     }
     
     rv = gfl(&fns);
     if (rv != CKR_OK) {
         goto fail_dso;
     }
-    
-    cname = strdup(name);
-    if (cname == NULL) {
-        rv = CKR_HOST_MEMORY;
-        goto fail_dso;
-    }
-
-    *provider = prov = malloc(sizeof *prov);
-    if (prov == NULL) {
-        rv = CKR_HOST_MEMORY;
-        goto fail_ndup;
-    }
-    
-    if (pthread_mutex_init(&prov->mutex, NULL)) {
-        rv = CKR_GENERAL_ERROR;
-        goto fail_ctx;
-    }
-
-    prov->name = cname;
-    prov->handle = h;
-    prov->fns = fns;
-    prov->refcount = 1;
 
     /* Require OS locking, the only sane option. */
     memset(&args, 0, sizeof args);
@@ -215,49 +844,161 @@ static ck_rv_t load_provider(struct provider **provider, const char *name,
 
     rv = fns->C_Initialize(&args);
     if (rv != CKR_OK) {
-        goto fail_ctx;
+        goto fail_dso;
     }
 
-    prov->next = provider_list;
-    prov->prevref = &provider_list;
-    if (prov->next) {
-        prov->next->prevref = &prov->next;
-    }
-    provider_list = prov;
+    prov->handle = h;
+    prov->fns = fns;
 
-    pthread_mutex_unlock(&provider_mutex);
-    
     return CKR_OK;
-fail_ctx:        
-    free(prov);
-fail_ndup:
-    free(cname);
 fail_dso:
     dlclose(h);
-fail_locked:
-    pthread_mutex_unlock(&provider_mutex);
-    *provider = NULL;
     return rv;
-}    
+}
 
-static ck_rv_t load_module(pakchois_module_t **module, const char *name, 
-                           void *reserved)
+static ck_rv_t load_provider(struct provider **provider, const char *name, 
+                             void *reserved)
 {
+    unsigned int hash = provider_hash(name), n;
+    struct provider *prov;
     ck_rv_t rv;
-    pakchois_module_t *pm = malloc(sizeof *pm);
 
-    if (!pm) {
-        return CKR_HOST_MEMORY;
+    /* Fast path: take another reference to a provider which is
+     * already referenced, without locking. */
+    prov = find_provider(name, hash);
+    if (prov) {
+        n = __atomic_load_n(&prov->refcount, __ATOMIC_RELAXED);
+        while (n > 0) {
+            if (!__atomic_compare_exchange_n(&prov->refcount, &n, n + 1, 1,
+                                             __ATOMIC_ACQUIRE,
+                                             __ATOMIC_RELAXED)) {
+                continue;
+            }
+
+            if (__atomic_load_n(&prov->state, __ATOMIC_ACQUIRE)
+                == PROVIDER_READY) {
+                *provider = prov;
+                return CKR_OK;
+            }
+
+            /* Still being loaded by another thread. */
+            if (pthread_mutex_lock(&provider_mutex)) {
+                abort();
+            }
+            rv = wait_provider(prov);
+            pthread_mutex_unlock(&provider_mutex);
+            if (rv == CKR_OK) {
+                *provider = prov;
+            }
+            return rv;
+        }
     }
 
+    if (pthread_mutex_lock(&provider_mutex) != 0) {
+        return CKR_CANT_LOCK;
+    }
+
+    if (prov == NULL) {
+        prov = find_provider(name, hash);
+        if (prov == NULL && (prov = register_provider(name, hash)) == NULL) {
+            pthread_mutex_unlock(&provider_mutex);
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    /* Wait for any previous instance of this provider to finish
+     * unloading, since it shares the same DSO. */
+    while (prov->state == PROVIDER_FINALIZING) {
+        pthread_cond_wait(&provider_cond, &provider_mutex);
+    }
+
+    __atomic_add_fetch(&prov->refcount, 1, __ATOMIC_ACQUIRE);
+
+    if (prov->state == PROVIDER_READY || prov->state == PROVIDER_LOADING) {
+        /* Either loaded, or being loaded by another thread, in which
+         * case wait for that to complete. */
+        rv = wait_provider(prov);
+        pthread_mutex_unlock(&provider_mutex);
+        if (rv == CKR_OK) {
+            *provider = prov;
+        }
+        return rv;
+    }
+
+    set_provider_state(prov, PROVIDER_LOADING);
+    pthread_mutex_unlock(&provider_mutex);
+
+    rv = init_provider(prov, reserved);
+
+    if (pthread_mutex_lock(&provider_mutex)) {
+        abort();
+    }
+
+    if (rv == CKR_OK) {
+        set_provider_state(prov, PROVIDER_READY);
+        *provider = prov;
+    }
+    else {
+        /* Any concurrent waiters see the error and drop their
+         * references; a subsequent load will try again. */
+        prov->rv = rv;
+        __atomic_sub_fetch(&prov->refcount, 1, __ATOMIC_RELEASE);
+        set_provider_state(prov, PROVIDER_FAILED);
+    }
+
+    pthread_mutex_unlock(&provider_mutex);
+    
+    return rv;
+}    
+
+static void provider_unref(struct provider *prov);
+static ck_rv_t new_subscription(pakchois_module_t *mod,
+                                pakchois_slot_event_t callback,
+                                void *userdata, int fd,
+                                pakchois_subscription_t **subp);
+
+static ck_rv_t load_module(pakchois_module_t **module, const char *name, 
+                           void *reserved)
+{
+    ck_rv_t rv;
+    pakchois_module_t *pm = pk_calloc(1, sizeof *pm);
+
+    if (!pm) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_rwlock_init(&pm->slots_lock, NULL)) {
+        pk_free(pm);
+        return CKR_GENERAL_ERROR;
+    }
+
+    slab_init(&pm->slot_slab, sizeof(struct slot));
+
     rv = load_provider(&pm->provider, name, reserved);
     if (rv) {
-        free(pm);
+        pthread_rwlock_destroy(&pm->slots_lock);
+        pk_free(pm);
+        return rv;
+    }
+
+    /* Register with the provider to see slot events, queueing them
+     * for pakchois_wait_for_slot_event() from now on. */
+    if (pthread_mutex_lock(&pm->provider->mutex)) {
+        abort();
+    }
+    rv = new_subscription(pm, NULL, NULL, 0, &pm->events);
+    if (rv) {
+        pthread_mutex_unlock(&pm->provider->mutex);
+        provider_unref(pm->provider);
+        pthread_rwlock_destroy(&pm->slots_lock);
+        pk_free(pm);
         return rv;
     }
+    pm->pnext = pm->provider->modules;
+    pm->provider->modules = pm;
+    pthread_mutex_unlock(&pm->provider->mutex);
     
     *module = pm;    
-    pm->slots = NULL;
 
     return CKR_OK;
 }    
@@ -285,41 +1026,238 @@ ck_rv_t pakchois_module_nssload(pakchois_module_t **module,
     return load_module(module, name, buf);
 }
 
-/* Unreference a provider structure and destoy if, if necessary.  Must
- * be called WIHTOUT the provider mutex held.  */
+static void stop_dispatcher(struct provider *prov);
+
+/* Finalize and unload a provider with a zero refcount.  Must be
+ * called with the provider mutex held; the mutex is released whilst
+ * the provider is finalized. */
+static void finalize_provider(struct provider *prov)
+{
+    /* Any concurrent load of the same name waits for this to
+     * complete. */
+    set_provider_state(prov, PROVIDER_FINALIZING);
+    pthread_mutex_unlock(&provider_mutex);
+
+    /* C_Finalize causes any blocked C_WaitForSlotEvent call to
+     * return, so the dispatcher can be stopped afterwards. */
+    pthread_mutex_lock(&prov->mutex);
+    prov->dispatch_stop = 1;
+    pthread_cond_broadcast(&prov->event_cond);
+    pthread_mutex_unlock(&prov->mutex);
+
+    prov->fns->C_Finalize(NULL);
+    stop_dispatcher(prov);
+    dlclose(prov->handle);
+
+    if (pthread_mutex_lock(&provider_mutex)) {
+        abort();
+    }
+    prov->fns = NULL;
+    prov->handle = NULL;
+    set_provider_state(prov, PROVIDER_UNLOADED);
+}
+
+/* Returns the least recently used lingering provider, or NULL if
+ * there are none, and the number of lingering providers in *count.
+ * Must be called with the provider mutex held. */
+static struct provider *oldest_lingering(unsigned int *count)
+{
+    struct provider *prov, *oldest = NULL;
+    unsigned int n;
+
+    *count = 0;
+    for (n = 0; n < PROVIDER_BUCKETS; n++) {
+        for (prov = provider_table[n]; prov; prov = prov->next) {
+            if (prov->state == PROVIDER_READY 
+                && __atomic_load_n(&prov->refcount, __ATOMIC_ACQUIRE) == 0) {
+                if (oldest == NULL || prov->idle_since < oldest->idle_since) {
+                    oldest = prov;
+                }
+                (*count)++;
+            }
+        }
+    }
+
+    return oldest;
+}
+
+static void *linger_reaper(void *arg)
+{
+    struct timespec deadline;
+    struct provider *prov;
+    unsigned int count;
+    time_t now;
+
+    if (pthread_mutex_lock(&provider_mutex)) {
+        abort();
+    }
+
+    while (!linger_shutdown) {
+        prov = oldest_lingering(&count);
+        if (prov == NULL) {
+            pthread_cond_wait(&linger_cond, &provider_mutex);
+            continue;
+        }
+
+        now = monotonic_now();
+        if (now - prov->idle_since >= (time_t)linger_timeout) {
+            finalize_provider(prov);
+            continue;
+        }
+
+        /* Wait until the provider expires; the deadline is set
+         * directly, since the interval in milliseconds could
+         * overflow. */
+        deadline.tv_sec = prov->idle_since + (time_t)linger_timeout;
+        deadline.tv_nsec = 0;
+        pthread_cond_timedwait(&linger_cond, &provider_mutex, &deadline);
+    }
+
+    pthread_mutex_unlock(&provider_mutex);
+    return NULL;
+}
+
+/* Finalize lingering providers in excess of the linger policy
+ * (excluding any which the reaper thread would finalize after a
+ * timeout).  Must be called with the provider mutex held. */
+static void enforce_linger(void)
+{
+    struct provider *prov;
+    unsigned int count;
+
+    while ((prov = oldest_lingering(&count)) != NULL
+           && (linger_timeout == 0 || (linger_max && count > linger_max))) {
+        finalize_provider(prov);
+    }
+}
+
+ck_rv_t pakchois_set_linger(unsigned int timeout, unsigned int max_idle)
+{
+    if (pthread_mutex_lock(&provider_mutex)) {
+        return CKR_CANT_LOCK;
+    }
+
+    linger_timeout = timeout;
+    linger_max = max_idle;
+
+    if (linger_timeout && !linger_running) {
+        if (monotonic_cond_init(&linger_cond)) {
+            pthread_mutex_unlock(&provider_mutex);
+            return CKR_GENERAL_ERROR;
+        }
+        if (pthread_create(&linger_thread, NULL, linger_reaper, NULL)) {
+            pthread_cond_destroy(&linger_cond);
+            pthread_mutex_unlock(&provider_mutex);
+            return CKR_GENERAL_ERROR;
+        }
+        linger_running = 1;
+    }
+
+    enforce_linger();
+
+    if (linger_running) {
+        pthread_cond_signal(&linger_cond);
+    }
+
+    pthread_mutex_unlock(&provider_mutex);
+    return CKR_OK;
+}
+
+/* Unreference a provider structure and unload it, if necessary.
+ * Must be called WIHTOUT the provider mutex held.  */
 static void provider_unref(struct provider *prov)
 {
+    if (__atomic_sub_fetch(&prov->refcount, 1, __ATOMIC_ACQ_REL)) {
+        return;
+    }
+
     /* Not sure whether to fail silently or abort() here... either
      * choice equally ugly. */
     if (pthread_mutex_lock(&provider_mutex)) {
         abort();
     }
 
-    if (--prov->refcount == 0) {
-        prov->fns->C_Finalize(NULL);
-        dlclose(prov->handle);
-        *prov->prevref = prov->next;
-        if (prov->next) {
-            prov->next->prevref = prov->prevref;
-        }
-        free(prov->name);
-        free(prov);
+    /* The provider may have been referenced again, or already
+     * unloaded by another thread, before the mutex was acquired. */
+    if (__atomic_load_n(&prov->refcount, __ATOMIC_ACQUIRE)
+        || prov->state != PROVIDER_READY) {
+        pthread_mutex_unlock(&provider_mutex);
+        return;
+    }
+
+    if (linger_timeout) {
+        /* Leave it loaded for reuse; the reaper thread will finalize
+         * it after the timeout. */
+        prov->idle_since = monotonic_now();
+        enforce_linger();
+        pthread_cond_signal(&linger_cond);
+    }
+    else {
+        finalize_provider(prov);
     }
+
     pthread_mutex_unlock(&provider_mutex);
 }
 
+static ck_rv_t close_slot_sessions(struct slot *slot);
+static void flush_slot_caches(struct slot *slot);
+static void invalidate_slot(pakchois_module_t *mod, ck_slot_id_t id);
+static void note_presence(pakchois_module_t *mod, ck_slot_id_t id,
+                          ck_rv_t rv, const struct ck_token_info *info);
+static int info_changed(int token, const struct info_cache *old,
+                        const struct info_cache *new);
+static int attr_cache_get(struct slot *slot, ck_object_handle_t object,
+                          struct ck_attribute *templ, unsigned long count,
+                          unsigned long *generation, unsigned long *changes,
+                          ck_rv_t *rv);
+static void attr_cache_put(pakchois_session_t *sess,
+                           ck_object_handle_t object,
+                           const struct ck_attribute *templ,
+                           unsigned long count, unsigned long generation,
+                           unsigned long changes);
+static void attr_cache_forget(struct slot *slot, ck_object_handle_t object);
+static void len_forget(struct slot *slot, ck_object_handle_t key);
+static void free_attr_cache(struct attr_cache *ac);
+static void index_add(pakchois_session_t *sess, ck_object_handle_t handle);
+static void index_forget(struct slot *slot, ck_object_handle_t handle);
+static void free_object_index(struct object_index *idx);
+static void cert_forget(struct slot *slot, ck_object_handle_t handle,
+                        int added);
+static void free_cert_index(struct cert_index *ci);
+static struct mech_cache *snap_mechs(pakchois_module_t *mod,
+                                     struct slot *slot,
+                                     unsigned long *generation);
+static void snap_objects(pakchois_session_t *sess);
+static void detach_module(pakchois_module_t *mod);
+static ck_rv_t wait_dispatched_event(pakchois_module_t *mod, ck_flags_t flags,
+                                     ck_slot_id_t *slot);
+
 void pakchois_module_destroy(pakchois_module_t *mod)
 {
-    while (mod->slots) {
-        struct slot *slot = mod->slots;
-        pakchois_close_all_sessions(mod, slot->id);
-        mod->slots = slot->next;
-        free(slot);
+    struct slot *slot;
+
+    detach_module(mod);
+
+    for (slot = mod->slots; slot; slot = slot->next) {
+        close_slot_sessions(slot);
+        slab_destroy(&slot->session_slab);
+        flush_slot_caches(slot);
+        free_cert_index(slot->certs);
+        pthread_rwlock_destroy(&slot->cache_lock);
+        pthread_mutex_destroy(&slot->mutex);
+    }
+
+    slab_destroy(&mod->slot_slab);
+    pthread_rwlock_destroy(&mod->slots_lock);
+    pk_free(mod->slot_hash);
+
+    if (mod->snapshot) {
+        munmap((void *)mod->snapshot, mod->snapshot_len);
     }
 
     provider_unref(mod->provider);
 
-    free(mod);
+    pk_free(mod);
 }
 
 #ifdef __GNUC__
@@ -328,6 +1266,50 @@ static void pakchois_destructor(void)
 
 static void pakchois_destructor(void)
 {
+    unsigned int n;
+
+    /* Lingering providers are not finalized here, since their DSOs
+     * may already have been unloaded; just stop the reaper. */
+    pthread_mutex_lock(&provider_mutex);
+    linger_shutdown = 1;
+    if (linger_running) {
+        pthread_cond_signal(&linger_cond);
+    }
+    pthread_mutex_unlock(&provider_mutex);
+
+    if (linger_running) {
+        pthread_join(linger_thread, NULL);
+        pthread_cond_destroy(&linger_cond);
+    }
+
+    while (modpath_cache) {
+        struct modpath *mp = modpath_cache;
+
+        modpath_cache = mp->next;
+        free(mp->name);
+        free(mp->path);
+        free(mp);
+    }
+    free(modpath_file);
+
+    for (n = 0; n < PROVIDER_BUCKETS; n++) {
+        while (provider_table[n]) {
+            struct provider *prov = provider_table[n];
+
+            provider_table[n] = prov->next;
+            /* A lingering provider may still have a dispatcher
+             * thread blocked in the provider; leak it. */
+            if (prov->dispatching) {
+                continue;
+            }
+            pthread_cond_destroy(&prov->event_cond);
+            pthread_mutex_destroy(&prov->mutex);
+            free(prov);
+        }
+    }
+
+    pthread_mutex_destroy(&modpath_mutex);
+    pthread_cond_destroy(&provider_cond);
     pthread_mutex_destroy(&provider_mutex);
 }
 #else
@@ -358,22 +1340,22 @@ ck_rv_t pakchois_get_token_info(pakchois_module_t *mod,
 				ck_slot_id_t slot_id,
 				struct ck_token_info *info)
 {
-    return CALL(GetTokenInfo, (slot_id, info));
+    ck_rv_t rv = CALL(GetTokenInfo, (slot_id, info));
+
+    note_presence(mod, slot_id, rv, rv == CKR_OK ? info : NULL);
+
+    return rv;
 }
 
 ck_rv_t pakchois_wait_for_slot_event(pakchois_module_t *mod,
 				     ck_flags_t flags, ck_slot_id_t *slot,
 				     void *reserved)
 {
-    ck_rv_t rv;
-
-    if (pthread_mutex_lock(&mod->provider->mutex)) {
-        return CKR_CANT_LOCK;
+    if (reserved != NULL) {
+        return CKR_ARGUMENTS_BAD;
     }
-        
-    rv = CALL(WaitForSlotEvent, (flags, slot, reserved));
-    pthread_mutex_unlock(&mod->provider->mutex);
-    return rv;
+
+    return wait_dispatched_event(mod, flags, slot);
 }
 
 ck_rv_t pakchois_get_mechanism_list(pakchois_module_t *mod,
@@ -420,17 +1402,87 @@ static ck_rv_t notify_thunk(ck_session_handle_t session,
     return sess->notify(sess, event, sess->notify_data);
 }
 
-static struct slot *find_slot(pakchois_module_t *mod, ck_slot_id_t id)
+static unsigned int slot_bucket(pakchois_module_t *mod, ck_slot_id_t id)
+{
+    return (unsigned int)((id * 2654435761UL) >> 7) 
+        & (mod->slot_hash_size - 1);
+}
+
+/* Find the slot object for the given id, if the id is not dense.
+ * Must be called with the module's slots_lock held. */
+static struct slot *lookup_slot(pakchois_module_t *mod, ck_slot_id_t id)
 {
     struct slot *slot;
 
-    for (slot = mod->slots; slot; slot = slot->next)
+    if (mod->slot_hash == NULL) {
+        return NULL;
+    }
+
+    for (slot = mod->slot_hash[slot_bucket(mod, id)]; slot; 
+         slot = slot->hnext)
         if (slot->id == id)
             return slot;
 
     return NULL;
 }
 
+static struct slot *find_slot(pakchois_module_t *mod, ck_slot_id_t id)
+{
+    struct slot *slot;
+
+    if (id < SLOT_DENSE) {
+        return __atomic_load_n(&mod->slot_dense[id], __ATOMIC_ACQUIRE);
+    }
+
+    if (pthread_rwlock_rdlock(&mod->slots_lock)) {
+        return NULL;
+    }
+    slot = lookup_slot(mod, id);
+    pthread_rwlock_unlock(&mod->slots_lock);
+
+    return slot;
+}
+
+/* Add a slot with a non-dense id to the hash table, growing the table
+ * as necessary.  Must be called with the module's slots_lock held
+ * for writing.  Returns non-zero on allocation failure. */
+static int hash_slot(pakchois_module_t *mod, struct slot *slot)
+{
+    unsigned int bucket;
+
+    if (mod->slot_hash_count >= mod->slot_hash_size) {
+        unsigned int n, oldsize = mod->slot_hash_size;
+        struct slot **old = mod->slot_hash, *s, *next;
+
+        mod->slot_hash_size = oldsize ? oldsize * 2 : 16;
+        mod->slot_hash = pk_calloc(mod->slot_hash_size, sizeof *old);
+        if (mod->slot_hash == NULL) {
+            mod->slot_hash = old;
+            mod->slot_hash_size = oldsize;
+            if (old == NULL) {
+                return -1;
+            }
+        }
+        else {
+            for (n = 0; n < oldsize; n++) {
+                for (s = old[n]; s; s = next) {
+                    next = s->hnext;
+                    bucket = slot_bucket(mod, s->id);
+                    s->hnext = mod->slot_hash[bucket];
+                    mod->slot_hash[bucket] = s;
+                }
+            }
+            pk_free(old);
+        }
+    }
+
+    bucket = slot_bucket(mod, slot->id);
+    slot->hnext = mod->slot_hash[bucket];
+    mod->slot_hash[bucket] = slot;
+    mod->slot_hash_count++;
+    return 0;
+}
+
 static struct slot *find_or_create_slot(pakchois_module_t *mod,
                                         ck_slot_id_t id)
 {
@@ -440,37 +1492,72 @@ static struct slot *find_or_create_slot(pakchois_module_t *mod,
         return slot;
     }
 
-    slot = malloc(sizeof *slot);
-    if (!slot) {
+    if (pthread_rwlock_wrlock(&mod->slots_lock)) {
         return NULL;
     }
+
+    /* Another thread may have created the slot in the meantime. */
+    slot = id < SLOT_DENSE ? mod->slot_dense[id] : lookup_slot(mod, id);
+    if (slot) {
+        goto out;
+    }
+
+    slot = slab_alloc(&mod->slot_slab);
+    if (!slot) {
+        goto out;
+    }
+
+    if (pthread_mutex_init(&slot->mutex, NULL)) {
+        slab_free(&mod->slot_slab, slot);
+        slot = NULL;
+        goto out;
+    }
+
+    if (pthread_rwlock_init(&slot->cache_lock, NULL)) {
+        pthread_mutex_destroy(&slot->mutex);
+        slab_free(&mod->slot_slab, slot);
+        slot = NULL;
+        goto out;
+    }
     
     slot->id = id;
-    slot->sessions = NULL;
+    slab_init(&slot->session_slab, sizeof(pakchois_session_t));
+
+    if (id >= SLOT_DENSE && hash_slot(mod, slot)) {
+        pthread_rwlock_destroy(&slot->cache_lock);
+        pthread_mutex_destroy(&slot->mutex);
+        slab_free(&mod->slot_slab, slot);
+        slot = NULL;
+        goto out;
+    }
+
     slot->next = mod->slots;
     mod->slots = slot;
 
+    if (id < SLOT_DENSE) {
+        __atomic_store_n(&mod->slot_dense[id], slot, __ATOMIC_RELEASE);
+    }
+
+out:
+    pthread_rwlock_unlock(&mod->slots_lock);
     return slot;
 }
 
-static ck_rv_t insert_session(pakchois_module_t *mod,
-                              pakchois_session_t *session,
-                              ck_slot_id_t id)
+static void insert_session(struct slot *slot, pakchois_session_t *session)
 {
-    struct slot *slot = find_or_create_slot(mod, id);
-    
-    if (!slot) {
-        return CKR_HOST_MEMORY;
+    if (pthread_mutex_lock(&slot->mutex)) {
+        abort();
     }
 
+    session->slot = slot;
     session->prevref = &slot->sessions;
     session->next = slot->sessions;
     if (session->next) {
-        session->next->prevref = session->prevref;
+        session->next->prevref = &session->next;
     }
     slot->sessions = session;
 
-    return CKR_OK;
+    pthread_mutex_unlock(&slot->mutex);
 }
 
 ck_rv_t pakchois_open_session(pakchois_module_t *mod,
@@ -480,16 +1567,33 @@ ck_rv_t pakchois_open_session(pakchois_module_t *mod,
 {
     ck_session_handle_t sh;
     pakchois_session_t *sess;
+    struct slot *slot;
     ck_rv_t rv;
 
-    sess = calloc(1, sizeof *sess);
+    slot = find_or_create_slot(mod, slot_id);
+    if (slot == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_mutex_lock(&slot->mutex)) {
+        return CKR_CANT_LOCK;
+    }
+    sess = slab_alloc(&slot->session_slab);
+    pthread_mutex_unlock(&slot->mutex);
     if (sess == NULL) {
         return CKR_HOST_MEMORY;
     }    
 
     rv = CALL(OpenSession, (slot_id, flags, sess, notify_thunk, &sh));
+    if (TOKEN_MISSING(rv)) {
+        note_presence(mod, slot_id, rv, NULL);
+    }
     if (rv != CKR_OK) {
-        free(sess);
+        if (pthread_mutex_lock(&slot->mutex)) {
+            abort();
+        }
+        slab_free(&slot->session_slab, sess);
+        pthread_mutex_unlock(&slot->mutex);
         return rv;
     }
     
@@ -497,7 +1601,8 @@ ck_rv_t pakchois_open_session(pakchois_module_t *mod,
     sess->module = mod;
     sess->id = sh;
 
-    return insert_session(mod, sess, slot_id);
+    insert_session(slot, sess);
+    return CKR_OK;
 }
 
 ck_rv_t pakchois_close_session(pakchois_session_t *sess)
@@ -505,28 +1610,39 @@ ck_rv_t pakchois_close_session(pakchois_session_t *sess)
     /* PKCS#11 says that all bets are off on failure, so destroy the
      * session object and just return the error code. */
     ck_rv_t rv = CALLS(CloseSession, (sess->id));
+    struct slot *slot = sess->slot;
+
+    if (pthread_mutex_lock(&slot->mutex)) {
+        abort();
+    }
     *sess->prevref = sess->next;
     if (sess->next) {
         sess->next->prevref = sess->prevref;
     }
-    free(sess);
+    slab_free(&slot->session_slab, sess);
+    pthread_mutex_unlock(&slot->mutex);
+
     return rv;
 }
 
-ck_rv_t pakchois_close_all_sessions(pakchois_module_t *mod,
-				    ck_slot_id_t slot_id)
+static ck_rv_t close_slot_sessions(struct slot *slot)
 {
-    struct slot *slot;
     ck_rv_t rv, frv = CKR_OK;
 
-    slot = find_slot(mod, slot_id);
+    for (;;) {
+        pakchois_session_t *sess;
 
-    if (!slot) {
-        return CKR_SLOT_ID_INVALID;
-    }
+        if (pthread_mutex_lock(&slot->mutex)) {
+            return CKR_CANT_LOCK;
+        }
+        sess = slot->sessions;
+        pthread_mutex_unlock(&slot->mutex);
+
+        if (sess == NULL) {
+            break;
+        }
 
-    while (slot->sessions) {
-        rv = pakchois_close_session(slot->sessions);
+        rv = pakchois_close_session(sess);
         if (rv != CKR_OK) {
             frv = rv;
         }
@@ -535,6 +1651,20 @@ ck_rv_t pakchois_close_all_sessions(pakchois_module_t *mod,
     return frv;
 }
 
+ck_rv_t pakchois_close_all_sessions(pakchois_module_t *mod,
+				    ck_slot_id_t slot_id)
+{
+    struct slot *slot;
+
+    slot = find_slot(mod, slot_id);
+
+    if (!slot) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    return close_slot_sessions(slot);
+}
+
 ck_rv_t pakchois_get_session_info(pakchois_session_t *sess,
 				  struct ck_session_info *info)
 {
@@ -562,12 +1692,39 @@ ck_rv_t pakchois_set_operation_state(pakchois_session_t *sess,
 ck_rv_t pakchois_login(pakchois_session_t *sess, ck_user_type_t user_type,
 		       unsigned char *pin, unsigned long pin_len)
 {
-    return CALLS3(Login, user_type, pin, pin_len);
+    ck_rv_t rv = CALLS3(Login, user_type, pin, pin_len);
+
+    /* Private objects are now visible. */
+    if (rv == CKR_OK && user_type != CKU_CONTEXT_SPECIFIC) {
+        index_forget(sess->slot, CK_INVALID_HANDLE);
+        cert_forget(sess->slot, CK_INVALID_HANDLE, 1);
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_logout(pakchois_session_t *sess)
 {
-    return CALLS(Logout, (sess->id));
+    ck_rv_t rv = CALLS(Logout, (sess->id));
+
+    if (rv == CKR_OK) {
+        index_forget(sess->slot, CK_INVALID_HANDLE);
+        cert_forget(sess->slot, CK_INVALID_HANDLE, 1);
+    }
+
+    return rv;
+}
+
+/* Called for each new object handle returned by the provider.  The
+ * handle of an object destroyed behind our back may have been
+ * reused, so anything cached for it is discarded. */
+static void object_created(pakchois_session_t *sess,
+                           ck_object_handle_t handle)
+{
+    attr_cache_forget(sess->slot, handle);
+    len_forget(sess->slot, handle);
+    index_add(sess, handle);
+    cert_forget(sess->slot, handle, 1);
 }
 
 ck_rv_t pakchois_create_object(pakchois_session_t *sess,
@@ -575,7 +1732,13 @@ ck_rv_t pakchois_create_object(pakchois_session_t *sess,
 			       unsigned long count,
 			       ck_object_handle_t *object)
 {
-    return CALLS3(CreateObject, templ, count, object);
+    ck_rv_t rv = CALLS3(CreateObject, templ, count, object);
+
+    if (rv == CKR_OK) {
+        object_created(sess, *object);
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_copy_object(pakchois_session_t *sess,
@@ -583,17 +1746,32 @@ ck_rv_t pakchois_copy_object(pakchois_session_t *sess,
 			     struct ck_attribute *templ, unsigned long count,
 			     ck_object_handle_t *new_object)
 {
-    return CALLS4(CopyObject, object, templ, count, new_object);
+    ck_rv_t rv = CALLS4(CopyObject, object, templ, count, new_object);
+
+    if (rv == CKR_OK) {
+        object_created(sess, *new_object);
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_destroy_object(pakchois_session_t *sess,
 				ck_object_handle_t object)
 {
-    return CALLS1(DestroyObject, object);
-}    
+    ck_rv_t rv = CALLS1(DestroyObject, object);
 
-ck_rv_t pakchois_get_object_size(pakchois_session_t *sess,
-				 ck_object_handle_t object,
+    if (rv == CKR_OK || rv == CKR_OBJECT_HANDLE_INVALID) {
+        attr_cache_forget(sess->slot, object);
+        len_forget(sess->slot, object);
+        index_forget(sess->slot, object);
+        cert_forget(sess->slot, object, 0);
+    }
+
+    return rv;
+}
+
+ck_rv_t pakchois_get_object_size(pakchois_session_t *sess,
+				 ck_object_handle_t object,
 				 unsigned long *size)
 {
     return CALLS2(GetObjectSize, object, size);
@@ -604,7 +1782,27 @@ ck_rv_t pakchois_get_attribute_value(pakchois_session_t *sess,
 				     struct ck_attribute *templ,
 				     unsigned long count)
 {
-    return CALLS3(GetAttributeValue, object, templ, count);
+    unsigned long generation, changes;
+    ck_rv_t rv;
+
+    if (__atomic_load_n(&sess->slot->attr_caching, __ATOMIC_RELAXED)) {
+        snap_objects(sess);
+    }
+
+    if (attr_cache_get(sess->slot, object, templ, count, &generation,
+                       &changes, &rv)) {
+        return rv;
+    }
+
+    rv = CALLS3(GetAttributeValue, object, templ, count);
+
+    /* Attributes are still returned if some are unavailable. */
+    if (rv == CKR_OK || rv == CKR_ATTRIBUTE_SENSITIVE
+        || rv == CKR_ATTRIBUTE_TYPE_INVALID || rv == CKR_BUFFER_TOO_SMALL) {
+        attr_cache_put(sess, object, templ, count, generation, changes);
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_set_attribute_value(pakchois_session_t *sess,
@@ -612,7 +1810,29 @@ ck_rv_t pakchois_set_attribute_value(pakchois_session_t *sess,
 				     struct ck_attribute *templ,
 				     unsigned long count)
 {
-    return CALLS3(SetAttributeValue, object, templ, count);
+    ck_rv_t rv = CALLS3(SetAttributeValue, object, templ, count);
+    unsigned long n;
+
+    /* Some attributes may have been changed even on failure. */
+    attr_cache_forget(sess->slot, object);
+
+    for (n = 0; n < count; n++) {
+        if (templ[n].type == CKA_ID || templ[n].type == CKA_LABEL) {
+            index_forget(sess->slot, object);
+            index_add(sess, object);
+            break;
+        }
+    }
+
+    for (n = 0; n < count; n++) {
+        if (templ[n].type == CKA_SUBJECT || templ[n].type == CKA_ISSUER
+            || templ[n].type == CKA_SERIAL_NUMBER) {
+            cert_forget(sess->slot, object, 1);
+            break;
+        }
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_find_objects_init(pakchois_session_t *sess,
@@ -859,7 +2079,13 @@ ck_rv_t pakchois_generate_key(pakchois_session_t *sess,
 			      struct ck_attribute *templ,
 			      unsigned long count, ck_object_handle_t *key)
 {
-    return CALLS4(GenerateKey, mechanism, templ, count, key);
+    ck_rv_t rv = CALLS4(GenerateKey, mechanism, templ, count, key);
+
+    if (rv == CKR_OK) {
+        object_created(sess, *key);
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_generate_key_pair(pakchois_session_t *sess,
@@ -871,10 +2097,17 @@ ck_rv_t pakchois_generate_key_pair(pakchois_session_t *sess,
 				   ck_object_handle_t *public_key,
 				   ck_object_handle_t *private_key)
 {
-    return CALLS7(GenerateKeyPair, mechanism,
-                  public_key_template, public_key_attribute_count,
-                  private_key_template, private_key_attribute_count,
-                  public_key, private_key);
+    ck_rv_t rv = CALLS7(GenerateKeyPair, mechanism,
+                        public_key_template, public_key_attribute_count,
+                        private_key_template, private_key_attribute_count,
+                        public_key, private_key);
+
+    if (rv == CKR_OK) {
+        object_created(sess, *public_key);
+        object_created(sess, *private_key);
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_wrap_key(pakchois_session_t *sess,
@@ -896,9 +2129,15 @@ ck_rv_t pakchois_unwrap_key(pakchois_session_t *sess,
 			    unsigned long attribute_count,
 			    ck_object_handle_t *key)
 {
-    return CALLS7(UnwrapKey, mechanism, unwrapping_key, 
-                  wrapped_key, wrapped_key_len, templ, attribute_count,
-                  key);
+    ck_rv_t rv = CALLS7(UnwrapKey, mechanism, unwrapping_key,
+                        wrapped_key, wrapped_key_len, templ, attribute_count,
+                        key);
+
+    if (rv == CKR_OK) {
+        object_created(sess, *key);
+    }
+
+    return rv;
 }
 
 ck_rv_t pakchois_derive_key(pakchois_session_t *sess,
@@ -908,7 +2147,14 @@ ck_rv_t pakchois_derive_key(pakchois_session_t *sess,
 			    unsigned long attribute_count,
 			    ck_object_handle_t *key)
 {
-    return CALLS5(DeriveKey, mechanism, base_key, templ, attribute_count, key);
+    ck_rv_t rv = CALLS5(DeriveKey, mechanism, base_key, templ,
+                        attribute_count, key);
+
+    if (rv == CKR_OK) {
+        object_created(sess, *key);
+    }
+
+    return rv;
 }
 
 
@@ -924,3 +2170,5384 @@ ck_rv_t pakchois_generate_random(pakchois_session_t *sess,
 {
     return CALLS2(GenerateRandom, random_data, random_len);
 }
+
+/* Session pools. */
+
+/* Upper bound on the size of a pool sized from the token's
+ * max_session_count. */
+#define POOL_MAX_SESSIONS (64)
+
+struct pool_entry {
+    pakchois_session_t *session;
+    time_t idle_since;
+};
+
+struct pakchois_session_pool_s {
+    pakchois_module_t *module;
+    ck_slot_id_t slot_id;
+    struct pakchois_pool_params params;
+
+    /* Stored credentials, used to log in again if every session in
+     * the pool has been closed in the meantime. */
+    ck_user_type_t user_type;
+    unsigned char *pin;
+    unsigned long pin_len;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+
+    /* Stack of idle sessions; idle[nidle - 1] is the most recently
+     * released, so the least recently used sessions sit at the bottom
+     * of the stack and are the first to be reaped. */
+    struct pool_entry *idle;
+    unsigned int nidle;
+
+    /* Number of sessions owned by the pool: idle, checked out, or
+     * being opened. */
+    unsigned int total;
+
+    /* Non-zero while the first session is being opened and logged
+     * in; other acquirers wait for it rather than opening sessions
+     * which would not yet be logged in. */
+    int logging_in;
+};
+
+/* Open a new session for the pool.  If first is non-zero, no other
+ * pool session is open to hold the login state, so log in using the
+ * stored credentials, if any.  Must be called WITHOUT the pool mutex
+ * held.  The stored credentials are only replaced while a pool
+ * session is checked out, so cannot change while the first session
+ * is being opened. */
+static ck_rv_t pool_open(pakchois_session_pool_t *pool,
+                         pakchois_session_t **session, int first)
+{
+    ck_rv_t rv;
+
+    rv = pakchois_open_session(pool->module, pool->slot_id,
+                               pool->params.flags | CKF_SERIAL_SESSION,
+                               NULL, NULL, session);
+    if (rv != CKR_OK || !first || pool->pin == NULL) {
+        return rv;
+    }
+
+    rv = pakchois_login(*session, pool->user_type,
+                        pool->pin, pool->pin_len);
+    if (rv == CKR_USER_ALREADY_LOGGED_IN) {
+        rv = CKR_OK;
+    }
+
+    if (rv != CKR_OK) {
+        pakchois_close_session(*session);
+    }
+
+    return rv;
+}
+
+/* Remove and return the least recently used idle session if it has
+ * exceeded the idle timeout and the pool holds more than
+ * min_sessions, otherwise return NULL.  Must be called with the pool
+ * mutex held. */
+static pakchois_session_t *pool_expired(pakchois_session_pool_t *pool)
+{
+    pakchois_session_t *sess;
+
+    if (pool->params.idle_timeout == 0 || pool->nidle == 0
+        || pool->total <= pool->params.min_sessions
+        || monotonic_now() - pool->idle[0].idle_since 
+           < (time_t)pool->params.idle_timeout) {
+        return NULL;
+    }
+
+    sess = pool->idle[0].session;
+    pool->nidle--;
+    pool->total--;
+    memmove(&pool->idle[0], &pool->idle[1],
+            pool->nidle * sizeof pool->idle[0]);
+    return sess;
+}
+
+ck_rv_t pakchois_session_pool_create(pakchois_session_pool_t **pool,
+                                     pakchois_module_t *module,
+                                     ck_slot_id_t slot_id,
+                                     const struct pakchois_pool_params *params)
+{
+    pakchois_session_pool_t *p;
+    unsigned int max = params->max_sessions;
+    ck_rv_t rv = CKR_OK;
+
+    if (max == 0) {
+        /* Size the pool to the token's limit. */
+        struct ck_token_info info;
+
+        rv = pakchois_get_cached_token_info(module, slot_id, &info, NULL);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+        
+        if (info.max_session_count == CK_EFFECTIVELY_INFINITE
+            || info.max_session_count == CK_UNAVAILABLE_INFORMATION
+            || info.max_session_count > POOL_MAX_SESSIONS) {
+            max = POOL_MAX_SESSIONS;
+        }
+        else {
+            max = info.max_session_count;
+        }
+    }
+
+    if (params->min_sessions > max) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    p = pk_calloc(1, sizeof *p);
+    if (p == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    p->idle = pk_calloc(max, sizeof *p->idle);
+    if (p->idle == NULL) {
+        pk_free(p);
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_mutex_init(&p->mutex, NULL)) {
+        rv = CKR_GENERAL_ERROR;
+        goto fail_idle;
+    }
+
+    if (monotonic_cond_init(&p->cond)) {
+        rv = CKR_GENERAL_ERROR;
+        goto fail_mutex;
+    }
+
+    p->module = module;
+    p->slot_id = slot_id;
+    p->params = *params;
+    p->params.max_sessions = max;
+
+    /* Pre-open the minimum number of sessions. */
+    while (p->total < p->params.min_sessions) {
+        rv = pool_open(p, &p->idle[p->nidle].session, 0);
+        if (rv != CKR_OK) {
+            pakchois_session_pool_destroy(p);
+            return rv;
+        }
+        p->idle[p->nidle++].idle_since = monotonic_now();
+        p->total++;
+    }
+
+    *pool = p;
+    return CKR_OK;
+fail_mutex:
+    pthread_mutex_destroy(&p->mutex);
+fail_idle:
+    pk_free(p->idle);
+    pk_free(p);
+    return rv;
+}
+
+ck_rv_t pakchois_session_pool_login(pakchois_session_pool_t *pool,
+                                    ck_user_type_t user_type,
+                                    unsigned char *pin, 
+                                    unsigned long pin_len)
+{
+    pakchois_session_t *sess;
+    unsigned char *copy;
+    ck_rv_t rv;
+
+    copy = pk_malloc(pin_len + 1);
+    if (copy == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+    if (pin_len) {
+        memcpy(copy, pin, pin_len);
+    }
+
+    rv = pakchois_session_pool_acquire(pool, &sess);
+    if (rv != CKR_OK) {
+        pk_free(copy);
+        return rv;
+    }
+
+    rv = pakchois_login(sess, user_type, pin, pin_len);
+    if (rv == CKR_USER_ALREADY_LOGGED_IN) {
+        rv = CKR_OK;
+    }
+
+    if (pthread_mutex_lock(&pool->mutex)) {
+        abort();
+    }
+    if (rv == CKR_OK) {
+        if (pool->pin) {
+            memset(pool->pin, 0, pool->pin_len);
+            pk_free(pool->pin);
+        }
+        pool->user_type = user_type;
+        pool->pin = copy;
+        pool->pin_len = pin_len;
+    }
+    else {
+        memset(copy, 0, pin_len);
+        pk_free(copy);
+    }
+    pthread_mutex_unlock(&pool->mutex);
+
+    pakchois_session_pool_release(pool, sess);
+    return rv;
+}
+
+ck_rv_t pakchois_session_pool_acquire(pakchois_session_pool_t *pool,
+                                      pakchois_session_t **session)
+{
+    struct timespec deadline;
+    ck_rv_t rv = CKR_OK;
+
+    if (pool->params.wait_timeout > 0) {
+        monotonic_deadline(&deadline, pool->params.wait_timeout);
+    }
+
+    if (pthread_mutex_lock(&pool->mutex)) {
+        return CKR_CANT_LOCK;
+    }
+
+    for (;;) {
+        if (pool->nidle) {
+            *session = pool->idle[--pool->nidle].session;
+            break;
+        }
+
+        if (pool->logging_in) {
+            /* Wait for the first session to be logged in, however
+             * long that takes, since the pool is not exhausted. */
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+            continue;
+        }
+        
+        if (pool->total < pool->params.max_sessions) {
+            int first = pool->total++ == 0;
+
+            pool->logging_in = first && pool->pin != NULL;
+
+            /* Open the new session without holding the mutex, so
+             * that other threads can release and acquire sessions
+             * in the meantime; the increment of total above
+             * reserves its place in the pool. */
+            pthread_mutex_unlock(&pool->mutex);
+            rv = pool_open(pool, session, first);
+            if (pthread_mutex_lock(&pool->mutex)) {
+                abort();
+            }
+
+            if (pool->logging_in) {
+                pool->logging_in = 0;
+                pthread_cond_broadcast(&pool->cond);
+            }
+
+            if (rv == CKR_OK) {
+                break;
+            }
+
+            pool->total--;
+            pthread_cond_signal(&pool->cond);
+
+            /* If the token has run out of sessions, wait for one of
+             * ours to be released like any other exhausted pool. */
+            if (rv != CKR_SESSION_COUNT || pool->total == 0) {
+                break;
+            }
+            rv = CKR_OK;
+        }
+
+        if (pool->params.wait_timeout == 0) {
+            rv = CKR_SESSION_COUNT;
+            break;
+        }
+        else if (pool->params.wait_timeout < 0) {
+            pthread_cond_wait(&pool->cond, &pool->mutex);
+        }
+        else if (pthread_cond_timedwait(&pool->cond, &pool->mutex,
+                                        &deadline) == ETIMEDOUT) {
+            rv = CKR_SESSION_COUNT;
+            break;
+        }
+    }
+
+    pthread_mutex_unlock(&pool->mutex);
+    return rv;
+}
+
+void pakchois_session_pool_release(pakchois_session_pool_t *pool,
+                                   pakchois_session_t *session)
+{
+    if (pthread_mutex_lock(&pool->mutex)) {
+        abort();
+    }
+
+    pool->idle[pool->nidle].session = session;
+    pool->idle[pool->nidle++].idle_since = monotonic_now();
+    pthread_cond_signal(&pool->cond);
+
+    pthread_mutex_unlock(&pool->mutex);
+
+    pakchois_session_pool_reap(pool);
+}
+
+void pakchois_session_pool_discard(pakchois_session_pool_t *pool,
+                                   pakchois_session_t *session)
+{
+    pakchois_close_session(session);
+
+    if (pthread_mutex_lock(&pool->mutex)) {
+        abort();
+    }
+
+    pool->total--;
+    pthread_cond_signal(&pool->cond);
+
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+void pakchois_session_pool_reap(pakchois_session_pool_t *pool)
+{
+    pakchois_session_t *sess;
+
+    /* Close expired sessions one at a time, so the mutex is not held
+     * across the calls into the provider. */
+    for (;;) {
+        if (pthread_mutex_lock(&pool->mutex)) {
+            abort();
+        }
+        sess = pool_expired(pool);
+        pthread_mutex_unlock(&pool->mutex);
+
+        if (sess == NULL) {
+            break;
+        }
+
+        pakchois_close_session(sess);
+    }
+}
+
+void pakchois_session_pool_destroy(pakchois_session_pool_t *pool)
+{
+    while (pool->nidle) {
+        pakchois_close_session(pool->idle[--pool->nidle].session);
+    }
+
+    if (pool->pin) {
+        memset(pool->pin, 0, pool->pin_len);
+        pk_free(pool->pin);
+    }
+
+    pthread_cond_destroy(&pool->cond);
+    pthread_mutex_destroy(&pool->mutex);
+    pk_free(pool->idle);
+    pk_free(pool);
+}
+
+/* Slot caches. */
+
+/* Discard all cached token state for a slot.  Must be called with the
+ * slot's cache_lock held for writing (or with the module otherwise
+ * unused). */
+static void flush_slot_caches(struct slot *slot)
+{
+    if (slot->mechs) {
+        pk_free(slot->mechs->types);
+        pk_free(slot->mechs->info);
+        pk_free(slot->mechs->table);
+        pk_free(slot->mechs);
+        slot->mechs = NULL;
+    }
+
+    slot->slot_info.valid = slot->token_info.valid = 0;
+
+    pk_free(slot->lens);
+    slot->lens = NULL;
+
+    free_attr_cache(slot->attrs);
+    slot->attrs = NULL;
+
+    free_object_index(slot->index);
+    slot->index = NULL;
+
+    /* The token now in the slot may match the snapshot. */
+    __atomic_store_n(&slot->snap_state, 0, __ATOMIC_RELAXED);
+}
+
+/* Called when a slot event is seen for the given slot id: the token
+ * may have been inserted, removed or replaced, so discard anything
+ * cached about it. */
+static void invalidate_slot(pakchois_module_t *mod, ck_slot_id_t id)
+{
+    struct slot *slot = find_slot(mod, id);
+
+    if (slot == NULL || pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+
+    flush_slot_caches(slot);
+    slot->generation++;
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+/* Called with the result of a call which tells whether a token is
+ * present in the given slot, and the token information if the call
+ * returned it.  If the slot is known to have held a token and now
+ * does not, or the reverse, or the information shows a different
+ * token, its caches are discarded as by invalidate_slot().  An absent
+ * token, or the information given, is recorded in the cached token
+ * information, so repeated calls do not invalidate the slot again. */
+static void note_presence(pakchois_module_t *mod, ck_slot_id_t id,
+                          ck_rv_t rv, const struct ck_token_info *info)
+{
+    struct slot *slot = find_slot(mod, id);
+    struct info_cache *ic, fresh;
+    int missing = TOKEN_MISSING(rv);
+
+    if (slot == NULL || (rv != CKR_OK && !missing)
+        || pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+
+    memset(&fresh, 0, sizeof fresh);
+    fresh.valid = 1;
+    fresh.rv = rv;
+    fresh.fetched = monotonic_now();
+    if (info && !missing) {
+        fresh.u.token = *info;
+    }
+
+    ic = &slot->token_info;
+    if (ic->valid && (TOKEN_MISSING(ic->rv) != missing
+                      || (info && info_changed(1, ic, &fresh)))) {
+        flush_slot_caches(slot);
+        slot->generation++;
+    }
+    if (missing || info) {
+        *ic = fresh;
+    }
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+static unsigned int mech_hash(ck_mechanism_type_t type, unsigned int size)
+{
+    return (unsigned int)((type * 2654435761UL) >> 5) & (size - 1);
+}
+
+/* Returns the index of the given mechanism type in the cache, or -1
+ * if the mechanism is not supported. */
+static long mech_lookup(const struct mech_cache *mc, ck_mechanism_type_t type)
+{
+    unsigned int n = mech_hash(type, mc->table_size);
+
+    while (mc->table[n]) {
+        if (mc->types[mc->table[n] - 1] == type) {
+            return mc->table[n] - 1;
+        }
+        n = (n + 1) & (mc->table_size - 1);
+    }
+
+    return -1;
+}
+
+/* Build the hash table for a mechanism cache whose types and info
+ * arrays are filled. */
+static ck_rv_t mech_index(struct mech_cache *mc)
+{
+    unsigned long n;
+
+    mc->table_size = 8;
+    while (mc->table_size < mc->count * 2) {
+        mc->table_size *= 2;
+    }
+    mc->table = pk_calloc(mc->table_size, sizeof *mc->table);
+    if (mc->table == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    for (n = 0; n < mc->count; n++) {
+        unsigned int h;
+
+        /* Ignore duplicates in the list. */
+        if (mech_lookup(mc, mc->types[n]) >= 0) {
+            continue;
+        }
+
+        h = mech_hash(mc->types[n], mc->table_size);
+        while (mc->table[h]) {
+            h = (h + 1) & (mc->table_size - 1);
+        }
+        mc->table[h] = n + 1;
+    }
+
+    return CKR_OK;
+}
+
+/* Fetch the mechanism list and information for all mechanisms from
+ * the provider. */
+static ck_rv_t fetch_mechs(pakchois_module_t *mod, ck_slot_id_t slot_id,
+                           struct mech_cache **mcp)
+{
+    struct mech_cache *mc;
+    unsigned long n;
+    ck_rv_t rv;
+
+    mc = pk_calloc(1, sizeof *mc);
+    if (mc == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    /* The list may change size between calls, so retry until it
+     * fits. */
+    do {
+        pk_free(mc->types);
+        mc->types = NULL;
+
+        rv = CALL(GetMechanismList, (slot_id, NULL, &mc->count));
+        if (rv != CKR_OK) {
+            goto fail;
+        }
+
+        mc->types = pk_calloc(mc->count + 1, sizeof *mc->types);
+        if (mc->types == NULL) {
+            rv = CKR_HOST_MEMORY;
+            goto fail;
+        }
+
+        rv = CALL(GetMechanismList, (slot_id, mc->types, &mc->count));
+    } while (rv == CKR_BUFFER_TOO_SMALL);
+
+    if (rv != CKR_OK) {
+        goto fail;
+    }
+
+    mc->info = pk_calloc(mc->count + 1, sizeof *mc->info);
+    if (mc->info == NULL) {
+        rv = CKR_HOST_MEMORY;
+        goto fail;
+    }
+
+    for (n = 0; n < mc->count; n++) {
+        rv = CALL(GetMechanismInfo, (slot_id, mc->types[n], &mc->info[n]));
+        if (rv != CKR_OK) {
+            goto fail;
+        }
+    }
+
+    rv = mech_index(mc);
+    if (rv != CKR_OK) {
+        goto fail;
+    }
+
+    *mcp = mc;
+    return CKR_OK;
+fail:
+    pk_free(mc->types);
+    pk_free(mc->info);
+    pk_free(mc->table);
+    pk_free(mc);
+    return rv;
+}
+
+/* Find the slot for given id and return with its cache_lock held for
+ * reading and the mechanism cache filled.  On failure, returns an
+ * error with the lock not held. */
+static ck_rv_t lock_mechs(pakchois_module_t *mod, ck_slot_id_t slot_id,
+                          struct slot **slotp)
+{
+    struct slot *slot = find_or_create_slot(mod, slot_id);
+    struct mech_cache *mc = NULL;
+    unsigned long generation;
+    ck_rv_t rv;
+
+    if (slot == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    for (;;) {
+        if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+            return CKR_CANT_LOCK;
+        }
+
+        if (slot->mechs) {
+            *slotp = slot;
+            return CKR_OK;
+        }
+
+        generation = slot->generation;
+        pthread_rwlock_unlock(&slot->cache_lock);
+
+        mc = snap_mechs(mod, slot, &generation);
+        rv = mc ? CKR_OK : fetch_mechs(mod, slot_id, &mc);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+            return CKR_CANT_LOCK;
+        }
+        /* Another thread may have filled the cache meanwhile, or the
+         * slot been invalidated since the list was fetched, in which
+         * case it may describe a different token; try again. */
+        if (slot->mechs == NULL && slot->generation == generation) {
+            slot->mechs = mc;
+            mc = NULL;
+        }
+        pthread_rwlock_unlock(&slot->cache_lock);
+
+        if (mc) {
+            pk_free(mc->types);
+            pk_free(mc->info);
+            pk_free(mc->table);
+            pk_free(mc);
+        }
+    }
+}
+
+ck_rv_t pakchois_get_cached_mechanism_list(pakchois_module_t *mod,
+                                           ck_slot_id_t slot_id,
+                                           ck_mechanism_type_t *mechanism_list,
+                                           unsigned long *count)
+{
+    struct slot *slot;
+    ck_rv_t rv;
+
+    rv = lock_mechs(mod, slot_id, &slot);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (mechanism_list == NULL) {
+        rv = CKR_OK;
+    }
+    else if (*count < slot->mechs->count) {
+        rv = CKR_BUFFER_TOO_SMALL;
+    }
+    else {
+        memcpy(mechanism_list, slot->mechs->types,
+               slot->mechs->count * sizeof *mechanism_list);
+    }
+    *count = slot->mechs->count;
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+    return rv;
+}
+
+ck_rv_t pakchois_get_cached_mechanism_info(pakchois_module_t *mod,
+                                           ck_slot_id_t slot_id,
+                                           ck_mechanism_type_t type,
+                                           struct ck_mechanism_info *info)
+{
+    struct slot *slot;
+    long n;
+    ck_rv_t rv;
+
+    rv = lock_mechs(mod, slot_id, &slot);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    n = mech_lookup(slot->mechs, type);
+    if (n < 0) {
+        rv = CKR_MECHANISM_INVALID;
+    }
+    else {
+        *info = slot->mechs->info[n];
+    }
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+    return rv;
+}
+
+ck_rv_t pakchois_mechanism_supported(pakchois_module_t *mod,
+                                     ck_slot_id_t slot_id,
+                                     ck_mechanism_type_t type,
+                                     ck_flags_t flags)
+{
+    struct slot *slot;
+    long n;
+    ck_rv_t rv;
+
+    rv = lock_mechs(mod, slot_id, &slot);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    n = mech_lookup(slot->mechs, type);
+    if (n < 0 || (slot->mechs->info[n].flags & flags) != flags) {
+        rv = CKR_MECHANISM_INVALID;
+    }
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+    return rv;
+}
+
+void pakchois_set_info_ttl(unsigned int seconds)
+{
+    __atomic_store_n(&info_ttl, seconds, __ATOMIC_RELAXED);
+}
+
+/* Returns non-zero if the identifying fields of the slot or token
+ * information differ; the counters and clock in the token
+ * information are expected to change and are ignored. */
+static int info_changed(int token, const struct info_cache *old,
+                        const struct info_cache *new)
+{
+    if (old->rv != new->rv) {
+        return 1;
+    }
+    else if (new->rv != CKR_OK) {
+        return 0;
+    }
+    else if (token) {
+        const struct ck_token_info *a = &old->u.token, *b = &new->u.token;
+
+        return memcmp(a->label, b->label, sizeof a->label)
+            || memcmp(a->manufacturer_id, b->manufacturer_id,
+                      sizeof a->manufacturer_id)
+            || memcmp(a->model, b->model, sizeof a->model)
+            || memcmp(a->serial_number, b->serial_number,
+                      sizeof a->serial_number)
+            || a->flags != b->flags;
+    }
+    else {
+        const struct ck_slot_info *a = &old->u.slot, *b = &new->u.slot;
+
+        return memcmp(a->slot_description, b->slot_description,
+                      sizeof a->slot_description)
+            || memcmp(a->manufacturer_id, b->manufacturer_id,
+                      sizeof a->manufacturer_id)
+            || a->flags != b->flags;
+    }
+}
+
+/* Return the cached slot (token == 0) or token information for the
+ * given slot in *out, fetching it from the provider first if it is
+ * missing or has expired. */
+static ck_rv_t get_cached_info(pakchois_module_t *mod, ck_slot_id_t slot_id,
+                               int token, struct info_cache *out,
+                               unsigned long *generation)
+{
+    struct slot *slot = find_or_create_slot(mod, slot_id);
+    struct info_cache *ic, fresh;
+    unsigned int ttl = __atomic_load_n(&info_ttl, __ATOMIC_RELAXED);
+    time_t now = monotonic_now();
+    unsigned long fetched_in;
+
+    if (slot == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    ic = token ? &slot->token_info : &slot->slot_info;
+
+    if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return CKR_CANT_LOCK;
+    }
+    if (ic->valid && (ttl == 0 || now - ic->fetched < (time_t)ttl)) {
+        *out = *ic;
+        if (generation) *generation = slot->generation;
+        pthread_rwlock_unlock(&slot->cache_lock);
+        return out->rv;
+    }
+    fetched_in = slot->generation;
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    /* Query the provider without holding the lock. */
+    memset(&fresh, 0, sizeof fresh);
+    if (token) {
+        fresh.rv = CALL(GetTokenInfo, (slot_id, &fresh.u.token));
+    }
+    else {
+        fresh.rv = CALL(GetSlotInfo, (slot_id, &fresh.u.slot));
+    }
+    fresh.valid = 1;
+    fresh.fetched = now;
+
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return CKR_CANT_LOCK;
+    }
+    *out = fresh;
+    if (slot->generation != fetched_in) {
+        /* The slot was invalidated while the provider was queried;
+         * the answer may predate the change, so it is returned but
+         * not cached, with the old generation. */
+        if (generation) *generation = fetched_in;
+        pthread_rwlock_unlock(&slot->cache_lock);
+        return fresh.rv;
+    }
+    if (ic->valid && info_changed(token, ic, &fresh)) {
+        /* A different token, or none: nothing cached for the old
+         * one applies. */
+        flush_slot_caches(slot);
+        slot->generation++;
+    }
+    *ic = fresh;
+    if (generation) *generation = slot->generation;
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    return fresh.rv;
+}
+
+ck_rv_t pakchois_get_cached_slot_info(pakchois_module_t *mod,
+                                      ck_slot_id_t slot_id,
+                                      struct ck_slot_info *info,
+                                      unsigned long *generation)
+{
+    struct info_cache ic;
+    ck_rv_t rv;
+
+    rv = get_cached_info(mod, slot_id, 0, &ic, generation);
+    if (rv == CKR_OK) {
+        *info = ic.u.slot;
+    }
+    return rv;
+}
+
+ck_rv_t pakchois_get_cached_token_info(pakchois_module_t *mod,
+                                       ck_slot_id_t slot_id,
+                                       struct ck_token_info *info,
+                                       unsigned long *generation)
+{
+    struct info_cache ic;
+    ck_rv_t rv;
+
+    rv = get_cached_info(mod, slot_id, 1, &ic, generation);
+    if (rv == CKR_OK) {
+        *info = ic.u.token;
+    }
+    return rv;
+}
+
+ck_rv_t pakchois_slot_generation(pakchois_module_t *mod,
+                                 ck_slot_id_t slot_id,
+                                 unsigned long *generation)
+{
+    struct slot *slot = find_or_create_slot(mod, slot_id);
+
+    if (slot == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return CKR_CANT_LOCK;
+    }
+    *generation = slot->generation;
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    return CKR_OK;
+}
+
+/* Notification descriptors: an eventfd where available, otherwise a
+ * pipe, which is readable whilst the notifier is raised.  Both
+ * descriptors are -1 for an unused notifier. */
+struct notifier {
+    int rfd, wfd;
+};
+
+#define NOTIFIER_INIT(n) ((n)->rfd = (n)->wfd = -1)
+
+static int notifier_open(struct notifier *n)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    n->rfd = n->wfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    return n->rfd < 0 ? -1 : 0;
+#else
+    int fds[2];
+
+    if (pipe(fds)) {
+        return -1;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    n->rfd = fds[0];
+    n->wfd = fds[1];
+    return 0;
+#endif
+}
+
+static void notifier_close(struct notifier *n)
+{
+    if (n->rfd >= 0) {
+        close(n->rfd);
+    }
+    if (n->wfd >= 0 && n->wfd != n->rfd) {
+        close(n->wfd);
+    }
+    NOTIFIER_INIT(n);
+}
+
+/* Make the notification descriptor readable. */
+static void notifier_raise(struct notifier *n)
+{
+#ifdef HAVE_SYS_EVENTFD_H
+    uint64_t one = 1;
+#else
+    char one = 1;
+#endif
+
+    if (n->wfd >= 0 && write(n->wfd, &one, sizeof one) < 0) {
+        /* Full pipe or eventfd counter: already readable. */
+    }
+}
+
+/* Drain the notification descriptor. */
+static void notifier_clear(struct notifier *n)
+{
+    char buf[64];
+
+    if (n->rfd >= 0) {
+        while (read(n->rfd, buf, sizeof buf) > 0)
+            /* nothing */;
+    }
+}
+
+/* Slot event dispatch. */
+
+struct pakchois_subscription_s {
+    pakchois_module_t *module;
+    pakchois_slot_event_t callback;
+    void *userdata;
+    /* For queued subscriptions: pending slot ids, without
+     * duplicates, and the notifier (unused for internal queues). */
+    ck_slot_id_t *pending;
+    unsigned int npending, size;
+    struct notifier notifier;
+    /* busy is set whilst the callback runs, in thread caller; dead
+     * is set once cancelled, to 2 if cancelled from within the
+     * callback, in which case the dispatching thread frees it. */
+    int busy, dead;
+    pthread_t caller;
+    pakchois_subscription_t *next;
+};
+
+/* Add a slot id to the queue of a subscription.  Must be called with
+ * the provider mutex held. */
+static void queue_event(pakchois_subscription_t *sub, ck_slot_id_t slot_id)
+{
+    unsigned int n;
+
+    for (n = 0; n < sub->npending; n++) {
+        if (sub->pending[n] == slot_id) {
+            return;
+        }
+    }
+
+    if (sub->npending == sub->size) {
+        unsigned int size = sub->size ? sub->size * 2 : 8;
+        ck_slot_id_t *pending = pk_malloc(size * sizeof *pending);
+
+        /* If out of memory, the event is lost. */
+        if (pending == NULL) {
+            return;
+        }
+        if (sub->npending) {
+            memcpy(pending, sub->pending, sub->npending * sizeof *pending);
+        }
+        pk_free(sub->pending);
+        sub->pending = pending;
+        sub->size = size;
+    }
+
+    sub->pending[sub->npending++] = slot_id;
+    if (sub->npending == 1) {
+        notifier_raise(&sub->notifier);
+    }
+}
+
+/* Remove the oldest queued slot id from a subscription.  Must be
+ * called with the provider mutex held.  Returns CKR_OK on success,
+ * otherwise CKR_NO_EVENT. */
+static ck_rv_t dequeue_event(pakchois_subscription_t *sub,
+                             ck_slot_id_t *slot_id)
+{
+    if (sub->npending == 0) {
+        return CKR_NO_EVENT;
+    }
+
+    *slot_id = sub->pending[0];
+    memmove(sub->pending, sub->pending + 1, 
+            --sub->npending * sizeof *sub->pending);
+    if (sub->npending == 0) {
+        notifier_clear(&sub->notifier);
+    }
+
+    return CKR_OK;
+}
+
+static void free_subscription(pakchois_subscription_t *sub)
+{
+    notifier_close(&sub->notifier);
+    pk_free(sub->pending);
+    pk_free(sub);
+}
+
+/* Pass an event for the given slot to all modules and subscribers of
+ * the provider.  Must be called WITHOUT the provider mutex held. */
+static void dispatch_event(struct provider *prov, ck_slot_id_t slot_id)
+{
+    pakchois_subscription_t *sub, *next, **prevp;
+    pakchois_module_t *mod;
+
+    pthread_mutex_lock(&prov->mutex);
+
+    for (mod = prov->modules; mod; mod = mod->pnext) {
+        invalidate_slot(mod, slot_id);
+    }
+
+    for (sub = prov->subscribers; sub; sub = next) {
+        if (sub->dead) {
+            next = sub->next;
+            continue;
+        }
+
+        if (sub->callback == NULL) {
+            queue_event(sub, slot_id);
+            next = sub->next;
+            continue;
+        }
+
+        /* Run the callback unlocked, so it may subscribe or cancel
+         * subscriptions; pakchois_cancel_slot_events() waits until
+         * the callback has finished. */
+        sub->busy = 1;
+        sub->caller = pthread_self();
+        pthread_mutex_unlock(&prov->mutex);
+        sub->callback(sub->module, slot_id, sub->userdata);
+        pthread_mutex_lock(&prov->mutex);
+        sub->busy = 0;
+        next = sub->next;
+
+        if (sub->dead == 2) {
+            for (prevp = &prov->subscribers; *prevp != sub; 
+                 prevp = &(*prevp)->next)
+                /* nothing */;
+            *prevp = sub->next;
+            free_subscription(sub);
+        }
+    }
+
+    pthread_cond_broadcast(&prov->event_cond);
+    pthread_mutex_unlock(&prov->mutex);
+}
+
+void pakchois_set_poll_interval(unsigned int min_msec, unsigned int max_msec)
+{
+    if (min_msec == 0) {
+        min_msec = 1;
+    }
+    if (max_msec < min_msec) {
+        max_msec = min_msec;
+    }
+
+    pthread_mutex_lock(&poll_mutex);
+    poll_min = min_msec;
+    poll_max = max_msec;
+    pthread_mutex_unlock(&poll_mutex);
+}
+
+/* Clamp the poll interval to the current bounds, storing the
+ * minimum in *min. */
+static unsigned int poll_clamp(unsigned int interval, unsigned int *min)
+{
+    pthread_mutex_lock(&poll_mutex);
+    *min = poll_min;
+    if (interval < poll_min) {
+        interval = poll_min;
+    }
+    else if (interval > poll_max) {
+        interval = poll_max;
+    }
+    pthread_mutex_unlock(&poll_mutex);
+
+    return interval;
+}
+
+/* Present tokens, as seen by the polling dispatcher. */
+struct token_snapshot {
+    unsigned long count;
+    ck_slot_id_t *ids;
+    unsigned char (*serials)[16];
+};
+
+/* Take a snapshot of the slots with tokens present and their serial
+ * numbers.  Fails if any token could not be queried, so that a token
+ * is not reported as removed because of a transient error. */
+static ck_rv_t snapshot_tokens(struct provider *prov,
+                               struct token_snapshot *snap)
+{
+    const struct ck_function_list *fns = prov->fns;
+    struct ck_token_info info;
+    unsigned long n, count;
+    ck_rv_t rv;
+
+    snap->ids = NULL;
+    snap->serials = NULL;
+
+    do {
+        pk_free(snap->ids);
+        snap->ids = NULL;
+
+        rv = fns->C_GetSlotList(1, NULL, &snap->count);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+        
+        snap->ids = pk_malloc((snap->count + 1) * sizeof *snap->ids);
+        if (snap->ids == NULL) {
+            return CKR_HOST_MEMORY;
+        }
+
+        rv = fns->C_GetSlotList(1, snap->ids, &snap->count);
+    } while (rv == CKR_BUFFER_TOO_SMALL);
+
+    if (rv == CKR_OK) {
+        snap->serials = pk_malloc((snap->count + 1) * sizeof *snap->serials);
+        if (snap->serials == NULL) {
+            rv = CKR_HOST_MEMORY;
+        }
+    }
+
+    if (rv != CKR_OK) {
+        pk_free(snap->ids);
+        return rv;
+    }
+
+    /* A token which has gone since the list was read is left out. */
+    for (n = count = 0; n < snap->count; n++) {
+        rv = fns->C_GetTokenInfo(snap->ids[n], &info);
+        if (rv == CKR_OK) {
+            snap->ids[count] = snap->ids[n];
+            memcpy(snap->serials[count++], info.serial_number, 16);
+        }
+        else if (rv != CKR_TOKEN_NOT_PRESENT && rv != CKR_DEVICE_REMOVED
+                 && rv != CKR_SLOT_ID_INVALID) {
+            pk_free(snap->ids);
+            pk_free(snap->serials);
+            return rv;
+        }
+    }
+    snap->count = count;
+
+    return CKR_OK;
+}
+
+/* Returns the index of slot in snapshot, or -1. */
+static long snapshot_find(const struct token_snapshot *snap, ck_slot_id_t id)
+{
+    unsigned long n;
+
+    for (n = 0; n < snap->count; n++) {
+        if (snap->ids[n] == id) {
+            return n;
+        }
+    }
+
+    return -1;
+}
+
+/* Dispatch events for all differences between two snapshots.
+ * Returns non-zero if any were found. */
+static int diff_snapshots(struct provider *prov,
+                          const struct token_snapshot *old,
+                          const struct token_snapshot *new)
+{
+    unsigned long n;
+    int changed = 0;
+    long m;
+
+    for (n = 0; n < new->count; n++) {
+        m = snapshot_find(old, new->ids[n]);
+        if (m < 0 || memcmp(old->serials[m], new->serials[n], 16)) {
+            /* Inserted or replaced. */
+            dispatch_event(prov, new->ids[n]);
+            changed = 1;
+        }
+    }
+
+    for (n = 0; n < old->count; n++) {
+        if (snapshot_find(new, old->ids[n]) < 0) {
+            /* Removed. */
+            dispatch_event(prov, old->ids[n]);
+            changed = 1;
+        }
+    }
+
+    return changed;
+}
+
+/* Sleep for the given interval, or until the provider is finalized.
+ * Returns non-zero if the dispatcher should stop. */
+static int poll_sleep(struct provider *prov, unsigned int msec)
+{
+    struct timespec deadline;
+    int stop;
+
+    monotonic_deadline(&deadline, msec);
+
+    pthread_mutex_lock(&prov->mutex);
+    while (!prov->dispatch_stop
+           && pthread_cond_timedwait(&prov->event_cond, &prov->mutex,
+                                     &deadline) != ETIMEDOUT)
+        /* nothing */;
+    stop = prov->dispatch_stop;
+    pthread_mutex_unlock(&prov->mutex);
+
+    return stop;
+}
+
+/* Poll for events from a provider which does not support blocking
+ * waits, until the provider is finalized.  If the provider supports
+ * non-blocking C_WaitForSlotEvent calls, they are used; otherwise,
+ * events are synthesized by comparing the slots with tokens present
+ * and the token serial numbers.  The poll interval doubles each time
+ * nothing changes, up to poll_max, and returns to poll_min once an
+ * event is seen.  A poll which fails is tried again at the next
+ * interval. */
+static void poll_events(struct provider *prov)
+{
+    const struct ck_function_list *fns = prov->fns;
+    struct token_snapshot snap, next;
+    unsigned int interval = 0, min;
+    ck_slot_id_t slot_id;
+    int dont_block, have_snap = 0, changed;
+    ck_rv_t rv;
+
+    rv = fns->C_WaitForSlotEvent(CKF_DONT_BLOCK, &slot_id, NULL);
+    dont_block = rv == CKR_OK || rv == CKR_NO_EVENT;
+    if (rv == CKR_OK) {
+        dispatch_event(prov, slot_id);
+    }
+    else if (!dont_block) {
+        have_snap = snapshot_tokens(prov, &snap) == CKR_OK;
+    }
+
+    for (;;) {
+        interval = poll_clamp(interval, &min);
+        if (poll_sleep(prov, interval)) {
+            break;
+        }
+
+        changed = 0;
+        if (dont_block) {
+            while (fns->C_WaitForSlotEvent(CKF_DONT_BLOCK, &slot_id,
+                                           NULL) == CKR_OK) {
+                dispatch_event(prov, slot_id);
+                changed = 1;
+            }
+        }
+        else if (snapshot_tokens(prov, &next) == CKR_OK) {
+            if (have_snap) {
+                changed = diff_snapshots(prov, &snap, &next);
+                pk_free(snap.ids);
+                pk_free(snap.serials);
+            }
+            snap = next;
+            have_snap = 1;
+        }
+
+        interval = changed ? min : interval * 2;
+    }
+
+    if (have_snap) {
+        pk_free(snap.ids);
+        pk_free(snap.serials);
+    }
+}
+
+static void *dispatcher_thread(void *arg)
+{
+    struct provider *prov = arg;
+    unsigned int interval = 0, min;
+    ck_slot_id_t slot_id;
+    ck_rv_t rv;
+
+    for (;;) {
+        rv = prov->fns->C_WaitForSlotEvent(0, &slot_id, NULL);
+
+        /* Fall back on polling if blocking waits are not
+         * supported; some providers return CKR_NO_EVENT. */
+        if (rv == CKR_FUNCTION_NOT_SUPPORTED || rv == CKR_NO_EVENT) {
+            poll_events(prov);
+            pthread_mutex_lock(&prov->mutex);
+            break;
+        }
+
+        pthread_mutex_lock(&prov->mutex);
+        if (prov->dispatch_stop) {
+            break;
+        }
+        pthread_mutex_unlock(&prov->mutex);
+
+        if (rv == CKR_OK) {
+            dispatch_event(prov, slot_id);
+            interval = 0;
+        }
+        else {
+            /* Back off before trying again after an error. */
+            interval = poll_clamp(interval * 2, &min);
+            if (poll_sleep(prov, interval)) {
+                pthread_mutex_lock(&prov->mutex);
+                break;
+            }
+        }
+    }
+
+    prov->dispatching = 0;
+    pthread_cond_broadcast(&prov->event_cond);
+    pthread_mutex_unlock(&prov->mutex);
+
+    return NULL;
+}
+
+/* Start the dispatcher for a provider, if it is not already running.
+ * Must be called with the provider mutex held.  Returns CKR_OK if
+ * the dispatcher is running. */
+static ck_rv_t start_dispatcher(struct provider *prov)
+{
+    if (prov->dispatching) {
+        return CKR_OK;
+    }
+
+    if (pthread_create(&prov->dispatcher, NULL, dispatcher_thread, prov)) {
+        return CKR_GENERAL_ERROR;
+    }
+
+    prov->dispatching = prov->dispatch_joinable = 1;
+    return CKR_OK;
+}
+
+/* Stop the dispatcher of a provider which has been finalized.  Must
+ * be called WITHOUT the provider mutex held. */
+static void stop_dispatcher(struct provider *prov)
+{
+    if (prov->dispatch_joinable) {
+        pthread_join(prov->dispatcher, NULL);
+    }
+
+    prov->dispatch_joinable = prov->dispatch_stop = 0;
+}
+
+/* Create a subscription; if fd is non-zero, a notification
+ * descriptor is created too.  Must be called with the provider mutex
+ * held. */
+static ck_rv_t new_subscription(pakchois_module_t *mod,
+                                pakchois_slot_event_t callback,
+                                void *userdata, int fd,
+                                pakchois_subscription_t **subp)
+{
+    pakchois_subscription_t *sub = pk_calloc(1, sizeof *sub);
+
+    if (sub == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    sub->module = mod;
+    sub->callback = callback;
+    sub->userdata = userdata;
+    NOTIFIER_INIT(&sub->notifier);
+
+    if (fd && notifier_open(&sub->notifier)) {
+        pk_free(sub);
+        return CKR_GENERAL_ERROR;
+    }
+
+    sub->next = mod->provider->subscribers;
+    mod->provider->subscribers = sub;
+    *subp = sub;
+
+    return CKR_OK;
+}
+
+/* Unlink a module from its provider, discarding its event queue.
+ * Must be called WITHOUT the provider mutex held. */
+static void detach_module(pakchois_module_t *mod)
+{
+    struct provider *prov = mod->provider;
+    pakchois_module_t **mp;
+
+    pthread_mutex_lock(&prov->mutex);
+    for (mp = &prov->modules; *mp != mod; mp = &(*mp)->pnext)
+        /* nothing */;
+    *mp = mod->pnext;
+    pthread_mutex_unlock(&prov->mutex);
+
+    if (mod->events) {
+        pakchois_cancel_slot_events(mod->events);
+    }
+}
+
+static ck_rv_t wait_dispatched_event(pakchois_module_t *mod, ck_flags_t flags,
+                                     ck_slot_id_t *slot)
+{
+    struct provider *prov = mod->provider;
+    ck_rv_t rv;
+
+    if (pthread_mutex_lock(&prov->mutex)) {
+        return CKR_CANT_LOCK;
+    }
+
+    rv = dequeue_event(mod->events, slot);
+    if (rv != CKR_NO_EVENT) {
+        pthread_mutex_unlock(&prov->mutex);
+        return rv;
+    }
+
+    /* A non-blocking call only drains the queue, but starts the
+     * dispatcher so that later calls see events. */
+    rv = start_dispatcher(prov);
+    while (rv == CKR_OK) {
+        rv = dequeue_event(mod->events, slot);
+        if (rv != CKR_NO_EVENT || (flags & CKF_DONT_BLOCK)) {
+            break;
+        }
+        if (!prov->dispatching) {
+            /* The provider is being finalized; as for a blocked
+             * C_WaitForSlotEvent call, no event will follow. */
+            rv = CKR_CRYPTOKI_NOT_INITIALIZED;
+            break;
+        }
+        pthread_cond_wait(&prov->event_cond, &prov->mutex);
+        rv = CKR_OK;
+    }
+
+    pthread_mutex_unlock(&prov->mutex);
+    return rv;
+}
+
+ck_rv_t pakchois_subscribe_slot_events(pakchois_module_t *mod,
+                                       pakchois_slot_event_t callback,
+                                       void *userdata,
+                                       pakchois_subscription_t **sub)
+{
+    struct provider *prov = mod->provider;
+    ck_rv_t rv;
+
+    if (pthread_mutex_lock(&prov->mutex)) {
+        return CKR_CANT_LOCK;
+    }
+
+    rv = start_dispatcher(prov);
+    if (rv == CKR_OK) {
+        rv = new_subscription(mod, callback, userdata, callback == NULL, sub);
+    }
+
+    pthread_mutex_unlock(&prov->mutex);
+    return rv;
+}
+
+int pakchois_subscription_fd(pakchois_subscription_t *sub)
+{
+    return sub->notifier.rfd;
+}
+
+ck_rv_t pakchois_next_slot_event(pakchois_subscription_t *sub,
+                                 ck_slot_id_t *slot_id)
+{
+    struct provider *prov = sub->module->provider;
+    ck_rv_t rv;
+
+    if (pthread_mutex_lock(&prov->mutex)) {
+        return CKR_CANT_LOCK;
+    }
+    rv = dequeue_event(sub, slot_id);
+    pthread_mutex_unlock(&prov->mutex);
+
+    return rv;
+}
+
+void pakchois_cancel_slot_events(pakchois_subscription_t *sub)
+{
+    struct provider *prov = sub->module->provider;
+    pakchois_subscription_t **prevp;
+
+    pthread_mutex_lock(&prov->mutex);
+
+    sub->dead = 1;
+
+    if (sub->busy) {
+        if (pthread_equal(pthread_self(), sub->caller)) {
+            /* Cancelled from the callback. */
+            sub->dead = 2;
+            pthread_mutex_unlock(&prov->mutex);
+            return;
+        }
+
+        while (sub->busy) {
+            pthread_cond_wait(&prov->event_cond, &prov->mutex);
+        }
+    }
+
+    for (prevp = &prov->subscribers; *prevp != sub; prevp = &(*prevp)->next)
+        /* nothing */;
+    *prevp = sub->next;
+
+    pthread_mutex_unlock(&prov->mutex);
+
+    free_subscription(sub);
+}
+
+/* Single-part operations. */
+
+enum op_kind {
+    OP_SIGN = 1,
+    OP_VERIFY,
+    OP_ENCRYPT,
+    OP_DECRYPT,
+    OP_DIGEST
+};
+
+static ck_rv_t op_init(pakchois_session_t *sess, enum op_kind kind,
+                       struct ck_mechanism *mech, ck_object_handle_t key)
+{
+    switch (kind) {
+    case OP_SIGN:
+        return pakchois_sign_init(sess, mech, key);
+    case OP_VERIFY:
+        return pakchois_verify_init(sess, mech, key);
+    case OP_ENCRYPT:
+        return pakchois_encrypt_init(sess, mech, key);
+    case OP_DECRYPT:
+        return pakchois_decrypt_init(sess, mech, key);
+    case OP_DIGEST:
+        return pakchois_digest_init(sess, mech);
+    }
+
+    return CKR_ARGUMENTS_BAD;
+}
+
+/* Run the single-part call for an initialized operation.  For
+ * verify, output and *output_len are the signature. */
+static ck_rv_t op_call(pakchois_session_t *sess, enum op_kind kind,
+                       unsigned char *input, unsigned long input_len,
+                       unsigned char *output, unsigned long *output_len)
+{
+    switch (kind) {
+    case OP_SIGN:
+        return pakchois_sign(sess, input, input_len, output, output_len);
+    case OP_VERIFY:
+        return pakchois_verify(sess, input, input_len, output, *output_len);
+    case OP_ENCRYPT:
+        return pakchois_encrypt(sess, input, input_len, output, output_len);
+    case OP_DECRYPT:
+        return pakchois_decrypt(sess, input, input_len, output, output_len);
+    case OP_DIGEST:
+        return pakchois_digest(sess, input, input_len, output, output_len);
+    }
+
+    return CKR_ARGUMENTS_BAD;
+}
+
+/* Returns non-zero if a session should be discarded rather than
+ * returned to the pool after an operation failed with the given
+ * error; either the session is unusable, or an operation is
+ * unexpectedly active. */
+static int discard_session(ck_rv_t rv)
+{
+    switch (rv) {
+    case CKR_OPERATION_ACTIVE:
+    case CKR_SESSION_CLOSED:
+    case CKR_SESSION_HANDLE_INVALID:
+    case CKR_DEVICE_ERROR:
+    case CKR_DEVICE_REMOVED:
+    case CKR_TOKEN_NOT_PRESENT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/* Return a session to the pool after an operation which finished
+ * with the given result, or close it if the result shows it is
+ * unusable, or if active is non-zero since an operation could not be
+ * ended. */
+static void pool_put(pakchois_session_pool_t *pool,
+                     pakchois_session_t *sess, ck_rv_t rv, int active)
+{
+    if (active || discard_session(rv)) {
+        pakchois_session_pool_discard(pool, sess);
+    }
+    else {
+        pakchois_session_pool_release(pool, sess);
+    }
+}
+
+static enum op_kind op_from_flags(ck_flags_t operation)
+{
+    switch (operation) {
+    case CKF_SIGN: return OP_SIGN;
+    case CKF_VERIFY: return OP_VERIFY;
+    case CKF_ENCRYPT: return OP_ENCRYPT;
+    case CKF_DECRYPT: return OP_DECRYPT;
+    case CKF_DIGEST: return OP_DIGEST;
+    default: return 0;
+    }
+}
+
+/* Output length prediction.  Output lengths are learned per slot,
+ * keyed by operation, mechanism, key and the "class" of the input
+ * length (its bit length), in a direct-mapped cache where a
+ * colliding entry simply replaces the old one.  Lengths derived from
+ * the key attributes, which hold for any input length, are stored
+ * with class LEN_ANY.  The largest length seen is kept, so the
+ * prediction is an upper bound unless inputs in the same class
+ * produce longer outputs than previously seen. */
+#define LEN_ANY (0xff)
+
+static unsigned int len_class(unsigned long len)
+{
+    unsigned int cls = 0;
+
+    while (len) {
+        cls++;
+        len >>= 1;
+    }
+
+    return cls;
+}
+
+static struct len_entry *len_slot(struct len_entry *lens,
+                                  enum op_kind kind, ck_mechanism_type_t mech,
+                                  ck_object_handle_t key, unsigned int cls)
+{
+    unsigned long h = (mech * 31 + key) * 31 + kind * 131 + cls;
+
+    return &lens[(h * 2654435761UL >> 8) % LEN_CACHE_SIZE];
+}
+
+static int len_match(const struct len_entry *e, enum op_kind kind,
+                     ck_mechanism_type_t mech, ck_object_handle_t key,
+                     unsigned int cls)
+{
+    return e->kind == kind && e->cls == cls && e->mech == mech
+        && e->key == key;
+}
+
+/* Stores the cached lengths for given key in *len, for the input
+ * length class, and *any, for class LEN_ANY, with one read lock;
+ * each is zero if there is no entry or the length is unknown.
+ * Returns non-zero if a LEN_ANY entry was found. */
+static int len_lookup(struct slot *slot, enum op_kind kind,
+                      ck_mechanism_type_t mech, ck_object_handle_t key,
+                      unsigned int cls, unsigned long *len,
+                      unsigned long *any)
+{
+    struct len_entry *e;
+    int found = 0;
+
+    *len = *any = 0;
+
+    if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return 0;
+    }
+    if (slot->lens) {
+        e = len_slot(slot->lens, kind, mech, key, cls);
+        if (len_match(e, kind, mech, key, cls)) {
+            *len = e->len;
+        }
+        e = len_slot(slot->lens, kind, mech, key, LEN_ANY);
+        if (len_match(e, kind, mech, key, LEN_ANY)) {
+            *any = e->len;
+            found = 1;
+        }
+    }
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    return found;
+}
+
+/* Record a length for given key, keeping the largest seen.  The write
+ * lock is taken only if the entry must be added or grown. */
+static void len_store(struct slot *slot, enum op_kind kind,
+                      ck_mechanism_type_t mech, ck_object_handle_t key,
+                      unsigned int cls, unsigned long len)
+{
+    struct len_entry *e;
+    int known = 0;
+
+    if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return;
+    }
+    if (slot->lens) {
+        e = len_slot(slot->lens, kind, mech, key, cls);
+        known = len_match(e, kind, mech, key, cls) && len <= e->len;
+    }
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    if (known || pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+    if (slot->lens == NULL) {
+        slot->lens = pk_calloc(LEN_CACHE_SIZE, sizeof *slot->lens);
+    }
+    if (slot->lens) {
+        e = len_slot(slot->lens, kind, mech, key, cls);
+        if (!len_match(e, kind, mech, key, cls)) {
+            e->kind = kind;
+            e->cls = cls;
+            e->mech = mech;
+            e->key = key;
+            e->len = len;
+        }
+        else if (len > e->len) {
+            e->len = len;
+        }
+    }
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+/* Discard any lengths learned for the key, whose handle may be
+ * reused by another object. */
+static void len_forget(struct slot *slot, ck_object_handle_t key)
+{
+    unsigned int n;
+
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+    for (n = 0; slot->lens && n < LEN_CACHE_SIZE; n++) {
+        if (slot->lens[n].kind && slot->lens[n].key == key) {
+            slot->lens[n].kind = 0;
+        }
+    }
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+/* Signature lengths for ECDSA on named curves, by DER-encoded
+ * curve OID. */
+static const struct {
+    unsigned char oid[10];
+    unsigned int oid_len;
+    unsigned long sig_len;
+} ec_curves[] = {
+    /* P-256 */
+    { { 0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 }, 10, 64 },
+    /* P-384 */
+    { { 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22 }, 7, 96 },
+    /* P-521 */
+    { { 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x23 }, 7, 132 },
+    /* secp256k1 */
+    { { 0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x0a }, 7, 64 }
+};
+
+/* Derive the output length for any input from the mechanism or key
+ * attributes, storing it in *len, or zero if it cannot be derived.
+ * Returns CKR_OK unless the key attributes could not be read. */
+static ck_rv_t derive_len(pakchois_session_t *sess, enum op_kind kind,
+                          ck_mechanism_type_t mech, ck_object_handle_t key,
+                          unsigned long *len)
+{
+    ck_key_type_t type = CK_UNAVAILABLE_INFORMATION;
+    unsigned long bits = 0, n;
+    unsigned char params[32];
+    struct ck_attribute a[3];
+    ck_rv_t rv;
+
+    *len = 0;
+
+    if (kind == OP_DIGEST) {
+        switch (mech) {
+        case CKM_MD5: *len = 16; break;
+        case CKM_SHA_1: *len = 20; break;
+        case CKM_SHA256: *len = 32; break;
+        case CKM_SHA384: *len = 48; break;
+        case CKM_SHA512: *len = 64; break;
+        }
+        return CKR_OK;
+    }
+
+    a[0].type = CKA_KEY_TYPE;
+    a[0].value = &type;
+    a[0].value_len = sizeof type;
+    a[1].type = CKA_MODULUS_BITS;
+    a[1].value = &bits;
+    a[1].value_len = sizeof bits;
+    a[2].type = CKA_EC_PARAMS;
+    a[2].value = params;
+    a[2].value_len = sizeof params;
+
+    /* Attributes the key does not have are marked unavailable, and
+     * the rest still returned. */
+    rv = pakchois_get_attribute_value(sess, key, a, 3);
+    if (rv != CKR_OK && rv != CKR_ATTRIBUTE_SENSITIVE
+        && rv != CKR_ATTRIBUTE_TYPE_INVALID && rv != CKR_BUFFER_TOO_SMALL) {
+        return rv;
+    }
+
+    if (a[0].value_len != sizeof type) {
+        return CKR_OK;
+    }
+
+    if (type == CKK_RSA && a[1].value_len == sizeof bits && bits) {
+        /* Signatures, ciphertexts, and the largest plaintexts, are
+         * all at most the modulus length. */
+        *len = (bits + 7) / 8;
+    }
+
+    if (type == CKK_EC && kind == OP_SIGN
+        && a[2].value_len != CK_UNAVAILABLE_INFORMATION) {
+        for (n = 0; n < sizeof ec_curves / sizeof ec_curves[0]; n++) {
+            if (a[2].value_len == ec_curves[n].oid_len
+                && memcmp(params, ec_curves[n].oid, a[2].value_len) == 0) {
+                *len = ec_curves[n].sig_len;
+            }
+        }
+    }
+
+    return CKR_OK;
+}
+
+/* Predict the output length of an operation, returning zero if
+ * unknown.  A length which cannot be derived is cached as zero, so
+ * the key attributes are read only once. */
+static unsigned long predict_len(pakchois_session_t *sess, enum op_kind kind,
+                                 ck_mechanism_type_t mech,
+                                 ck_object_handle_t key,
+                                 unsigned long input_len)
+{
+    unsigned long len, any;
+
+    if (!len_lookup(sess->slot, kind, mech, key, len_class(input_len),
+                    &len, &any)
+        && len == 0
+        && derive_len(sess, kind, mech, key, &any) == CKR_OK) {
+        len_store(sess->slot, kind, mech, key, LEN_ANY, any);
+    }
+
+    return len > any ? len : any;
+}
+
+ck_rv_t pakchois_get_output_length(pakchois_session_t *sess,
+                                   ck_flags_t operation,
+                                   struct ck_mechanism *mech,
+                                   ck_object_handle_t key,
+                                   unsigned long input_len,
+                                   unsigned long *len)
+{
+    enum op_kind kind = op_from_flags(operation);
+
+    if (kind == 0 || kind == OP_VERIFY) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    *len = predict_len(sess, kind, mech->mechanism, key, input_len);
+
+    return *len ? CKR_OK : CKR_FUNCTION_NOT_SUPPORTED;
+}
+
+/* Size of the stack buffer used to complete operations whose output
+ * is discarded; larger outputs are allocated. */
+#define OP_SCRATCH (512)
+
+/* Complete an operation left active by CKR_BUFFER_TOO_SMALL or a size
+ * query, for which the output needs len bytes, discarding the output.
+ * Returns non-zero if the operation could not be completed and
+ * remains active. */
+static int op_finish(pakchois_session_t *sess, enum op_kind kind,
+                     unsigned char *input, unsigned long input_len,
+                     unsigned long len)
+{
+    unsigned char stack[OP_SCRATCH], *scratch;
+    ck_rv_t rv;
+    int tries;
+
+    /* The provider may ask for more again; give up after a retry. */
+    for (tries = 0; tries < 2; tries++) {
+        scratch = len <= sizeof stack ? stack : malloc(len);
+        if (scratch == NULL) {
+            return 1;
+        }
+
+        rv = op_call(sess, kind, input, input_len, scratch, &len);
+        if (scratch != stack) {
+            free(scratch);
+        }
+
+        /* Any other result ends the operation. */
+        if (rv != CKR_BUFFER_TOO_SMALL) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Run a single-part operation with an output buffer allocated to
+ * the predicted length, retrying with a larger buffer if the
+ * prediction was too small.  The operation remains active after
+ * CKR_BUFFER_TOO_SMALL, so no further init call is needed.  If active
+ * is non-NULL, *active is set to non-zero if the operation could not
+ * be ended, which is possible only if CKR_HOST_MEMORY is returned. */
+static ck_rv_t op_alloc(pakchois_session_t *sess, enum op_kind kind,
+                        struct ck_mechanism *mech, ck_object_handle_t key,
+                        unsigned char *input, unsigned long input_len,
+                        unsigned char **output, unsigned long *output_len,
+                        int *active)
+{
+    unsigned long len;
+    unsigned char *buf = NULL;
+    ck_rv_t rv;
+    int dummy;
+
+    if (active == NULL) {
+        active = &dummy;
+    }
+    *active = 0;
+
+    len = predict_len(sess, kind, mech->mechanism, key, input_len);
+
+    rv = op_init(sess, kind, mech, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (len == 0) {
+        /* Unknown; ask the provider.  A failure ends the
+         * operation. */
+        rv = op_call(sess, kind, input, input_len, NULL, &len);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+
+    do {
+        unsigned char *nbuf = realloc(buf, len ? len : 1);
+
+        if (nbuf == NULL) {
+            free(buf);
+            *active = op_finish(sess, kind, input, input_len, len);
+            return CKR_HOST_MEMORY;
+        }
+        buf = nbuf;
+
+        rv = op_call(sess, kind, input, input_len, buf, &len);
+    } while (rv == CKR_BUFFER_TOO_SMALL);
+
+    if (rv != CKR_OK) {
+        free(buf);
+        return rv;
+    }
+
+    len_store(sess->slot, kind, mech->mechanism, key,
+              len_class(input_len), len);
+
+    *output = buf;
+    *output_len = len;
+    return CKR_OK;
+}
+
+/* Run a single-part operation into the caller's buffer, leaving no
+ * operation active on the session.  If output is NULL, the predicted
+ * length is returned without starting an operation where possible.
+ * If the provider reports CKR_BUFFER_TOO_SMALL, the (still active)
+ * operation is completed into a scratch buffer and discarded.  If
+ * active is non-NULL, *active is set to non-zero if the operation
+ * could not be ended, in which case CKR_HOST_MEMORY is returned. */
+static ck_rv_t op_oneshot(pakchois_session_t *sess, enum op_kind kind,
+                          struct ck_mechanism *mech, ck_object_handle_t key,
+                          unsigned char *input, unsigned long input_len,
+                          unsigned char *output, unsigned long *output_len,
+                          int *active)
+{
+    unsigned long len, need;
+    unsigned char *scratch;
+    ck_rv_t rv;
+    int dummy;
+
+    if (active == NULL) {
+        active = &dummy;
+    }
+    *active = 0;
+
+    if (output == NULL) {
+        if (kind == OP_VERIFY) {
+            return CKR_ARGUMENTS_BAD;
+        }
+
+        len = predict_len(sess, kind, mech->mechanism, key, input_len);
+        if (len) {
+            *output_len = len;
+            return CKR_OK;
+        }
+
+        /* Unpredictable: run the operation to find out. */
+        rv = op_alloc(sess, kind, mech, key, input, input_len,
+                      &scratch, output_len, active);
+        if (rv == CKR_OK) {
+            free(scratch);
+        }
+        return rv;
+    }
+
+    /* A buffer smaller than the predicted length is still passed to
+     * the provider, since only the provider knows the exact
+     * length. */
+    rv = op_init(sess, kind, mech, key);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = op_call(sess, kind, input, input_len, output, output_len);
+    if (kind == OP_VERIFY) {
+        return rv;
+    }
+    else if (rv == CKR_OK) {
+        len_store(sess->slot, kind, mech->mechanism, key,
+                  len_class(input_len), *output_len);
+        return rv;
+    }
+    else if (rv != CKR_BUFFER_TOO_SMALL) {
+        return rv;
+    }
+
+    need = *output_len;
+    len_store(sess->slot, kind, mech->mechanism, key,
+              len_class(input_len), need);
+
+    /* Complete the operation to leave the session clean. */
+    if (op_finish(sess, kind, input, input_len, need)) {
+        *active = 1;
+        return CKR_HOST_MEMORY;
+    }
+
+    *output_len = need;
+    return CKR_BUFFER_TOO_SMALL;
+}
+
+ck_rv_t pakchois_sign_oneshot(pakchois_session_t *sess,
+                              struct ck_mechanism *mech,
+                              ck_object_handle_t key,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char *signature,
+                              unsigned long *signature_len)
+{
+    return op_oneshot(sess, OP_SIGN, mech, key, data, data_len,
+                      signature, signature_len, NULL);
+}
+
+ck_rv_t pakchois_verify_oneshot(pakchois_session_t *sess,
+                                struct ck_mechanism *mech,
+                                ck_object_handle_t key,
+                                unsigned char *data, unsigned long data_len,
+                                unsigned char *signature,
+                                unsigned long signature_len)
+{
+    return op_oneshot(sess, OP_VERIFY, mech, key, data, data_len,
+                      signature, &signature_len, NULL);
+}
+
+ck_rv_t pakchois_encrypt_oneshot(pakchois_session_t *sess,
+                                 struct ck_mechanism *mech,
+                                 ck_object_handle_t key,
+                                 unsigned char *data, unsigned long data_len,
+                                 unsigned char *encrypted_data,
+                                 unsigned long *encrypted_data_len)
+{
+    return op_oneshot(sess, OP_ENCRYPT, mech, key, data, data_len,
+                      encrypted_data, encrypted_data_len, NULL);
+}
+
+ck_rv_t pakchois_decrypt_oneshot(pakchois_session_t *sess,
+                                 struct ck_mechanism *mech,
+                                 ck_object_handle_t key,
+                                 unsigned char *encrypted_data,
+                                 unsigned long encrypted_data_len,
+                                 unsigned char *data, unsigned long *data_len)
+{
+    return op_oneshot(sess, OP_DECRYPT, mech, key, encrypted_data,
+                      encrypted_data_len, data, data_len, NULL);
+}
+
+ck_rv_t pakchois_digest_oneshot(pakchois_session_t *sess,
+                                struct ck_mechanism *mech,
+                                unsigned char *data, unsigned long data_len,
+                                unsigned char *digest,
+                                unsigned long *digest_len)
+{
+    return op_oneshot(sess, OP_DIGEST, mech, CK_INVALID_HANDLE,
+                      data, data_len, digest, digest_len, NULL);
+}
+
+ck_rv_t pakchois_sign_alloc(pakchois_session_t *sess,
+                            struct ck_mechanism *mech,
+                            ck_object_handle_t key,
+                            unsigned char *data, unsigned long data_len,
+                            unsigned char **signature,
+                            unsigned long *signature_len)
+{
+    return op_alloc(sess, OP_SIGN, mech, key, data, data_len,
+                    signature, signature_len, NULL);
+}
+
+ck_rv_t pakchois_encrypt_alloc(pakchois_session_t *sess,
+                               struct ck_mechanism *mech,
+                               ck_object_handle_t key,
+                               unsigned char *data, unsigned long data_len,
+                               unsigned char **encrypted_data,
+                               unsigned long *encrypted_data_len)
+{
+    return op_alloc(sess, OP_ENCRYPT, mech, key, data, data_len,
+                    encrypted_data, encrypted_data_len, NULL);
+}
+
+ck_rv_t pakchois_decrypt_alloc(pakchois_session_t *sess,
+                               struct ck_mechanism *mech,
+                               ck_object_handle_t key,
+                               unsigned char *encrypted_data,
+                               unsigned long encrypted_data_len,
+                               unsigned char **data, unsigned long *data_len)
+{
+    return op_alloc(sess, OP_DECRYPT, mech, key, encrypted_data,
+                    encrypted_data_len, data, data_len, NULL);
+}
+
+ck_rv_t pakchois_digest_alloc(pakchois_session_t *sess,
+                              struct ck_mechanism *mech,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char **digest, unsigned long *digest_len)
+{
+    return op_alloc(sess, OP_DIGEST, mech, CK_INVALID_HANDLE, data, data_len,
+                    digest, digest_len, NULL);
+}
+
+/* Prepared operations. */
+
+struct pakchois_prepared_s {
+    pakchois_session_pool_t *pool;
+    enum op_kind kind;
+    struct ck_mechanism mech; /* parameter copied */
+    ck_object_handle_t key;
+};
+
+/* Check that the key exists and, if the provider says, may be used
+ * for the operation.  The operation itself is not initialized, since
+ * it could then only be ended by completing it. */
+static ck_rv_t prepared_check_key(pakchois_session_t *sess,
+                                  enum op_kind kind, ck_object_handle_t key)
+{
+    unsigned char allowed = 1;
+    struct ck_attribute a;
+    ck_rv_t rv;
+
+    switch (kind) {
+    case OP_SIGN: a.type = CKA_SIGN; break;
+    case OP_VERIFY: a.type = CKA_VERIFY; break;
+    case OP_ENCRYPT: a.type = CKA_ENCRYPT; break;
+    case OP_DECRYPT: a.type = CKA_DECRYPT; break;
+    default: return CKR_OK;
+    }
+    a.value = &allowed;
+    a.value_len = sizeof allowed;
+
+    rv = pakchois_get_attribute_value(sess, key, &a, 1);
+    switch (rv) {
+    case CKR_OK:
+        return a.value_len == sizeof allowed && !allowed
+            ? CKR_KEY_FUNCTION_NOT_PERMITTED : CKR_OK;
+    case CKR_OBJECT_HANDLE_INVALID:
+        return CKR_KEY_HANDLE_INVALID;
+    case CKR_ATTRIBUTE_TYPE_INVALID:
+    case CKR_ATTRIBUTE_SENSITIVE:
+        /* Left to the provider to check when the operation is run. */
+        return CKR_OK;
+    default:
+        return rv;
+    }
+}
+
+ck_rv_t pakchois_prepare(pakchois_prepared_t **prepared,
+                         pakchois_session_pool_t *pool,
+                         ck_flags_t operation,
+                         struct ck_mechanism *mech,
+                         ck_object_handle_t key)
+{
+    enum op_kind kind = op_from_flags(operation);
+    pakchois_prepared_t *prep;
+    pakchois_session_t *sess;
+    ck_rv_t rv;
+
+    if (kind == 0) {
+        return CKR_ARGUMENTS_BAD;
+    }
+
+    /* Check the mechanism against the (cached) mechanism
+     * information, if the provider gives any. */
+    rv = pakchois_mechanism_supported(pool->module, pool->slot_id,
+                                      mech->mechanism, operation);
+    if (rv == CKR_MECHANISM_INVALID) {
+        return rv;
+    }
+
+    rv = pakchois_session_pool_acquire(pool, &sess);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    rv = prepared_check_key(sess, kind, key);
+    pool_put(pool, sess, rv, 0);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    prep = pk_calloc(1, sizeof *prep);
+    if (prep == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (mech->parameter_len) {
+        prep->mech.parameter = pk_malloc(mech->parameter_len);
+        if (prep->mech.parameter == NULL) {
+            pk_free(prep);
+            return CKR_HOST_MEMORY;
+        }
+        memcpy(prep->mech.parameter, mech->parameter, mech->parameter_len);
+    }
+    prep->mech.mechanism = mech->mechanism;
+    prep->mech.parameter_len = mech->parameter_len;
+
+    prep->pool = pool;
+    prep->kind = kind;
+    prep->key = key;
+
+    *prepared = prep;
+    return CKR_OK;
+}
+
+ck_rv_t pakchois_prepared_run(pakchois_prepared_t *prep,
+                              unsigned char *input, unsigned long input_len,
+                              unsigned char *output, unsigned long *output_len)
+{
+    pakchois_session_t *sess;
+    ck_rv_t rv;
+    int active;
+
+    rv = pakchois_session_pool_acquire(prep->pool, &sess);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    rv = op_oneshot(sess, prep->kind, &prep->mech, prep->key,
+                    input, input_len, output, output_len, &active);
+
+    pool_put(prep->pool, sess, rv, active);
+    return rv;
+}
+
+void pakchois_prepared_destroy(pakchois_prepared_t *prep)
+{
+    pk_free(prep->mech.parameter);
+    pk_free(prep);
+}
+
+/* Asynchronous operations. */
+
+struct async_op {
+    enum op_kind kind;
+    struct ck_mechanism mech;
+    ck_object_handle_t key;
+    unsigned char *input;
+    unsigned long input_len;
+    /* For verify, the signature; otherwise the output buffer, with
+     * its length in output_len on submission, and the result length
+     * on completion. */
+    unsigned char *output;
+    unsigned long output_len;
+    void *userdata;
+    ck_rv_t rv;
+    /* For part of a batch, the results are stored in *rvp and
+     * *lenp rather than queued as a completion. */
+    struct async_batch *batch;
+    ck_rv_t *rvp;
+    unsigned long *lenp;
+    struct async_op *next;
+};
+
+/* A batch of operations, for which the submitter waits. */
+struct async_batch {
+    /* Operations not yet completed; protected by the async mutex. */
+    unsigned long remaining;
+};
+
+struct pakchois_async_s {
+    pakchois_session_pool_t *pool;
+
+    pthread_mutex_t mutex;
+    /* Signalled when an operation is submitted, or on shutdown. */
+    pthread_cond_t submit_cond;
+    /* Broadcast when an operation completes. */
+    pthread_cond_t done_cond;
+
+    /* FIFO queues of submitted and completed operations. */
+    struct async_op *queue, **queue_tail;
+    struct async_op *done, **done_tail;
+    unsigned int ndone;
+    /* Raised whilst completions are queued, once created. */
+    struct notifier notifier;
+    struct slab op_slab;
+    int shutdown;
+
+    unsigned int nthreads;
+    pthread_t *threads;
+};
+
+/* Run an operation using a pooled session. */
+static void async_run(pakchois_session_pool_t *pool, struct async_op *op)
+{
+    pakchois_session_t *sess;
+    ck_rv_t rv;
+    int active;
+
+    rv = pakchois_session_pool_acquire(pool, &sess);
+    if (rv != CKR_OK) {
+        op->rv = rv;
+        return;
+    }
+
+    /* A NULL output buffer is a size query, which may run the whole
+     * operation; either way the session is closed rather than
+     * returned to the pool if the operation could not be ended. */
+    rv = op_oneshot(sess, op->kind, &op->mech, op->key,
+                    op->input, op->input_len, op->output, &op->output_len,
+                    &active);
+
+    pool_put(pool, sess, rv, active);
+    op->rv = rv;
+}
+
+static void *async_worker(void *arg)
+{
+    pakchois_async_t *async = arg;
+    struct async_op *op;
+
+    pthread_mutex_lock(&async->mutex);
+
+    for (;;) {
+        while (async->queue == NULL && !async->shutdown) {
+            pthread_cond_wait(&async->submit_cond, &async->mutex);
+        }
+
+        /* Submitted operations are completed before shutting
+         * down. */
+        if ((op = async->queue) == NULL) {
+            break;
+        }
+
+        async->queue = op->next;
+        if (async->queue == NULL) {
+            async->queue_tail = &async->queue;
+        }
+        pthread_mutex_unlock(&async->mutex);
+
+        async_run(async->pool, op);
+
+        if (op->batch) {
+            *op->rvp = op->rv;
+            if (op->lenp) {
+                *op->lenp = op->output_len;
+            }
+
+            pthread_mutex_lock(&async->mutex);
+            if (--op->batch->remaining == 0) {
+                pthread_cond_broadcast(&async->done_cond);
+            }
+            slab_free(&async->op_slab, op);
+            continue;
+        }
+
+        pthread_mutex_lock(&async->mutex);
+        op->next = NULL;
+        *async->done_tail = op;
+        async->done_tail = &op->next;
+        if (async->ndone++ == 0) {
+            notifier_raise(&async->notifier);
+        }
+        pthread_cond_broadcast(&async->done_cond);
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+    return NULL;
+}
+
+ck_rv_t pakchois_async_create(pakchois_async_t **asyncp,
+                              pakchois_session_pool_t *pool,
+                              unsigned int threads)
+{
+    pakchois_async_t *async;
+    unsigned int n;
+
+    /* Each worker holds a pooled session while it runs an operation,
+     * so any more workers than sessions would only fail to acquire
+     * one. */
+    if (threads == 0 || threads > pool->params.max_sessions) {
+        threads = pool->params.max_sessions;
+    }
+
+    async = pk_calloc(1, sizeof *async);
+    if (async == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    async->threads = pk_calloc(threads, sizeof *async->threads);
+    if (async->threads == NULL) {
+        pk_free(async);
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_mutex_init(&async->mutex, NULL)) {
+        goto fail_free;
+    }
+    if (pthread_cond_init(&async->submit_cond, NULL)) {
+        goto fail_mutex;
+    }
+    if (monotonic_cond_init(&async->done_cond)) {
+        goto fail_submit;
+    }
+
+    async->pool = pool;
+    NOTIFIER_INIT(&async->notifier);
+    async->queue_tail = &async->queue;
+    async->done_tail = &async->done;
+    slab_init(&async->op_slab, sizeof(struct async_op));
+
+    for (n = 0; n < threads; n++) {
+        if (pthread_create(&async->threads[n], NULL, async_worker, async)) {
+            break;
+        }
+    }
+    async->nthreads = n;
+
+    if (n < threads) {
+        pakchois_async_destroy(async);
+        return CKR_GENERAL_ERROR;
+    }
+
+    *asyncp = async;
+    return CKR_OK;
+
+fail_submit:
+    pthread_cond_destroy(&async->submit_cond);
+fail_mutex:
+    pthread_mutex_destroy(&async->mutex);
+fail_free:
+    pk_free(async->threads);
+    pk_free(async);
+    return CKR_GENERAL_ERROR;
+}
+
+/* Allocate and queue an operation.  Must be called with the async
+ * mutex held; the caller must signal submit_cond.  Returns NULL on
+ * allocation failure. */
+static struct async_op *async_enqueue(pakchois_async_t *async, 
+                                      enum op_kind kind,
+                                      struct ck_mechanism *mech,
+                                      ck_object_handle_t key,
+                                      unsigned char *input,
+                                      unsigned long input_len,
+                                      unsigned char *output,
+                                      unsigned long output_len)
+{
+    struct async_op *op = slab_alloc(&async->op_slab);
+
+    if (op == NULL) {
+        return NULL;
+    }
+
+    op->kind = kind;
+    op->mech = *mech;
+    op->key = key;
+    op->input = input;
+    op->input_len = input_len;
+    op->output = output;
+    op->output_len = output_len;
+
+    *async->queue_tail = op;
+    async->queue_tail = &op->next;
+
+    return op;
+}
+
+static ck_rv_t async_submit(pakchois_async_t *async, enum op_kind kind,
+                            struct ck_mechanism *mech,
+                            ck_object_handle_t key,
+                            unsigned char *input, unsigned long input_len,
+                            unsigned char *output, unsigned long output_len,
+                            void *userdata)
+{
+    struct async_op *op;
+
+    if (pthread_mutex_lock(&async->mutex)) {
+        return CKR_CANT_LOCK;
+    }
+
+    op = async_enqueue(async, kind, mech, key, input, input_len, 
+                       output, output_len);
+    if (op == NULL) {
+        pthread_mutex_unlock(&async->mutex);
+        return CKR_HOST_MEMORY;
+    }
+    op->userdata = userdata;
+
+    pthread_cond_signal(&async->submit_cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    return CKR_OK;
+}
+
+ck_rv_t pakchois_async_sign(pakchois_async_t *async,
+                            struct ck_mechanism *mech,
+                            ck_object_handle_t key,
+                            unsigned char *data, unsigned long data_len,
+                            unsigned char *signature,
+                            unsigned long signature_len,
+                            void *userdata)
+{
+    return async_submit(async, OP_SIGN, mech, key, data, data_len,
+                        signature, signature_len, userdata);
+}
+
+ck_rv_t pakchois_async_verify(pakchois_async_t *async,
+                              struct ck_mechanism *mech,
+                              ck_object_handle_t key,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char *signature,
+                              unsigned long signature_len,
+                              void *userdata)
+{
+    return async_submit(async, OP_VERIFY, mech, key, data, data_len,
+                        signature, signature_len, userdata);
+}
+
+ck_rv_t pakchois_async_encrypt(pakchois_async_t *async,
+                               struct ck_mechanism *mech,
+                               ck_object_handle_t key,
+                               unsigned char *data, unsigned long data_len,
+                               unsigned char *encrypted_data,
+                               unsigned long encrypted_data_len,
+                               void *userdata)
+{
+    return async_submit(async, OP_ENCRYPT, mech, key, data, data_len,
+                        encrypted_data, encrypted_data_len, userdata);
+}
+
+ck_rv_t pakchois_async_decrypt(pakchois_async_t *async,
+                               struct ck_mechanism *mech,
+                               ck_object_handle_t key,
+                               unsigned char *encrypted_data,
+                               unsigned long encrypted_data_len,
+                               unsigned char *data, unsigned long data_len,
+                               void *userdata)
+{
+    return async_submit(async, OP_DECRYPT, mech, key, encrypted_data,
+                        encrypted_data_len, data, data_len, userdata);
+}
+
+ck_rv_t pakchois_async_digest(pakchois_async_t *async,
+                              struct ck_mechanism *mech,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char *digest, unsigned long digest_len,
+                              void *userdata)
+{
+    return async_submit(async, OP_DIGEST, mech, CK_INVALID_HANDLE,
+                        data, data_len, digest, digest_len, userdata);
+}
+
+/* Move up to max completions to the caller's array.  Must be called
+ * with the async mutex held. */
+static unsigned int async_reap(pakchois_async_t *async,
+                               struct pakchois_completion *completions,
+                               unsigned int max)
+{
+    struct async_op *op;
+    unsigned int n;
+
+    for (n = 0; n < max && (op = async->done) != NULL; n++) {
+        completions[n].userdata = op->userdata;
+        completions[n].rv = op->rv;
+        completions[n].output_len = 
+            op->kind == OP_VERIFY ? 0 : op->output_len;
+
+        async->done = op->next;
+        async->ndone--;
+        slab_free(&async->op_slab, op);
+    }
+
+    if (async->done == NULL) {
+        async->done_tail = &async->done;
+        notifier_clear(&async->notifier);
+    }
+
+    return n;
+}
+
+unsigned int pakchois_async_poll(pakchois_async_t *async,
+                                 struct pakchois_completion *completions,
+                                 unsigned int max)
+{
+    unsigned int n;
+
+    if (pthread_mutex_lock(&async->mutex)) {
+        return 0;
+    }
+    n = async_reap(async, completions, max);
+    pthread_mutex_unlock(&async->mutex);
+
+    return n;
+}
+
+unsigned int pakchois_async_wait(pakchois_async_t *async,
+                                 struct pakchois_completion *completions,
+                                 unsigned int max, int timeout)
+{
+    struct timespec deadline;
+    unsigned int n;
+
+    if (pthread_mutex_lock(&async->mutex)) {
+        return 0;
+    }
+
+    if (timeout > 0) {
+        monotonic_deadline(&deadline, timeout);
+    }
+
+    while (async->done == NULL && timeout != 0) {
+        if (timeout < 0) {
+            pthread_cond_wait(&async->done_cond, &async->mutex);
+        }
+        else if (pthread_cond_timedwait(&async->done_cond, &async->mutex,
+                                        &deadline) == ETIMEDOUT) {
+            break;
+        }
+    }
+
+    n = async_reap(async, completions, max);
+    pthread_mutex_unlock(&async->mutex);
+
+    return n;
+}
+
+/* Queue count operations as a batch, calling setup() to set the
+ * input, output and result pointers of the operation for each item
+ * n, and wait for all of them to complete.  The number of operations
+ * queued is stored in *queued; the rest could not be allocated. */
+static ck_rv_t async_batch_run(pakchois_async_t *async, enum op_kind kind,
+                               struct ck_mechanism *mech,
+                               ck_object_handle_t key, unsigned long count,
+                               void (*setup)(struct async_op *op,
+                                             unsigned long n, void *arg),
+                               void *arg, unsigned long *queued)
+{
+    struct async_batch batch;
+    struct async_op *op;
+    unsigned long n;
+
+    if (pthread_mutex_lock(&async->mutex)) {
+        return CKR_CANT_LOCK;
+    }
+
+    batch.remaining = 0;
+    for (n = 0; n < count; n++) {
+        op = async_enqueue(async, kind, mech, key, NULL, 0, NULL, 0);
+        if (op == NULL) {
+            break;
+        }
+        op->batch = &batch;
+        op->lenp = NULL;
+        setup(op, n, arg);
+        batch.remaining++;
+    }
+    *queued = n;
+
+    pthread_cond_broadcast(&async->submit_cond);
+
+    while (batch.remaining) {
+        pthread_cond_wait(&async->done_cond, &async->mutex);
+    }
+
+    pthread_mutex_unlock(&async->mutex);
+    return CKR_OK;
+}
+
+struct sign_batch {
+    struct pakchois_sign_item *items;
+    unsigned char *signatures;
+    unsigned long stride;
+};
+
+static void sign_batch_setup(struct async_op *op, unsigned long n, void *arg)
+{
+    struct sign_batch *sb = arg;
+
+    op->input = sb->items[n].data;
+    op->input_len = sb->items[n].data_len;
+    if (sb->signatures) {
+        op->output = sb->signatures + n * sb->stride;
+        op->output_len = sb->stride;
+    }
+    op->rvp = &sb->items[n].rv;
+    op->lenp = &sb->items[n].length;
+}
+
+ck_rv_t pakchois_sign_batch(pakchois_async_t *async,
+                            struct ck_mechanism *mech,
+                            ck_object_handle_t key,
+                            struct pakchois_sign_item *items,
+                            unsigned long count,
+                            unsigned char *signatures,
+                            unsigned long signatures_len)
+{
+    struct sign_batch sb;
+    unsigned long n, offset;
+    ck_rv_t rv;
+
+    if (count == 0) {
+        return CKR_OK;
+    }
+
+    /* Each signature is written into its own stride of the buffer,
+     * then packed once all are complete.  Without a buffer, each
+     * operation only finds the length of its signature. */
+    sb.items = items;
+    sb.signatures = signatures;
+    sb.stride = signatures ? signatures_len / count : 0;
+
+    rv = async_batch_run(async, OP_SIGN, mech, key, count,
+                         sign_batch_setup, &sb, &n);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    for (; n < count; n++) {
+        items[n].rv = CKR_HOST_MEMORY;
+        items[n].length = 0;
+    }
+
+    for (n = offset = 0; n < count; n++) {
+        items[n].offset = offset;
+        if (items[n].rv != CKR_OK) {
+            if (items[n].rv != CKR_BUFFER_TOO_SMALL) {
+                items[n].length = 0;
+            }
+            continue;
+        }
+        if (signatures && offset != n * sb.stride) {
+            memmove(signatures + offset, signatures + n * sb.stride,
+                    items[n].length);
+        }
+        offset += items[n].length;
+    }
+
+    return CKR_OK;
+}
+
+static void verify_batch_setup(struct async_op *op, unsigned long n,
+                               void *arg)
+{
+    struct pakchois_verify_item *items = arg;
+
+    op->input = items[n].data;
+    op->input_len = items[n].data_len;
+    op->output = items[n].signature;
+    op->output_len = items[n].signature_len;
+    op->rvp = &items[n].rv;
+}
+
+ck_rv_t pakchois_verify_batch(pakchois_async_t *async,
+                              struct ck_mechanism *mech,
+                              ck_object_handle_t key,
+                              struct pakchois_verify_item *items,
+                              unsigned long count)
+{
+    unsigned long n;
+    ck_rv_t rv;
+
+    rv = async_batch_run(async, OP_VERIFY, mech, key, count,
+                         verify_batch_setup, items, &n);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    for (; n < count; n++) {
+        items[n].rv = CKR_HOST_MEMORY;
+    }
+
+    return CKR_OK;
+}
+
+int pakchois_async_fd(pakchois_async_t *async)
+{
+    int fd;
+
+    if (pthread_mutex_lock(&async->mutex)) {
+        return -1;
+    }
+
+    if (async->notifier.rfd < 0 && notifier_open(&async->notifier) == 0
+        && async->ndone) {
+        notifier_raise(&async->notifier);
+    }
+    fd = async->notifier.rfd;
+
+    pthread_mutex_unlock(&async->mutex);
+    return fd;
+}
+
+void pakchois_async_destroy(pakchois_async_t *async)
+{
+    unsigned int n;
+
+    pthread_mutex_lock(&async->mutex);
+    async->shutdown = 1;
+    pthread_cond_broadcast(&async->submit_cond);
+    pthread_mutex_unlock(&async->mutex);
+
+    for (n = 0; n < async->nthreads; n++) {
+        pthread_join(async->threads[n], NULL);
+    }
+
+    /* Undelivered completions are simply discarded along with the
+     * slab. */
+    slab_destroy(&async->op_slab);
+    notifier_close(&async->notifier);
+    pthread_cond_destroy(&async->done_cond);
+    pthread_cond_destroy(&async->submit_cond);
+    pthread_mutex_destroy(&async->mutex);
+    pk_free(async->threads);
+    pk_free(async);
+}
+
+/* Object search. */
+
+#define FIND_CHUNK_MIN (16)
+#define FIND_CHUNK_MAX (1024)
+
+struct pakchois_find_iter_s {
+    pakchois_session_t *session;
+    int active; /* search not yet finalized */
+    /* Buffered handles: buf[pos] to buf[count - 1] are unread. */
+    ck_object_handle_t *buf;
+    unsigned long pos, count, chunk;
+};
+
+ck_rv_t pakchois_find_iter_init(pakchois_find_iter_t **iterp,
+                                pakchois_session_t *sess,
+                                struct ck_attribute *templ,
+                                unsigned long count)
+{
+    pakchois_find_iter_t *iter;
+    ck_rv_t rv;
+
+    iter = pk_calloc(1, sizeof *iter);
+    if (iter == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    iter->buf = pk_malloc(FIND_CHUNK_MAX * sizeof *iter->buf);
+    if (iter->buf == NULL) {
+        pk_free(iter);
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = pakchois_find_objects_init(sess, templ, count);
+    if (rv != CKR_OK) {
+        pk_free(iter->buf);
+        pk_free(iter);
+        return rv;
+    }
+
+    iter->session = sess;
+    iter->active = 1;
+    iter->chunk = FIND_CHUNK_MIN;
+
+    *iterp = iter;
+    return CKR_OK;
+}
+
+/* Refill the buffer with the next chunk of handles, finalizing the
+ * search once the provider returns no handles.  A provider may return
+ * fewer handles than asked for before the end of the search, so a
+ * short chunk does not end it. */
+static ck_rv_t find_refill(pakchois_find_iter_t *iter)
+{
+    ck_rv_t rv;
+
+    iter->pos = iter->count = 0;
+
+    rv = pakchois_find_objects(iter->session, iter->buf, iter->chunk,
+                               &iter->count);
+    if (rv != CKR_OK || iter->count == 0) {
+        ck_rv_t frv = pakchois_find_objects_final(iter->session);
+
+        iter->active = 0;
+        if (rv == CKR_OK) {
+            rv = frv;
+        }
+    }
+    else if (iter->count == iter->chunk && iter->chunk < FIND_CHUNK_MAX) {
+        iter->chunk *= 2;
+    }
+
+    return rv;
+}
+
+ck_rv_t pakchois_find_iter_next(pakchois_find_iter_t *iter,
+                                ck_object_handle_t *object)
+{
+    ck_rv_t rv;
+
+    if (iter->pos == iter->count) {
+        if (!iter->active) {
+            *object = CK_INVALID_HANDLE;
+            return CKR_OK;
+        }
+
+        rv = find_refill(iter);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+
+        if (iter->count == 0) {
+            *object = CK_INVALID_HANDLE;
+            return CKR_OK;
+        }
+    }
+
+    *object = iter->buf[iter->pos++];
+    return CKR_OK;
+}
+
+void pakchois_find_iter_destroy(pakchois_find_iter_t *iter)
+{
+    if (iter->active) {
+        pakchois_find_objects_final(iter->session);
+    }
+
+    pk_free(iter->buf);
+    pk_free(iter);
+}
+
+ck_rv_t pakchois_find_all(pakchois_session_t *sess,
+                          struct ck_attribute *templ, unsigned long count,
+                          ck_object_handle_t **objects,
+                          unsigned long *nobjects)
+{
+    unsigned long chunk = FIND_CHUNK_MIN, size = 0, n = 0, got;
+    ck_object_handle_t *vec = NULL;
+    ck_rv_t rv, frv;
+
+    rv = pakchois_find_objects_init(sess, templ, count);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    for (;;) {
+        if (n + chunk > size) {
+            ck_object_handle_t *nvec;
+
+            size = n + chunk;
+            nvec = realloc(vec, size * sizeof *vec);
+            if (nvec == NULL) {
+                rv = CKR_HOST_MEMORY;
+                break;
+            }
+            vec = nvec;
+        }
+
+        rv = pakchois_find_objects(sess, vec + n, chunk, &got);
+        if (rv != CKR_OK) {
+            break;
+        }
+        n += got;
+
+        /* Only an empty chunk marks the end of the search. */
+        if (got == 0) {
+            break;
+        }
+        if (got == chunk && chunk < FIND_CHUNK_MAX) {
+            chunk *= 2;
+        }
+    }
+
+    frv = pakchois_find_objects_final(sess);
+    if (rv == CKR_OK) {
+        rv = frv;
+    }
+
+    if (rv != CKR_OK) {
+        free(vec);
+        return rv;
+    }
+
+    *objects = vec;
+    *nobjects = n;
+    return CKR_OK;
+}
+
+/* Attribute arenas. */
+
+#define ARENA_ALIGN (16)
+#define ARENA_MIN (4096)
+
+struct arena_block {
+    struct arena_block *next;
+    size_t size, used;
+};
+
+#define ARENA_HEADER ((sizeof(struct arena_block) + ARENA_ALIGN - 1) \
+                      & ~(size_t)(ARENA_ALIGN - 1))
+
+/* Largest block size, such that neither rounding an allocation up
+ * to it nor adding the header can overflow. */
+#define ARENA_MAX ((SIZE_MAX - ARENA_HEADER) & ~(size_t)(ARENA_ALIGN - 1))
+
+/* A bump allocator: allocations are carved from the current block,
+ * and a new block at least twice the size of the last is added when
+ * it is full.  Nothing is freed until the arena is reset. */
+struct pakchois_arena_s {
+    struct arena_block *blocks; /* most recent first */
+    size_t total; /* bytes allocated since the last reset */
+};
+
+static struct arena_block *arena_block(size_t size)
+{
+    struct arena_block *b;
+
+    if (size > ARENA_MAX) {
+        return NULL;
+    }
+
+    b = pk_malloc(ARENA_HEADER + size);
+
+    if (b) {
+        b->next = NULL;
+        b->size = size;
+        b->used = 0;
+    }
+
+    return b;
+}
+
+ck_rv_t pakchois_arena_create(pakchois_arena_t **arenap, size_t size)
+{
+    pakchois_arena_t *arena = pk_malloc(sizeof *arena);
+
+    if (arena == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    arena->blocks = arena_block(size > ARENA_MIN ? size : ARENA_MIN);
+    if (arena->blocks == NULL) {
+        pk_free(arena);
+        return CKR_HOST_MEMORY;
+    }
+    arena->total = 0;
+
+    *arenap = arena;
+    return CKR_OK;
+}
+
+void *pakchois_arena_alloc(pakchois_arena_t *arena, size_t size)
+{
+    struct arena_block *b = arena->blocks;
+    void *p;
+
+    if (size > ARENA_MAX) {
+        return NULL;
+    }
+
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    if (b->size - b->used < size) {
+        size_t bsize = b->size;
+
+        /* Double the block size, stopping at the largest. */
+        do {
+            bsize = bsize > ARENA_MAX / 2 ? ARENA_MAX : bsize * 2;
+        } while (bsize < size);
+
+        b = arena_block(bsize);
+        if (b == NULL) {
+            return NULL;
+        }
+        b->next = arena->blocks;
+        arena->blocks = b;
+    }
+
+    p = (char *)b + ARENA_HEADER + b->used;
+    b->used += size;
+    arena->total += size;
+
+    return p;
+}
+
+void pakchois_arena_reset(pakchois_arena_t *arena)
+{
+    struct arena_block *b = arena->blocks, *next;
+
+    if (b->next) {
+        /* Replace all the blocks with one which would have held
+         * everything, so that the same use next time fits in one
+         * block. */
+        struct arena_block *nb = arena_block(arena->total);
+
+        if (nb) {
+            for (; b; b = next) {
+                next = b->next;
+                pk_free(b);
+            }
+            arena->blocks = b = nb;
+        }
+    }
+
+    for (; b; b = b->next) {
+        b->used = 0;
+    }
+    arena->total = 0;
+}
+
+void pakchois_arena_destroy(pakchois_arena_t *arena)
+{
+    struct arena_block *b, *next;
+
+    for (b = arena->blocks; b; b = next) {
+        next = b->next;
+        pk_free(b);
+    }
+
+    pk_free(arena);
+}
+
+/* Returns a guess at the length of an attribute value. */
+static unsigned long attr_guess(ck_attribute_type_t type)
+{
+    switch (type) {
+    case CKA_CLASS:
+    case CKA_KEY_TYPE:
+    case CKA_CERTIFICATE_TYPE:
+    case CKA_MODULUS_BITS:
+    case CKA_VALUE_LEN:
+        return sizeof(unsigned long);
+    case CKA_TOKEN:
+    case CKA_PRIVATE:
+    case CKA_TRUSTED:
+    case CKA_SENSITIVE:
+    case CKA_ENCRYPT:
+    case CKA_DECRYPT:
+    case CKA_WRAP:
+    case CKA_UNWRAP:
+    case CKA_SIGN:
+    case CKA_VERIFY:
+    case CKA_DERIVE:
+    case CKA_EXTRACTABLE:
+    case CKA_LOCAL:
+    case CKA_NEVER_EXTRACTABLE:
+    case CKA_ALWAYS_SENSITIVE:
+    case CKA_MODIFIABLE:
+        return 1;
+    case CKA_VALUE:
+        return 2048;
+    case CKA_MODULUS:
+        return 512;
+    case CKA_SUBJECT:
+    case CKA_ISSUER:
+        return 256;
+    default:
+        return 128;
+    }
+}
+
+ck_rv_t pakchois_get_attributes(pakchois_session_t *sess,
+                                ck_object_handle_t object,
+                                struct ck_attribute *templ,
+                                unsigned long count,
+                                pakchois_arena_t *arena)
+{
+    struct ck_attribute *retry;
+    unsigned long n, m, nretry, *idx;
+    ck_rv_t rv, qrv;
+
+    /* First try to fetch everything into buffers of the hinted or
+     * guessed size, which needs only the one call in most cases. */
+    for (n = 0; n < count; n++) {
+        if (templ[n].value_len == 0
+            || templ[n].value_len == CK_UNAVAILABLE_INFORMATION) {
+            templ[n].value_len = attr_guess(templ[n].type);
+        }
+        templ[n].value = pakchois_arena_alloc(arena, templ[n].value_len);
+        if (templ[n].value == NULL) {
+            return CKR_HOST_MEMORY;
+        }
+    }
+
+    rv = pakchois_get_attribute_value(sess, object, templ, count);
+    if (rv != CKR_BUFFER_TOO_SMALL
+        && rv != CKR_ATTRIBUTE_SENSITIVE
+        && rv != CKR_ATTRIBUTE_TYPE_INVALID) {
+        return rv;
+    }
+
+    /* Any attribute left unavailable was either too big for its
+     * buffer, or really is sensitive or invalid: query the lengths
+     * of those to tell which. */
+    for (n = nretry = 0; n < count; n++) {
+        if (templ[n].value_len == CK_UNAVAILABLE_INFORMATION) {
+            templ[n].value = NULL;
+            nretry++;
+        }
+    }
+
+    if (nretry == 0) {
+        return rv;
+    }
+
+    retry = pakchois_arena_alloc(arena, nretry * sizeof *retry);
+    idx = pakchois_arena_alloc(arena, nretry * sizeof *idx);
+    if (retry == NULL || idx == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    for (n = m = 0; n < count; n++) {
+        if (templ[n].value == NULL) {
+            retry[m].type = templ[n].type;
+            retry[m].value = NULL;
+            retry[m].value_len = 0;
+            idx[m++] = n;
+        }
+    }
+
+    qrv = pakchois_get_attribute_value(sess, object, retry, nretry);
+    if (qrv != CKR_OK
+        && qrv != CKR_ATTRIBUTE_SENSITIVE
+        && qrv != CKR_ATTRIBUTE_TYPE_INVALID) {
+        return qrv;
+    }
+
+    /* Fetch those which now have a known length into buffers of
+     * exactly that size. */
+    for (n = m = 0; n < nretry; n++) {
+        if (retry[n].value_len == CK_UNAVAILABLE_INFORMATION) {
+            continue;
+        }
+        retry[n].value = pakchois_arena_alloc(arena, retry[n].value_len);
+        if (retry[n].value == NULL) {
+            return CKR_HOST_MEMORY;
+        }
+        retry[m] = retry[n];
+        idx[m++] = idx[n];
+    }
+
+    if (m) {
+        rv = pakchois_get_attribute_value(sess, object, retry, m);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+        for (n = 0; n < m; n++) {
+            templ[idx[n]].value = retry[n].value;
+            templ[idx[n]].value_len = retry[n].value_len;
+        }
+    }
+
+    /* Report any which are still unavailable as the provider would
+     * have done. */
+    return qrv;
+}
+
+/* Immutable attribute cache. */
+
+struct attr_value {
+    struct attr_value *next;
+    ck_attribute_type_t type;
+    unsigned long len;
+    unsigned char data[];
+};
+
+/* A cached object.  Only the attributes of token objects are
+ * cached; session objects are recorded with token set to zero, so
+ * they need not be checked again. */
+struct attr_object {
+    struct attr_object *next;
+    ck_object_handle_t handle;
+    ck_object_class_t class;
+    unsigned char token;
+    struct attr_value *values;
+};
+
+/* Hash table of objects by handle. */
+struct attr_cache {
+    struct attr_object **table;
+    unsigned int size, count;
+};
+
+#define ATTR_CACHE_MIN (64)
+
+static void free_attr_object(struct attr_object *obj)
+{
+    struct attr_value *v, *next;
+
+    for (v = obj->values; v; v = next) {
+        next = v->next;
+        pk_free(v);
+    }
+    pk_free(obj);
+}
+
+static void free_attr_cache(struct attr_cache *ac)
+{
+    struct attr_object *obj, *next;
+    unsigned int n;
+
+    if (ac == NULL) {
+        return;
+    }
+
+    for (n = 0; n < ac->size; n++) {
+        for (obj = ac->table[n]; obj; obj = next) {
+            next = obj->next;
+            free_attr_object(obj);
+        }
+    }
+
+    pk_free(ac->table);
+    pk_free(ac);
+}
+
+static unsigned int attr_bucket(const struct attr_cache *ac,
+                                ck_object_handle_t handle)
+{
+    return (unsigned int)((handle * 2654435761UL) >> 7) & (ac->size - 1);
+}
+
+static struct attr_object **attr_find(struct attr_cache *ac,
+                                      ck_object_handle_t handle)
+{
+    struct attr_object **objp = &ac->table[attr_bucket(ac, handle)];
+
+    while (*objp && (*objp)->handle != handle) {
+        objp = &(*objp)->next;
+    }
+
+    return objp;
+}
+
+static const struct attr_value *attr_find_value(const struct attr_object *obj,
+                                                ck_attribute_type_t type)
+{
+    const struct attr_value *v;
+
+    for (v = obj->values; v && v->type != type; v = v->next)
+        ;
+
+    return v;
+}
+
+/* Returns non-zero if the attribute of an object of the given class
+ * can never change. */
+static int attr_immutable(ck_object_class_t class, ck_attribute_type_t type)
+{
+    switch (type) {
+    case CKA_CLASS:
+    case CKA_TOKEN:
+    case CKA_KEY_TYPE:
+    case CKA_CERTIFICATE_TYPE:
+    case CKA_MODULUS:
+    case CKA_MODULUS_BITS:
+    case CKA_PUBLIC_EXPONENT:
+    case CKA_EC_PARAMS:
+    case CKA_EC_POINT:
+        return 1;
+    case CKA_VALUE:
+    case CKA_SUBJECT:
+    case CKA_ISSUER:
+    case CKA_SERIAL_NUMBER:
+        return class == CKO_CERTIFICATE;
+    default:
+        return 0;
+    }
+}
+
+/* Attempt to satisfy the template from the cache, as
+ * C_GetAttributeValue would.  Returns non-zero, with the result in
+ * *rv, if every attribute was found; otherwise returns zero, leaving
+ * the template untouched, and stores the slot's generation and count
+ * of forgotten objects in *generation and *changes for a subsequent
+ * attr_cache_put(). */
+static int attr_cache_get(struct slot *slot, ck_object_handle_t object,
+                          struct ck_attribute *templ, unsigned long count,
+                          unsigned long *generation, unsigned long *changes,
+                          ck_rv_t *rv)
+{
+    struct attr_object *obj;
+    const struct attr_value *v;
+    unsigned long n;
+    int hit = 0;
+
+    *generation = *changes = 0;
+
+    if (!__atomic_load_n(&slot->attr_caching, __ATOMIC_RELAXED)
+        || pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return 0;
+    }
+
+    *generation = slot->generation;
+    *changes = slot->attr_changes;
+
+    obj = slot->attrs ? *attr_find(slot->attrs, object) : NULL;
+    if (obj == NULL || !obj->token) {
+        goto out;
+    }
+
+    for (n = 0; n < count; n++) {
+        if (attr_find_value(obj, templ[n].type) == NULL) {
+            goto out;
+        }
+    }
+
+    hit = 1;
+    *rv = CKR_OK;
+    for (n = 0; n < count; n++) {
+        v = attr_find_value(obj, templ[n].type);
+        if (templ[n].value == NULL) {
+            templ[n].value_len = v->len;
+        }
+        else if (templ[n].value_len < v->len) {
+            templ[n].value_len = CK_UNAVAILABLE_INFORMATION;
+            *rv = CKR_BUFFER_TOO_SMALL;
+        }
+        else {
+            memcpy(templ[n].value, v->data, v->len);
+            templ[n].value_len = v->len;
+        }
+    }
+
+out:
+    pthread_rwlock_unlock(&slot->cache_lock);
+    return hit;
+}
+
+/* Add an object record to the cache, creating the cache if *acp is
+ * NULL and growing the table as necessary.  Must be called with the
+ * cache_lock held for writing if the cache belongs to a slot. */
+static struct attr_object *attr_add_object(struct attr_cache **acp,
+                                           ck_object_handle_t handle)
+{
+    struct attr_cache *ac = *acp;
+    struct attr_object *obj, **objp;
+
+    if (ac == NULL) {
+        ac = pk_calloc(1, sizeof *ac);
+        if (ac == NULL) {
+            return NULL;
+        }
+        ac->size = ATTR_CACHE_MIN;
+        ac->table = pk_calloc(ac->size, sizeof *ac->table);
+        if (ac->table == NULL) {
+            pk_free(ac);
+            return NULL;
+        }
+        *acp = ac;
+    }
+    else if (ac->count >= ac->size) {
+        struct attr_object **old = ac->table, *next;
+        unsigned int n, oldsize = ac->size;
+
+        ac->table = pk_calloc(oldsize * 2, sizeof *ac->table);
+        if (ac->table == NULL) {
+            ac->table = old;
+        }
+        else {
+            ac->size = oldsize * 2;
+            for (n = 0; n < oldsize; n++) {
+                for (obj = old[n]; obj; obj = next) {
+                    next = obj->next;
+                    objp = &ac->table[attr_bucket(ac, obj->handle)];
+                    obj->next = *objp;
+                    *objp = obj;
+                }
+            }
+            pk_free(old);
+        }
+    }
+
+    obj = pk_calloc(1, sizeof *obj);
+    if (obj) {
+        objp = &ac->table[attr_bucket(ac, handle)];
+        obj->handle = handle;
+        obj->next = *objp;
+        *objp = obj;
+        ac->count++;
+    }
+
+    return obj;
+}
+
+/* Store any immutable attributes of the object from a template
+ * filled by C_GetAttributeValue.  Nothing is stored if the slot has
+ * been invalidated, or any object forgotten, since the given
+ * generation and count were read, since the handle may since belong
+ * to another object. */
+static void attr_cache_put(pakchois_session_t *sess,
+                           ck_object_handle_t object,
+                           const struct ck_attribute *templ,
+                           unsigned long count, unsigned long generation,
+                           unsigned long changes)
+{
+    struct slot *slot = sess->slot;
+    struct attr_object *obj, **objp;
+    struct attr_value *v;
+    ck_object_class_t class = CK_UNAVAILABLE_INFORMATION;
+    unsigned char token = 0;
+    struct ck_attribute a[2];
+    unsigned long n;
+    int known, have = 0;
+
+    if (!__atomic_load_n(&slot->attr_caching, __ATOMIC_RELAXED)
+        || pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return;
+    }
+    known = slot->attrs && *attr_find(slot->attrs, object) != NULL;
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    /* The first time an object is seen, find out whether it is a
+     * token object, and its class, unless the template says. */
+    for (n = 0; !known && n < count; n++) {
+        if (templ[n].value == NULL) {
+            continue;
+        }
+        if (templ[n].type == CKA_CLASS && templ[n].value_len == sizeof class) {
+            memcpy(&class, templ[n].value, sizeof class);
+            have |= 1;
+        }
+        else if (templ[n].type == CKA_TOKEN
+                 && templ[n].value_len == sizeof token) {
+            token = *(unsigned char *)templ[n].value;
+            have |= 2;
+        }
+    }
+
+    if (!known && have != 3) {
+        a[0].type = CKA_CLASS;
+        a[0].value = &class;
+        a[0].value_len = sizeof class;
+        a[1].type = CKA_TOKEN;
+        a[1].value = &token;
+        a[1].value_len = sizeof token;
+        if (CALLS3(GetAttributeValue, object, a, 2) != CKR_OK) {
+            return;
+        }
+    }
+
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+
+    if (!slot->attr_caching || slot->generation != generation
+        || slot->attr_changes != changes) {
+        goto out;
+    }
+
+    objp = slot->attrs ? attr_find(slot->attrs, object) : NULL;
+    if (objp && *objp) {
+        obj = *objp;
+    }
+    else if (known) {
+        /* Discarded in the meantime. */
+        goto out;
+    }
+    else if ((obj = attr_add_object(&slot->attrs, object)) != NULL) {
+        obj->class = class;
+        obj->token = token != 0;
+    }
+    else {
+        goto out;
+    }
+
+    if (!obj->token) {
+        goto out;
+    }
+
+    for (n = 0; n < count; n++) {
+        if (templ[n].value == NULL
+            || templ[n].value_len == CK_UNAVAILABLE_INFORMATION
+            || !attr_immutable(obj->class, templ[n].type)
+            || attr_find_value(obj, templ[n].type)) {
+            continue;
+        }
+
+        v = pk_malloc(sizeof *v + templ[n].value_len);
+        if (v == NULL) {
+            break;
+        }
+        v->type = templ[n].type;
+        v->len = templ[n].value_len;
+        memcpy(v->data, templ[n].value, v->len);
+        v->next = obj->values;
+        obj->values = v;
+    }
+
+out:
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+/* Discard anything cached for the object. */
+static void attr_cache_forget(struct slot *slot, ck_object_handle_t object)
+{
+    struct attr_object **objp, *obj;
+
+    if (!__atomic_load_n(&slot->attr_caching, __ATOMIC_RELAXED)
+        || pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+
+    if (slot->attrs) {
+        objp = attr_find(slot->attrs, object);
+        if ((obj = *objp) != NULL) {
+            *objp = obj->next;
+            slot->attrs->count--;
+            free_attr_object(obj);
+        }
+    }
+    slot->attr_changes++;
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+ck_rv_t pakchois_set_attribute_cache(pakchois_module_t *mod,
+                                     ck_slot_id_t slot_id, int enable)
+{
+    struct slot *slot = find_or_create_slot(mod, slot_id);
+
+    if (slot == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return CKR_CANT_LOCK;
+    }
+
+    __atomic_store_n(&slot->attr_caching, enable != 0, __ATOMIC_RELAXED);
+    if (!enable) {
+        free_attr_cache(slot->attrs);
+        slot->attrs = NULL;
+    }
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    return CKR_OK;
+}
+
+/* Object index. */
+
+/* An index entry maps the class and CKA_ID or CKA_LABEL of a token
+ * object to its handle.  An entry with CK_INVALID_HANDLE records a
+ * search which found no such object. */
+struct index_entry {
+    struct index_entry *next;
+    unsigned int hash;
+    ck_object_handle_t handle;
+    ck_object_class_t class;
+    ck_attribute_type_t type;
+    unsigned long len;
+    unsigned char data[];
+};
+
+struct object_index {
+    struct index_entry **table;
+    unsigned int size, count;
+    unsigned int misses; /* entries with CK_INVALID_HANDLE */
+};
+
+#define INDEX_MIN (64)
+
+/* Attributes fetched for each indexed object. */
+enum { IDX_CLASS, IDX_TOKEN, IDX_ID, IDX_LABEL, IDX_COUNT };
+
+static unsigned int index_hash(ck_object_class_t class,
+                               ck_attribute_type_t type,
+                               const unsigned char *data, unsigned long len)
+{
+    unsigned int h = 2166136261U;
+
+    h = (h ^ (unsigned int)class) * 16777619U;
+    h = (h ^ (unsigned int)type) * 16777619U;
+    while (len--) {
+        h = (h ^ *data++) * 16777619U;
+    }
+
+    return h;
+}
+
+static struct object_index *index_create(void)
+{
+    struct object_index *idx = pk_malloc(sizeof *idx);
+
+    if (idx) {
+        idx->size = INDEX_MIN;
+        idx->count = idx->misses = 0;
+        idx->table = pk_calloc(idx->size, sizeof *idx->table);
+        if (idx->table == NULL) {
+            pk_free(idx);
+            idx = NULL;
+        }
+    }
+
+    return idx;
+}
+
+static void free_object_index(struct object_index *idx)
+{
+    struct index_entry *e, *next;
+    unsigned int n;
+
+    if (idx == NULL) {
+        return;
+    }
+
+    for (n = 0; n < idx->size; n++) {
+        for (e = idx->table[n]; e; e = next) {
+            next = e->next;
+            pk_free(e);
+        }
+    }
+
+    pk_free(idx->table);
+    pk_free(idx);
+}
+
+/* Returns non-zero on allocation failure. */
+static int index_insert(struct object_index *idx, ck_object_handle_t handle,
+                        ck_object_class_t class, ck_attribute_type_t type,
+                        const void *data, unsigned long len)
+{
+    struct index_entry *e, **ep;
+
+    if (idx->count >= idx->size) {
+        struct index_entry **old = idx->table, *next;
+        unsigned int n, oldsize = idx->size;
+
+        idx->table = pk_calloc(oldsize * 2, sizeof *idx->table);
+        if (idx->table == NULL) {
+            idx->table = old;
+        }
+        else {
+            idx->size = oldsize * 2;
+            for (n = 0; n < oldsize; n++) {
+                for (e = old[n]; e; e = next) {
+                    next = e->next;
+                    ep = &idx->table[e->hash & (idx->size - 1)];
+                    e->next = *ep;
+                    *ep = e;
+                }
+            }
+            pk_free(old);
+        }
+    }
+
+    e = pk_malloc(sizeof *e + len);
+    if (e == NULL) {
+        return -1;
+    }
+
+    e->hash = index_hash(class, type, data, len);
+    e->handle = handle;
+    e->class = class;
+    e->type = type;
+    e->len = len;
+    memcpy(e->data, data, len);
+
+    ep = &idx->table[e->hash & (idx->size - 1)];
+    e->next = *ep;
+    *ep = e;
+    idx->count++;
+    if (handle == CK_INVALID_HANDLE) {
+        idx->misses++;
+    }
+
+    return 0;
+}
+
+/* Returns the entry for an object with the given class and CKA_ID or
+ * CKA_LABEL, or NULL if there is none. */
+static const struct index_entry *index_find(const struct object_index *idx,
+                                            ck_object_class_t class,
+                                            ck_attribute_type_t type,
+                                            const void *data,
+                                            unsigned long len)
+{
+    unsigned int hash = index_hash(class, type, data, len);
+    const struct index_entry *e;
+
+    for (e = idx->table[hash & (idx->size - 1)]; e; e = e->next) {
+        if (e->hash == hash && e->class == class && e->type == type
+            && e->len == len && memcmp(e->data, data, len) == 0) {
+            return e;
+        }
+    }
+
+    return NULL;
+}
+
+/* Remove all entries for the handle, or with CK_INVALID_HANDLE, all
+ * recorded misses; this scans the whole index, but is only needed
+ * when an object is created, destroyed or relabelled. */
+static void index_remove(struct object_index *idx, ck_object_handle_t handle)
+{
+    struct index_entry **ep, *e;
+    unsigned int n;
+
+    if (handle == CK_INVALID_HANDLE) {
+        if (idx->misses == 0) {
+            return;
+        }
+        idx->misses = 0;
+    }
+
+    for (n = 0; n < idx->size; n++) {
+        for (ep = &idx->table[n]; (e = *ep) != NULL; ) {
+            if (e->handle == handle) {
+                *ep = e->next;
+                idx->count--;
+                pk_free(e);
+            }
+            else {
+                ep = &e->next;
+            }
+        }
+    }
+}
+
+/* Fetch the attributes to be indexed for an object into the arena. */
+static ck_rv_t index_fetch(pakchois_session_t *sess, ck_object_handle_t handle,
+                           struct ck_attribute *a, pakchois_arena_t *arena)
+{
+    ck_rv_t rv;
+
+    a[IDX_CLASS].type = CKA_CLASS;
+    a[IDX_TOKEN].type = CKA_TOKEN;
+    a[IDX_ID].type = CKA_ID;
+    a[IDX_LABEL].type = CKA_LABEL;
+    a[IDX_CLASS].value_len = a[IDX_TOKEN].value_len = 0;
+    a[IDX_ID].value_len = a[IDX_LABEL].value_len = 0;
+
+    rv = pakchois_get_attributes(sess, handle, a, IDX_COUNT, arena);
+    if (rv == CKR_ATTRIBUTE_SENSITIVE || rv == CKR_ATTRIBUTE_TYPE_INVALID) {
+        rv = CKR_OK;
+    }
+
+    return rv;
+}
+
+/* Add the entries for an object, from attributes fetched by
+ * index_fetch(), to the index; session objects are skipped.  Returns
+ * non-zero on allocation failure. */
+static int index_add_entries(struct object_index *idx,
+                             ck_object_handle_t handle,
+                             const struct ck_attribute *a)
+{
+    ck_object_class_t class;
+
+    if (a[IDX_CLASS].value_len != sizeof class
+        || a[IDX_TOKEN].value_len != 1
+        || *(unsigned char *)a[IDX_TOKEN].value == 0) {
+        return 0;
+    }
+
+    memcpy(&class, a[IDX_CLASS].value, sizeof class);
+
+    if (a[IDX_ID].value_len != CK_UNAVAILABLE_INFORMATION
+        && index_insert(idx, handle, class, CKA_ID,
+                        a[IDX_ID].value, a[IDX_ID].value_len)) {
+        return -1;
+    }
+
+    if (a[IDX_LABEL].value_len != CK_UNAVAILABLE_INFORMATION
+        && index_insert(idx, handle, class, CKA_LABEL,
+                        a[IDX_LABEL].value, a[IDX_LABEL].value_len)) {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Build the index for the session's slot from all the token objects
+ * visible to the session. */
+static ck_rv_t index_build(pakchois_session_t *sess)
+{
+    struct slot *slot = sess->slot;
+    unsigned char yes = 1;
+    struct ck_attribute templ, a[IDX_COUNT];
+    unsigned long n, count, generation, changes;
+    ck_object_handle_t *objects;
+    struct object_index *idx;
+    pakchois_arena_t *arena = NULL;
+    ck_rv_t rv;
+    int have;
+
+    snap_objects(sess);
+
+    if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return CKR_CANT_LOCK;
+    }
+    have = slot->index != NULL;
+    generation = slot->generation;
+    changes = slot->index_changes;
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    /* Adopted from the snapshot. */
+    if (have) {
+        return CKR_OK;
+    }
+
+    templ.type = CKA_TOKEN;
+    templ.value = &yes;
+    templ.value_len = sizeof yes;
+
+    rv = pakchois_find_all(sess, &templ, 1, &objects, &count);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    idx = index_create();
+    if (idx == NULL) {
+        free(objects);
+        return CKR_HOST_MEMORY;
+    }
+
+    rv = pakchois_arena_create(&arena, 0);
+    for (n = 0; rv == CKR_OK && n < count; n++) {
+        rv = index_fetch(sess, objects[n], a, arena);
+        if (rv == CKR_OK && index_add_entries(idx, objects[n], a)) {
+            rv = CKR_HOST_MEMORY;
+        }
+        else if (rv == CKR_OBJECT_HANDLE_INVALID) {
+            /* Destroyed in the meantime. */
+            rv = CKR_OK;
+        }
+        pakchois_arena_reset(arena);
+    }
+
+    if (arena) {
+        pakchois_arena_destroy(arena);
+    }
+    free(objects);
+
+    if (rv != CKR_OK) {
+        free_object_index(idx);
+        return rv;
+    }
+
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        free_object_index(idx);
+        return CKR_CANT_LOCK;
+    }
+    /* Install the index unless another thread beat us to it, or it
+     * may be stale. */
+    if (slot->index == NULL && slot->generation == generation
+        && slot->index_changes == changes) {
+        slot->index = idx;
+        idx = NULL;
+    }
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    free_object_index(idx);
+    return CKR_OK;
+}
+
+/* Add a new or modified object to the slot's index, if there is
+ * one, discarding any recorded misses it may now match. */
+static void index_add(pakchois_session_t *sess, ck_object_handle_t handle)
+{
+    struct slot *slot = sess->slot;
+    struct ck_attribute a[IDX_COUNT];
+    pakchois_arena_t *arena = NULL;
+    unsigned long generation;
+    int have, fetched = 0;
+
+    if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+        return;
+    }
+    have = slot->index != NULL;
+    generation = slot->generation;
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    if (have && pakchois_arena_create(&arena, 0) == CKR_OK) {
+        fetched = index_fetch(sess, handle, a, arena) == CKR_OK;
+    }
+
+    if (pthread_rwlock_wrlock(&slot->cache_lock) == 0) {
+        if (fetched && slot->index && slot->generation == generation) {
+            /* The handle may already be indexed if it was found by a
+             * search. */
+            index_remove(slot->index, handle);
+            if (index_add_entries(slot->index, handle, a)) {
+                /* Rather than leave the object half-indexed, drop the
+                 * index to be rebuilt. */
+                free_object_index(slot->index);
+                slot->index = NULL;
+            }
+        }
+        if (slot->index) {
+            index_remove(slot->index, CK_INVALID_HANDLE);
+        }
+        slot->index_changes++;
+        pthread_rwlock_unlock(&slot->cache_lock);
+    }
+
+    if (arena) {
+        pakchois_arena_destroy(arena);
+    }
+}
+
+/* Record that no object matches the given class and attribute, unless
+ * the index has changed since the search began. */
+static void index_miss(struct slot *slot, unsigned long generation,
+                       unsigned long changes, ck_object_class_t class,
+                       ck_attribute_type_t type,
+                       const void *data, unsigned long len)
+{
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+
+    /* If out of memory, the miss is just not recorded. */
+    if (slot->index && slot->generation == generation
+        && slot->index_changes == changes) {
+        index_insert(slot->index, CK_INVALID_HANDLE, class, type, data, len);
+    }
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+/* Remove an object from the slot's index, or with CK_INVALID_HANDLE,
+ * the recorded misses. */
+static void index_forget(struct slot *slot, ck_object_handle_t handle)
+{
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+
+    if (slot->index) {
+        index_remove(slot->index, handle);
+    }
+    slot->index_changes++;
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+static ck_rv_t lookup_object(pakchois_session_t *sess,
+                             ck_object_class_t class,
+                             ck_attribute_type_t type,
+                             const void *data, unsigned long len,
+                             ck_object_handle_t *object)
+{
+    struct slot *slot = sess->slot;
+    struct ck_attribute templ[2];
+    const struct index_entry *e = NULL;
+    ck_object_handle_t handle = CK_INVALID_HANDLE;
+    unsigned long count, generation, changes;
+    int indexed, built = 0;
+    ck_rv_t rv, frv;
+
+    for (;;) {
+        if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+            return CKR_CANT_LOCK;
+        }
+        indexed = slot->index != NULL;
+        if (indexed) {
+            e = index_find(slot->index, class, type, data, len);
+            handle = e ? e->handle : CK_INVALID_HANDLE;
+        }
+        generation = slot->generation;
+        changes = slot->index_changes;
+        pthread_rwlock_unlock(&slot->cache_lock);
+
+        /* Found, or known to be missing. */
+        if (e) {
+            *object = handle;
+            return CKR_OK;
+        }
+        else if (indexed || built) {
+            break;
+        }
+
+        rv = index_build(sess);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+        built = 1;
+    }
+
+    /* Fall back on a search, which will find objects the index
+     * missed, such as private objects which were not visible when it
+     * was built. */
+    templ[0].type = CKA_CLASS;
+    templ[0].value = &class;
+    templ[0].value_len = sizeof class;
+    templ[1].type = type;
+    templ[1].value = (void *)data;
+    templ[1].value_len = len;
+
+    rv = pakchois_find_objects_init(sess, templ, 2);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+    rv = pakchois_find_objects(sess, &handle, 1, &count);
+    frv = pakchois_find_objects_final(sess);
+    if (rv == CKR_OK) {
+        rv = frv;
+    }
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    if (count == 0) {
+        handle = CK_INVALID_HANDLE;
+        index_miss(slot, generation, changes, class, type, data, len);
+    }
+    else {
+        index_add(sess, handle);
+    }
+
+    *object = handle;
+    return CKR_OK;
+}
+
+ck_rv_t pakchois_lookup_object(pakchois_session_t *sess,
+                               ck_object_class_t class,
+                               const unsigned char *id, unsigned long id_len,
+                               ck_object_handle_t *object)
+{
+    return lookup_object(sess, class, CKA_ID, id, id_len, object);
+}
+
+ck_rv_t pakchois_lookup_object_by_label(pakchois_session_t *sess,
+                                        ck_object_class_t class,
+                                        const char *label,
+                                        ck_object_handle_t *object)
+{
+    return lookup_object(sess, class, CKA_LABEL, label, strlen(label),
+                         object);
+}
+
+/* Certificate index. */
+
+/* An indexed certificate, linked into hash chains by handle, by
+ * subject, and by issuer and serial number.  The names and serial
+ * number are held as the DER-encoded attribute values. */
+struct cert_entry {
+    struct cert_entry *hnext, *snext, *inext;
+    ck_object_handle_t handle;
+    unsigned int shash, ihash;
+    int seen;
+    const unsigned char *subject, *issuer, *serial;
+    unsigned long subject_len, issuer_len, serial_len;
+    unsigned char data[];
+};
+
+/* The index is valid for the given slot generation; if the slot has
+ * been invalidated since, or stale is set, it is refreshed before
+ * use.  Entries are kept across a refresh only if the generation is
+ * unchanged, since the handle of a certificate on a token which has
+ * been removed and reinserted may since belong to another one. */
+struct cert_index {
+    struct cert_entry **by_handle, **by_subject, **by_issuer;
+    unsigned int size, count;
+    unsigned long generation;
+    int stale;
+    unsigned char token_serial[16];
+};
+
+#define CERT_INDEX_MIN (64)
+#define CERT_CHAIN_MAX (16)
+#define CERT_REFRESH_TRIES (3)
+
+static unsigned int cert_hash(const unsigned char *a, unsigned long alen,
+                              const unsigned char *b, unsigned long blen)
+{
+    unsigned int h = 2166136261U;
+
+    while (alen--) {
+        h = (h ^ *a++) * 16777619U;
+    }
+    while (blen--) {
+        h = (h ^ *b++) * 16777619U;
+    }
+
+    return h;
+}
+
+static unsigned int handle_bucket(ck_object_handle_t handle, unsigned int size)
+{
+    return (unsigned int)((handle * 2654435761UL) >> 7) & (size - 1);
+}
+
+static struct cert_index *cert_index_create(const unsigned char *serial)
+{
+    struct cert_index *ci = pk_calloc(1, sizeof *ci);
+
+    if (ci == NULL) {
+        return NULL;
+    }
+
+    ci->size = CERT_INDEX_MIN;
+    ci->by_handle = pk_calloc(ci->size, sizeof *ci->by_handle);
+    ci->by_subject = pk_calloc(ci->size, sizeof *ci->by_subject);
+    ci->by_issuer = pk_calloc(ci->size, sizeof *ci->by_issuer);
+    if (!ci->by_handle || !ci->by_subject || !ci->by_issuer) {
+        free_cert_index(ci);
+        return NULL;
+    }
+    memcpy(ci->token_serial, serial, sizeof ci->token_serial);
+
+    return ci;
+}
+
+static void free_cert_index(struct cert_index *ci)
+{
+    struct cert_entry *e, *next;
+    unsigned int n;
+
+    if (ci == NULL) {
+        return;
+    }
+
+    for (n = 0; ci->by_handle && n < ci->size; n++) {
+        for (e = ci->by_handle[n]; e; e = next) {
+            next = e->hnext;
+            pk_free(e);
+        }
+    }
+
+    pk_free(ci->by_handle);
+    pk_free(ci->by_subject);
+    pk_free(ci->by_issuer);
+    pk_free(ci);
+}
+
+static struct cert_entry **cert_by_handle(struct cert_index *ci,
+                                          ck_object_handle_t handle)
+{
+    struct cert_entry **ep = &ci->by_handle[handle_bucket(handle, ci->size)];
+
+    while (*ep && (*ep)->handle != handle) {
+        ep = &(*ep)->hnext;
+    }
+
+    return ep;
+}
+
+static void cert_link(struct cert_index *ci, struct cert_entry *e)
+{
+    struct cert_entry **ep;
+
+    ep = &ci->by_handle[handle_bucket(e->handle, ci->size)];
+    e->hnext = *ep;
+    *ep = e;
+    ep = &ci->by_subject[e->shash & (ci->size - 1)];
+    e->snext = *ep;
+    *ep = e;
+    ep = &ci->by_issuer[e->ihash & (ci->size - 1)];
+    e->inext = *ep;
+    *ep = e;
+}
+
+/* Add an entry to the index, growing the tables if necessary. */
+static void cert_insert(struct cert_index *ci, struct cert_entry *e)
+{
+    if (ci->count >= ci->size) {
+        struct cert_entry **h = ci->by_handle, **sb = ci->by_subject;
+        struct cert_entry **ib = ci->by_issuer, *c, *next;
+        unsigned int n, oldsize = ci->size;
+
+        ci->by_handle = pk_calloc(oldsize * 2, sizeof *h);
+        ci->by_subject = pk_calloc(oldsize * 2, sizeof *h);
+        ci->by_issuer = pk_calloc(oldsize * 2, sizeof *h);
+        if (!ci->by_handle || !ci->by_subject || !ci->by_issuer) {
+            /* Carry on with longer chains. */
+            pk_free(ci->by_handle);
+            pk_free(ci->by_subject);
+            pk_free(ci->by_issuer);
+            ci->by_handle = h;
+            ci->by_subject = sb;
+            ci->by_issuer = ib;
+        }
+        else {
+            ci->size = oldsize * 2;
+            for (n = 0; n < oldsize; n++) {
+                for (c = h[n]; c; c = next) {
+                    next = c->hnext;
+                    cert_link(ci, c);
+                }
+            }
+            pk_free(h);
+            pk_free(sb);
+            pk_free(ib);
+        }
+    }
+
+    cert_link(ci, e);
+    ci->count++;
+}
+
+/* Unlink and free the entry for the handle, if any. */
+static void cert_remove(struct cert_index *ci, ck_object_handle_t handle)
+{
+    struct cert_entry **ep = cert_by_handle(ci, handle), *e = *ep;
+
+    if (e == NULL) {
+        return;
+    }
+
+    *ep = e->hnext;
+    for (ep = &ci->by_subject[e->shash & (ci->size - 1)]; *ep != e;
+         ep = &(*ep)->snext)
+        ;
+    *ep = e->snext;
+    for (ep = &ci->by_issuer[e->ihash & (ci->size - 1)]; *ep != e;
+         ep = &(*ep)->inext)
+        ;
+    *ep = e->inext;
+
+    ci->count--;
+    pk_free(e);
+}
+
+/* Fetch the names and serial number of a certificate into a new,
+ * unlinked, entry.  Returns CKR_OK with *ep set to NULL if the
+ * certificate lacks any of them. */
+static ck_rv_t cert_fetch(pakchois_session_t *sess, ck_object_handle_t handle,
+                          pakchois_arena_t *arena, struct cert_entry **ep)
+{
+    struct ck_attribute a[3];
+    struct cert_entry *e;
+    unsigned char *p;
+    ck_rv_t rv;
+
+    *ep = NULL;
+
+    a[0].type = CKA_SUBJECT;
+    a[1].type = CKA_ISSUER;
+    a[2].type = CKA_SERIAL_NUMBER;
+    a[0].value_len = a[1].value_len = 0;
+    a[2].value_len = 32;
+
+    rv = pakchois_get_attributes(sess, handle, a, 3, arena);
+    if (rv == CKR_ATTRIBUTE_SENSITIVE || rv == CKR_ATTRIBUTE_TYPE_INVALID) {
+        return CKR_OK;
+    }
+    else if (rv != CKR_OK) {
+        return rv;
+    }
+
+    e = pk_malloc(sizeof *e + a[0].value_len + a[1].value_len
+                  + a[2].value_len);
+    if (e == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+
+    e->handle = handle;
+    e->seen = 1;
+    p = e->data;
+    memcpy(p, a[0].value, a[0].value_len);
+    e->subject = p;
+    e->subject_len = a[0].value_len;
+    p += a[0].value_len;
+    memcpy(p, a[1].value, a[1].value_len);
+    e->issuer = p;
+    e->issuer_len = a[1].value_len;
+    p += a[1].value_len;
+    memcpy(p, a[2].value, a[2].value_len);
+    e->serial = p;
+    e->serial_len = a[2].value_len;
+
+    e->shash = cert_hash(e->subject, e->subject_len, NULL, 0);
+    e->ihash = cert_hash(e->issuer, e->issuer_len, e->serial, e->serial_len);
+
+    *ep = e;
+    return CKR_OK;
+}
+
+/* Bring the slot's certificate index up to date: enumerate the
+ * certificates on the token, and fetch the attributes of only those
+ * not already indexed, unless the slot has been invalidated since
+ * the index was built, in which case they are fetched for all. */
+static ck_rv_t cert_refresh(pakchois_session_t *sess)
+{
+    struct slot *slot = sess->slot;
+    ck_object_class_t class = CKO_CERTIFICATE;
+    unsigned char yes = 1;
+    struct ck_attribute templ[2];
+    struct ck_token_info info;
+    struct cert_entry *e, *fresh = NULL, *next;
+    ck_object_handle_t *objects, *missing = NULL;
+    unsigned long n, count, nmissing, generation;
+    pakchois_arena_t *arena = NULL;
+    struct cert_index *ci;
+    unsigned int b;
+    ck_rv_t rv;
+
+    rv = pakchois_get_cached_token_info(sess->module, slot->id, &info,
+                                        &generation);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    templ[0].type = CKA_CLASS;
+    templ[0].value = &class;
+    templ[0].value_len = sizeof class;
+    templ[1].type = CKA_TOKEN;
+    templ[1].value = &yes;
+    templ[1].value_len = sizeof yes;
+
+    rv = pakchois_find_all(sess, templ, 2, &objects, &count);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    missing = pk_malloc((count + 1) * sizeof *missing);
+    if (missing == NULL) {
+        rv = CKR_HOST_MEMORY;
+        goto out;
+    }
+
+    if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+        rv = CKR_CANT_LOCK;
+        goto out;
+    }
+    ci = slot->certs;
+    if (ci && (ci->generation != generation
+               || memcmp(ci->token_serial, info.serial_number,
+                         sizeof ci->token_serial))) {
+        ci = NULL;
+    }
+    for (n = nmissing = 0; n < count; n++) {
+        if (ci == NULL || *cert_by_handle(ci, objects[n]) == NULL) {
+            missing[nmissing++] = objects[n];
+        }
+    }
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+    rv = pakchois_arena_create(&arena, 0);
+    for (n = 0; rv == CKR_OK && n < nmissing; n++) {
+        rv = cert_fetch(sess, missing[n], arena, &e);
+        if (rv == CKR_OBJECT_HANDLE_INVALID) {
+            /* Destroyed in the meantime. */
+            rv = CKR_OK;
+        }
+        else if (rv == CKR_OK && e) {
+            e->hnext = fresh;
+            fresh = e;
+        }
+        pakchois_arena_reset(arena);
+    }
+    if (rv != CKR_OK) {
+        goto out;
+    }
+
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        rv = CKR_CANT_LOCK;
+        goto out;
+    }
+
+    ci = slot->certs;
+    if (ci == NULL || memcmp(ci->token_serial, info.serial_number,
+                             sizeof ci->token_serial)) {
+        ci = cert_index_create(info.serial_number);
+        if (ci == NULL) {
+            pthread_rwlock_unlock(&slot->cache_lock);
+            rv = CKR_HOST_MEMORY;
+            goto out;
+        }
+        free_cert_index(slot->certs);
+        slot->certs = ci;
+    }
+
+    /* Drop the certificates no longer on the token, and any entries
+     * for the handles fetched again, which may have been added by
+     * another thread or describe another certificate; then add the
+     * ones fetched. */
+    for (b = 0; b < ci->size; b++) {
+        for (e = ci->by_handle[b]; e; e = e->hnext) {
+            e->seen = 0;
+        }
+    }
+    for (n = 0; n < count; n++) {
+        if ((e = *cert_by_handle(ci, objects[n])) != NULL) {
+            e->seen = 1;
+        }
+    }
+    for (n = 0; n < nmissing; n++) {
+        if ((e = *cert_by_handle(ci, missing[n])) != NULL) {
+            e->seen = 0;
+        }
+    }
+    for (b = 0; b < ci->size; b++) {
+        for (e = ci->by_handle[b]; e; e = next) {
+            next = e->hnext;
+            if (!e->seen) {
+                cert_remove(ci, e->handle);
+            }
+        }
+    }
+
+    for (e = fresh; e; e = next) {
+        next = e->hnext;
+        cert_insert(ci, e);
+    }
+    fresh = NULL;
+    ci->generation = generation;
+    ci->stale = 0;
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+
+out:
+    for (e = fresh; e; e = next) {
+        next = e->hnext;
+        pk_free(e);
+    }
+    if (arena) {
+        pakchois_arena_destroy(arena);
+    }
+    pk_free(missing);
+    free(objects);
+    return rv;
+}
+
+/* Mark the certificate index for refresh after an object has been
+ * added or modified, or remove a destroyed object from it.  With
+ * CK_INVALID_HANDLE, just marks the index for refresh, as after a
+ * login or logout changes which certificates are visible. */
+static void cert_forget(struct slot *slot, ck_object_handle_t handle,
+                        int added)
+{
+    if (pthread_rwlock_wrlock(&slot->cache_lock)) {
+        return;
+    }
+
+    if (slot->certs) {
+        cert_remove(slot->certs, handle);
+        if (added) {
+            slot->certs->stale = 1;
+        }
+    }
+
+    pthread_rwlock_unlock(&slot->cache_lock);
+}
+
+/* Take the cache_lock for reading with the slot's certificate index
+ * up to date.  Returns CKR_OK with the lock held, or an error
+ * without.  If the index is invalidated by another thread during
+ * each of CERT_REFRESH_TRIES refreshes, the index from the last
+ * refresh is used, reflecting the token as it was then. */
+static ck_rv_t cert_lock(pakchois_session_t *sess)
+{
+    struct slot *slot = sess->slot;
+    int tries;
+    ck_rv_t rv;
+
+    for (tries = 0; ; tries++) {
+        if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+            return CKR_CANT_LOCK;
+        }
+        /* Once built, the index is never freed before the module. */
+        if (slot->certs && (tries == CERT_REFRESH_TRIES
+                            || (!slot->certs->stale
+                                && slot->certs->generation
+                                == slot->generation))) {
+            return CKR_OK;
+        }
+        pthread_rwlock_unlock(&slot->cache_lock);
+
+        rv = cert_refresh(sess);
+        if (rv != CKR_OK) {
+            return rv;
+        }
+    }
+}
+
+ck_rv_t pakchois_find_certificate(pakchois_session_t *sess,
+                                  const unsigned char *issuer,
+                                  unsigned long issuer_len,
+                                  const unsigned char *serial,
+                                  unsigned long serial_len,
+                                  ck_object_handle_t *object)
+{
+    unsigned int hash = cert_hash(issuer, issuer_len, serial, serial_len);
+    struct cert_index *ci;
+    struct cert_entry *e;
+    ck_rv_t rv;
+
+    rv = cert_lock(sess);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    ci = sess->slot->certs;
+    for (e = ci->by_issuer[hash & (ci->size - 1)]; e; e = e->inext) {
+        if (e->ihash == hash
+            && e->issuer_len == issuer_len && e->serial_len == serial_len
+            && memcmp(e->issuer, issuer, issuer_len) == 0
+            && memcmp(e->serial, serial, serial_len) == 0) {
+            break;
+        }
+    }
+    *object = e ? e->handle : CK_INVALID_HANDLE;
+
+    pthread_rwlock_unlock(&sess->slot->cache_lock);
+    return CKR_OK;
+}
+
+/* Copy the handles of the certificates with the given subject into
+ * objects, up to max, and return the total number. */
+static unsigned long cert_subjects(const struct cert_index *ci,
+                                   const unsigned char *subject,
+                                   unsigned long subject_len,
+                                   ck_object_handle_t *objects,
+                                   unsigned long max)
+{
+    unsigned int hash = cert_hash(subject, subject_len, NULL, 0);
+    const struct cert_entry *e;
+    unsigned long n = 0;
+
+    for (e = ci->by_subject[hash & (ci->size - 1)]; e; e = e->snext) {
+        if (e->shash == hash && e->subject_len == subject_len
+            && memcmp(e->subject, subject, subject_len) == 0) {
+            if (n < max) {
+                objects[n] = e->handle;
+            }
+            n++;
+        }
+    }
+
+    return n;
+}
+
+ck_rv_t pakchois_find_certificates_by_subject(pakchois_session_t *sess,
+                                              const unsigned char *subject,
+                                              unsigned long subject_len,
+                                              ck_object_handle_t *objects,
+                                              unsigned long *count)
+{
+    unsigned long n;
+    ck_rv_t rv;
+
+    rv = cert_lock(sess);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    n = cert_subjects(sess->slot->certs, subject, subject_len, objects,
+                      objects ? *count : 0);
+
+    pthread_rwlock_unlock(&sess->slot->cache_lock);
+
+    rv = objects && n > *count ? CKR_BUFFER_TOO_SMALL : CKR_OK;
+    *count = n;
+    return rv;
+}
+
+ck_rv_t pakchois_build_chain(pakchois_session_t *sess,
+                             ck_object_handle_t cert,
+                             ck_object_handle_t *chain,
+                             unsigned long *count)
+{
+    ck_object_handle_t cands[CERT_CHAIN_MAX];
+    struct cert_index *ci;
+    struct cert_entry *e;
+    unsigned long n = 0, m, k, ncands;
+    ck_rv_t rv;
+
+    rv = cert_lock(sess);
+    if (rv != CKR_OK) {
+        return rv;
+    }
+
+    ci = sess->slot->certs;
+    e = *cert_by_handle(ci, cert);
+    if (e == NULL) {
+        pthread_rwlock_unlock(&sess->slot->cache_lock);
+        return CKR_OBJECT_HANDLE_INVALID;
+    }
+
+    for (;;) {
+        if (n == *count) {
+            rv = CKR_BUFFER_TOO_SMALL;
+            break;
+        }
+        chain[n++] = e->handle;
+
+        /* Stop at a self-issued certificate. */
+        if (e->issuer_len == e->subject_len
+            && memcmp(e->issuer, e->subject, e->subject_len) == 0) {
+            break;
+        }
+
+        /* Take the first certificate for the issuer's name which is
+         * not already in the chain. */
+        ncands = cert_subjects(ci, e->issuer, e->issuer_len, cands,
+                               CERT_CHAIN_MAX);
+        if (ncands > CERT_CHAIN_MAX) {
+            ncands = CERT_CHAIN_MAX;
+        }
+        for (m = 0; m < ncands; m++) {
+            for (k = 0; k < n && chain[k] != cands[m]; k++)
+                ;
+            if (k == n) {
+                break;
+            }
+        }
+        if (m == ncands) {
+            break;
+        }
+        e = *cert_by_handle(ci, cands[m]);
+    }
+
+    pthread_rwlock_unlock(&sess->slot->cache_lock);
+
+    *count = n;
+    return rv;
+}
+
+/* Cache snapshots. */
+
+/* A snapshot file is a header, a table of slot records, then the
+ * sections the records refer to.  All fields are 64-bit integers in
+ * host byte order and every section is 8-byte aligned, so the file
+ * is used in place once mapped.  Offsets are from the start of the
+ * file; a zero offset means the section is absent.  Nothing in the
+ * file is trusted: each section is bounds-checked when used. */
+#define SNAP_MAGIC "PKCHSNAP"
+#define SNAP_VERSION (2)
+#define SNAP_BOM (0x01020304U)
+
+struct snap_header {
+    char magic[8];
+    uint32_t version, bom;
+    uint64_t size, nslots;
+};
+
+struct snap_slot {
+    unsigned char label[32], serial[16];
+    /* Token hardware and firmware versions, major then minor. */
+    unsigned char hardware[2], firmware[2], pad[4];
+    uint64_t mechs, nmechs; /* snap_mech records */
+    uint64_t index, nindex; /* snap_entry records */
+    uint64_t attrs, nattrs; /* snap_object records */
+};
+
+struct snap_mech {
+    uint64_t type, min_key_size, max_key_size, flags;
+};
+
+/* An object index entry, followed by the value. */
+struct snap_entry {
+    uint64_t handle, class, type, len;
+};
+
+/* A cached object, followed by nvalues snap_value records, each
+ * followed by the value. */
+struct snap_object {
+    uint64_t handle, class, token, nvalues;
+};
+
+struct snap_value {
+    uint64_t type, len;
+};
+
+#define SNAP_PAD(n) (((n) + 7) & ~(uint64_t)7)
+
+/* Slot snapshot states. */
+#define SNAP_MECHS (1)
+#define SNAP_OBJECTS (2)
+
+/* Number of objects checked against the token before the object
+ * index and attribute cache are adopted. */
+#define SNAP_SPOT_CHECKS (4)
+
+/* Growable buffer used to write a snapshot. */
+struct snap_buf {
+    unsigned char *data;
+    uint64_t len, size;
+    int failed;
+};
+
+/* Append len bytes, padded to 8-byte alignment. */
+static void snap_put(struct snap_buf *b, const void *data, uint64_t len)
+{
+    uint64_t padded = SNAP_PAD(len);
+
+    if (b->failed) {
+        return;
+    }
+
+    if (b->len + padded > b->size) {
+        uint64_t size = b->size ? b->size * 2 : 4096;
+        unsigned char *p;
+
+        while (size < b->len + padded) {
+            size *= 2;
+        }
+        p = realloc(b->data, size);
+        if (p == NULL) {
+            b->failed = 1;
+            return;
+        }
+        b->data = p;
+        b->size = size;
+    }
+
+    memcpy(b->data + b->len, data, len);
+    memset(b->data + b->len + len, 0, padded - len);
+    b->len += padded;
+}
+
+/* Write the slot's caches to the body, and its record to the table.
+ * The offsets in the record are relative to the body, plus one so
+ * that a section at the start of the body is not taken as absent.
+ * Must be called with the slot's cache_lock held. */
+static void snap_write_slot(struct snap_buf *table, struct snap_buf *body,
+                            const struct slot *slot)
+{
+    const struct ck_token_info *info = &slot->token_info.u.token;
+    struct snap_slot ss;
+    unsigned long n;
+    unsigned int b;
+
+    memset(&ss, 0, sizeof ss);
+    memcpy(ss.label, info->label, sizeof ss.label);
+    memcpy(ss.serial, info->serial_number, sizeof ss.serial);
+    ss.hardware[0] = info->hardware_version.major;
+    ss.hardware[1] = info->hardware_version.minor;
+    ss.firmware[0] = info->firmware_version.major;
+    ss.firmware[1] = info->firmware_version.minor;
+
+    if (slot->mechs) {
+        ss.mechs = body->len + 1;
+        ss.nmechs = slot->mechs->count;
+        for (n = 0; n < slot->mechs->count; n++) {
+            struct snap_mech sm;
+
+            sm.type = slot->mechs->types[n];
+            sm.min_key_size = slot->mechs->info[n].min_key_size;
+            sm.max_key_size = slot->mechs->info[n].max_key_size;
+            sm.flags = slot->mechs->info[n].flags;
+            snap_put(body, &sm, sizeof sm);
+        }
+    }
+
+    if (slot->index) {
+        const struct index_entry *e;
+
+        ss.index = body->len + 1;
+        for (b = 0; b < slot->index->size; b++) {
+            for (e = slot->index->table[b]; e; e = e->next) {
+                struct snap_entry se;
+
+                /* Misses are not kept across processes. */
+                if (e->handle == CK_INVALID_HANDLE) {
+                    continue;
+                }
+
+                se.handle = e->handle;
+                se.class = e->class;
+                se.type = e->type;
+                se.len = e->len;
+                snap_put(body, &se, sizeof se);
+                snap_put(body, e->data, e->len);
+                ss.nindex++;
+            }
+        }
+    }
+
+    if (slot->attrs) {
+        const struct attr_object *obj;
+        const struct attr_value *v;
+
+        ss.attrs = body->len + 1;
+        for (b = 0; b < slot->attrs->size; b++) {
+            for (obj = slot->attrs->table[b]; obj; obj = obj->next) {
+                struct snap_object so;
+
+                so.handle = obj->handle;
+                so.class = obj->class;
+                so.token = obj->token;
+                so.nvalues = 0;
+                for (v = obj->values; v; v = v->next) {
+                    so.nvalues++;
+                }
+                snap_put(body, &so, sizeof so);
+
+                for (v = obj->values; v; v = v->next) {
+                    struct snap_value sv;
+
+                    sv.type = v->type;
+                    sv.len = v->len;
+                    snap_put(body, &sv, sizeof sv);
+                    snap_put(body, v->data, v->len);
+                }
+                ss.nattrs++;
+            }
+        }
+    }
+
+    snap_put(table, &ss, sizeof ss);
+}
+
+ck_rv_t pakchois_save_snapshot(pakchois_module_t *mod, const char *filename)
+{
+    struct snap_buf table = { NULL, 0, 0, 0 }, body = { NULL, 0, 0, 0 };
+    struct snap_header hdr;
+    struct snap_slot *ss;
+    struct ck_token_info info;
+    struct slot *slot;
+    ck_slot_id_t *ids = NULL;
+    uint64_t n, nids = 0, base;
+    size_t len = strlen(filename);
+    char *tmp = NULL;
+    FILE *f = NULL;
+    int fd, written;
+    ck_rv_t rv = CKR_FUNCTION_FAILED;
+
+    /* Make sure the token information, by which the caches are
+     * keyed, is known for every slot; it cannot be fetched with the
+     * slots_lock held. */
+    if (pthread_rwlock_rdlock(&mod->slots_lock)) {
+        return CKR_CANT_LOCK;
+    }
+    for (slot = mod->slots; slot; slot = slot->next) {
+        nids++;
+    }
+    ids = pk_malloc((nids + 1) * sizeof *ids);
+    for (slot = mod->slots, n = 0; ids && slot; slot = slot->next) {
+        ids[n++] = slot->id;
+    }
+    pthread_rwlock_unlock(&mod->slots_lock);
+
+    if (ids == NULL) {
+        return CKR_HOST_MEMORY;
+    }
+    for (n = 0; n < nids; n++) {
+        pakchois_get_cached_token_info(mod, ids[n], &info, NULL);
+    }
+    pk_free(ids);
+
+    if (pthread_rwlock_rdlock(&mod->slots_lock)) {
+        return CKR_CANT_LOCK;
+    }
+    /* Only slots with a token present can be keyed. */
+    for (slot = mod->slots; slot; slot = slot->next) {
+        if (pthread_rwlock_rdlock(&slot->cache_lock)) {
+            continue;
+        }
+        if (slot->token_info.valid && slot->token_info.rv == CKR_OK) {
+            snap_write_slot(&table, &body, slot);
+        }
+        pthread_rwlock_unlock(&slot->cache_lock);
+    }
+    pthread_rwlock_unlock(&mod->slots_lock);
+
+    if (table.failed || body.failed) {
+        rv = CKR_HOST_MEMORY;
+        goto out;
+    }
+
+    memset(&hdr, 0, sizeof hdr);
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof hdr.magic);
+    hdr.version = SNAP_VERSION;
+    hdr.bom = SNAP_BOM;
+    hdr.nslots = table.len / sizeof *ss;
+    hdr.size = sizeof hdr + table.len + body.len;
+
+    base = sizeof hdr + table.len - 1;
+    for (n = 0; n < hdr.nslots; n++) {
+        ss = (struct snap_slot *)table.data + n;
+        if (ss->mechs) ss->mechs += base;
+        if (ss->index) ss->index += base;
+        if (ss->attrs) ss->attrs += base;
+    }
+
+    /* Write to a temporary file and rename it into place, so a
+     * concurrent load sees either the old or the new snapshot. */
+    tmp = malloc(len + sizeof ".XXXXXX");
+    if (tmp == NULL) {
+        rv = CKR_HOST_MEMORY;
+        goto out;
+    }
+    memcpy(tmp, filename, len);
+    memcpy(tmp + len, ".XXXXXX", sizeof ".XXXXXX");
+
+    fd = mkstemp(tmp);
+    if (fd < 0) {
+        free(tmp);
+        tmp = NULL;
+        goto out;
+    }
+
+    f = fdopen(fd, "w");
+    if (f == NULL) {
+        close(fd);
+        goto out;
+    }
+
+    written = fwrite(&hdr, sizeof hdr, 1, f) == 1
+        && (table.len == 0 || fwrite(table.data, table.len, 1, f) == 1)
+        && (body.len == 0 || fwrite(body.data, body.len, 1, f) == 1);
+    /* The stream is closed whether or not the writes succeeded. */
+    if (fclose(f) == 0 && written && rename(tmp, filename) == 0) {
+        free(tmp);
+        tmp = NULL;
+        rv = CKR_OK;
+    }
+
+out:
+    if (tmp) {
+        unlink(tmp);
+        free(tmp);
+    }
+    free(table.data);
+    free(body.data);
+    return rv;
+}
+
+ck_rv_t pakchois_load_snapshot(pakchois_module_t *mod, const char *filename)
+{
+    const struct snap_header *hdr;
+    struct stat st;
+    void *map;
+    int fd;
+
+    if (mod->snapshot) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    if (fstat(fd, &st) || st.st_size < (off_t)sizeof *hdr) {
+        close(fd);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return CKR_FUNCTION_FAILED;
+    }
+
+    hdr = map;
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof hdr->magic)
+        || hdr->version != SNAP_VERSION || hdr->bom != SNAP_BOM
+        || hdr->size != (uint64_t)st.st_size
+        || hdr->nslots > (hdr->size - sizeof *hdr) / sizeof(struct snap_slot)) {
+        munmap(map, st.st_size);
+        return CKR_FUNCTION_FAILED;
+    }
+
+    mod->snapshot_len = st.st_size;
+    __atomic_store_n(&mod->snapshot, map, __ATOMIC_RELEASE);
+    return CKR_OK;
+}
+
+/* Returns a pointer to count records of the given size at off in the
+ * snapshot, or NULL if they lie outside it or off is not 8-byte
+ * aligned. */
+static const void *snap_at(const pakchois_module_t *mod, uint64_t off,
+                           uint64_t count, uint64_t size)
+{
+    if ((off & 7) || off > mod->snapshot_len
+        || count > (mod->snapshot_len - off) / size) {
+        return NULL;
+    }
+
+    return (const unsigned char *)mod->snapshot + off;
+}
+
+/* Claim a part of the module's snapshot for the slot; each part is
+ * tried once per slot generation.  Returns the slot record for the
+ * token now in the slot, or NULL if there is none, storing the slot
+ * generation in which the token was seen. */
+static const struct snap_slot *snap_claim(pakchois_module_t *mod,
+                                          struct slot *slot, int part,
+                                          unsigned long *generation)
+{
+    const struct snap_header *hdr;
+    const struct snap_slot *ss;
+    struct ck_token_info info;
+    uint64_t n;
+
+    hdr = __atomic_load_n(&mod->snapshot, __ATOMIC_ACQUIRE);
+    if (hdr == NULL
+        || (__atomic_load_n(&slot->snap_state, __ATOMIC_RELAXED) & part)
+        || (__atomic_fetch_or(&slot->snap_state, part, __ATOMIC_RELAXED)
+            & part)) {
+        return NULL;
+    }
+
+    if (pakchois_get_cached_token_info(mod, slot->id, &info,
+                                       generation) != CKR_OK) {
+        /* Try again once a token is present. */
+        __atomic_fetch_and(&slot->snap_state, ~part, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    ss = (const struct snap_slot *)(hdr + 1);
+    for (n = 0; n < hdr->nslots; n++, ss++) {
+        if (memcmp(ss->serial, info.serial_number, sizeof ss->serial) == 0
+            && memcmp(ss->label, info.label, sizeof ss->label) == 0
+            && ss->hardware[0] == info.hardware_version.major
+            && ss->hardware[1] == info.hardware_version.minor
+            && ss->firmware[0] == info.firmware_version.major
+            && ss->firmware[1] == info.firmware_version.minor) {
+            return ss;
+        }
+    }
+
+    return NULL;
+}
+
+/* Returns a mechanism cache built from the snapshot, or NULL.  If
+ * one is returned, *generation is set to the slot generation in which
+ * the token it describes was seen. */
+static struct mech_cache *snap_mechs(pakchois_module_t *mod,
+                                     struct slot *slot,
+                                     unsigned long *generation)
+{
+    const struct snap_slot *ss;
+    const struct snap_mech *sm;
+    struct mech_cache *mc;
+    unsigned long claimed, n;
+
+    ss = snap_claim(mod, slot, SNAP_MECHS, &claimed);
+    if (ss == NULL || ss->mechs == 0
+        || (sm = snap_at(mod, ss->mechs, ss->nmechs, sizeof *sm)) == NULL) {
+        return NULL;
+    }
+
+    mc = pk_calloc(1, sizeof *mc);
+    if (mc == NULL) {
+        return NULL;
+    }
+
+    mc->count = ss->nmechs;
+    mc->types = pk_calloc(mc->count + 1, sizeof *mc->types);
+    mc->info = pk_calloc(mc->count + 1, sizeof *mc->info);
+    if (mc->types && mc->info) {
+        for (n = 0; n < mc->count; n++) {
+            mc->types[n] = sm[n].type;
+            mc->info[n].min_key_size = sm[n].min_key_size;
+            mc->info[n].max_key_size = sm[n].max_key_size;
+            mc->info[n].flags = sm[n].flags;
+        }
+        if (mech_index(mc) == CKR_OK) {
+            *generation = claimed;
+            return mc;
+        }
+    }
+
+    pk_free(mc->types);
+    pk_free(mc->info);
+    pk_free(mc->table);
+    pk_free(mc);
+    return NULL;
+}
+
+/* Read the slot record's object index into a new index.  Returns
+ * NULL if it is absent or malformed. */
+static struct object_index *snap_read_index(const pakchois_module_t *mod,
+                                            const struct snap_slot *ss)
+{
+    struct object_index *idx;
+    const struct snap_entry *se;
+    const unsigned char *data;
+    uint64_t n, off = ss->index;
+
+    if (off == 0 || (idx = index_create()) == NULL) {
+        return NULL;
+    }
+
+    for (n = 0; n < ss->nindex; n++) {
+        se = snap_at(mod, off, 1, sizeof *se);
+        if (se == NULL
+            || (data = snap_at(mod, off + sizeof *se, se->len, 1)) == NULL
+            || index_insert(idx, se->handle, se->class, se->type,
+                            data, se->len)) {
+            free_object_index(idx);
+            return NULL;
+        }
+        off += sizeof *se + SNAP_PAD(se->len);
+    }
+
+    return idx;
+}
+
+/* Read the slot record's attribute cache into a new cache.  Returns
+ * NULL if it is absent or malformed. */
+static struct attr_cache *snap_read_attrs(const pakchois_module_t *mod,
+                                          const struct snap_slot *ss)
+{
+    struct attr_cache *ac = NULL;
+    const struct snap_object *so;
+    const struct snap_value *sv;
+    const unsigned char *data;
+    struct attr_object *obj;
+    struct attr_value *v;
+    uint64_t n, m, off = ss->attrs;
+
+    if (off == 0) {
+        return NULL;
+    }
+
+    for (n = 0; n < ss->nattrs; n++) {
+        so = snap_at(mod, off, 1, sizeof *so);
+        if (so == NULL || (obj = attr_add_object(&ac, so->handle)) == NULL) {
+            goto fail;
+        }
+        obj->class = so->class;
+        obj->token = so->token != 0;
+        off += sizeof *so;
+
+        for (m = 0; m < so->nvalues; m++) {
+            sv = snap_at(mod, off, 1, sizeof *sv);
+            if (sv == NULL
+                || (data = snap_at(mod, off + sizeof *sv, sv->len, 1)) == NULL) {
+                goto fail;
+            }
+            off += sizeof *sv + SNAP_PAD(sv->len);
+            /* Skip values no longer treated as immutable. */
+            if (!attr_immutable(obj->class, sv->type)) {
+                continue;
+            }
+            if ((v = pk_malloc(sizeof *v + sv->len)) == NULL) {
+                goto fail;
+            }
+            v->type = sv->type;
+            v->len = sv->len;
+            memcpy(v->data, data, v->len);
+            v->next = obj->values;
+            obj->values = v;
+        }
+    }
+
+    return ac;
+fail:
+    free_attr_cache(ac);
+    return NULL;
+}
+
+/* Check an object's class, and optionally one other attribute, on
+ * the token against the expected values.  Returns non-zero if they
+ * match. */
+static int snap_check(pakchois_session_t *sess, ck_object_handle_t handle,
+                      ck_object_class_t class, ck_attribute_type_t type,
+                      const void *data, unsigned long len)
+{
+    ck_object_class_t live = CK_UNAVAILABLE_INFORMATION;
+    struct ck_attribute a[2];
+    unsigned char *buf;
+    int ok;
+
+    buf = pk_malloc(len + 1);
+    if (buf == NULL) {
+        return 0;
+    }
+
+    a[0].type = CKA_CLASS;
+    a[0].value = &live;
+    a[0].value_len = sizeof live;
+    a[1].type = type;
+    a[1].value = buf;
+    a[1].value_len = len;
+
+    ok = CALLS3(GetAttributeValue, handle, a, data ? 2 : 1) == CKR_OK
+        && live == class
+        && (data == NULL
+            || (a[1].value_len == len && memcmp(buf, data, len) == 0));
+
+    pk_free(buf);
+    return ok;
+}
+
+/* Spot-check objects from the index, or failing that the attribute
+ * cache, against the token.  Returns non-zero if all match. */
+static int snap_spot_check(pakchois_session_t *sess,
+                           const struct object_index *idx,
+                           const struct attr_cache *ac)
+{
+    unsigned int b, n = 0, step, checked = 0;
+
+    if (idx && idx->count) {
+        const struct index_entry *e;
+
+        step = idx->count / SNAP_SPOT_CHECKS + 1;
+        for (b = 0; b < idx->size; b++) {
+            for (e = idx->table[b]; e; e = e->next) {
+                if (n++ % step) {
+                    continue;
+                }
+                if (!snap_check(sess, e->handle, e->class, e->type,
+                                e->data, e->len)) {
+                    return 0;
+                }
+                checked++;
+            }
+        }
+    }
+
+    if (checked == 0 && ac && ac->count) {
+        const struct attr_object *obj;
+
+        step = ac->count / SNAP_SPOT_CHECKS + 1;
+        for (b = 0; b < ac->size; b++) {
+            for (obj = ac->table[b]; obj; obj = obj->next) {
+                if (n++ % step == 0
+                    && !snap_check(sess, obj->handle, obj->class,
+                                   0, NULL, 0)) {
+                    return 0;
+                }
+            }
+        }
+    }
+
+    return 1;
+}
+
+/* Adopt the object index, and the attribute cache if enabled, from
+ * the module's snapshot, if the token matches and a spot-check of
+ * some of the objects passes. */
+static void snap_objects(pakchois_session_t *sess)
+{
+    pakchois_module_t *mod = sess->module;
+    struct slot *slot = sess->slot;
+    const struct snap_slot *ss;
+    struct object_index *idx;
+    struct attr_cache *ac;
+    unsigned long generation;
+
+    ss = snap_claim(mod, slot, SNAP_OBJECTS, &generation);
+    if (ss == NULL) {
+        return;
+    }
+
+    idx = snap_read_index(mod, ss);
+    ac = snap_read_attrs(mod, ss);
+
+    if ((idx || ac) && snap_spot_check(sess, idx, ac)
+        && pthread_rwlock_wrlock(&slot->cache_lock) == 0) {
+        if (slot->generation == generation) {
+            if (idx && slot->index == NULL) {
+                slot->index = idx;
+                idx = NULL;
+            }
+            if (ac && slot->attrs == NULL && slot->attr_caching) {
+                slot->attrs = ac;
+                ac = NULL;
+            }
+        }
+        pthread_rwlock_unlock(&slot->cache_lock);
+    }
+
+    free_object_index(idx);
+    free_attr_cache(ac);
+}
@@ -41,13 +41,15 @@
 
 #define CRYPTOKI_GNU
 
+#include <stddef.h>
+
 #include "pakchois11.h"
 
 /* API version: major is bumped for any backwards-incompatible
  * changes. minor is bumped for any new interfaces.  Note that the API
  * is versioned independent of the project release version.  */
 #define PAKCHOIS_API_MAJOR (0)
-#define PAKCHOIS_API_MINOR (2)
+#define PAKCHOIS_API_MINOR (3)
 
 /* API version history (note that API versions do not map directly to
    the project version!):
@@ -56,6 +58,38 @@
    0.2: Addition of pakchois_error()
         Concurrent access guarantee added for pakchois_module_load()
         Thread-safety guarantee added for pakchois_wait_for_slot_event()
+   0.3: Addition of session pools, pakchois_session_pool_*()
+        Thread-safety guarantee added for module objects
+        Addition of pakchois_set_module_cache()
+        Addition of pakchois_set_linger()
+        Addition of pakchois_set_allocator()
+        Addition of mechanism cache, pakchois_get_cached_mechanism_*()
+        and pakchois_mechanism_supported()
+        Addition of slot and token information cache,
+        pakchois_get_cached_{slot,token}_info(), pakchois_set_info_ttl()
+        and pakchois_slot_generation()
+        Addition of slot event subscriptions, pakchois_*_slot_events()
+        Addition of pakchois_set_poll_interval()
+        Addition of asynchronous operations, pakchois_async_*()
+        Addition of pakchois_async_fd()
+        Addition of pakchois_sign_batch()
+        Addition of pakchois_verify_batch()
+        Session pools may be sized from the token's max_session_count
+        Addition of pakchois_get_output_length() and
+        pakchois_{sign,encrypt,decrypt,digest}_alloc()
+        Addition of prepared operations, pakchois_prepare*()
+        Addition of pakchois_*_oneshot()
+        Addition of pakchois_find_iter_*() and pakchois_find_all()
+        Addition of attribute arenas, pakchois_arena_*(), and
+        pakchois_get_attributes()
+        Addition of immutable attribute cache,
+        pakchois_set_attribute_cache()
+        Addition of object index, pakchois_lookup_object() and
+        pakchois_lookup_object_by_label()
+        Addition of certificate index, pakchois_find_certificate(),
+        pakchois_find_certificates_by_subject() and pakchois_build_chain()
+        Addition of cache snapshots, pakchois_save_snapshot() and
+        pakchois_load_snapshot()
 */
 
 typedef struct pakchois_module_s pakchois_module_t;
@@ -82,6 +116,49 @@ ck_rv_t pakchois_module_nssload(pakchois_module_t **module,
 /* Destroy a PKCS#11 module. */
 void pakchois_module_destroy(pakchois_module_t *module);
 
+/* Set the linger policy for PKCS#11 providers.  By default, a
+ * provider is finalized and unloaded as soon as the last module using
+ * it is destroyed.  If timeout is non-zero, the provider instead
+ * remains loaded and initialized for that many seconds afterwards,
+ * and is reused without reinitialization if a module of the same name
+ * is loaded in the meantime; expired providers are finalized by a
+ * background thread.  If max_idle is non-zero, at most max_idle
+ * unused providers are kept loaded at once, the least recently used
+ * being finalized first.  Setting a zero timeout finalizes all unused
+ * providers immediately.  Returns CKR_OK on success. */
+ck_rv_t pakchois_set_linger(unsigned int timeout, unsigned int max_idle);
+
+/* Resolutions of module names to DSO paths are cached for the
+ * lifetime of the process, so a module which is loaded again after
+ * being unloaded is opened directly rather than by searching the
+ * module path.  If filename is non-NULL, the cache is additionally
+ * read from and saved to the named file, allowing resolutions to
+ * persist across processes; a cached resolution is discarded if the
+ * DSO or any of the module path directories searched have been
+ * modified since.  If filename is NULL, the on-disk cache is
+ * disabled.  Returns CKR_OK on success. */
+ck_rv_t pakchois_set_module_cache(const char *filename);
+
+/* Set the memory allocator used for module, session and session pool
+ * objects, and for the caches held by modules.  alloc must return a
+ * block of at least size bytes suitably aligned for any object, or
+ * NULL on failure; release frees a block returned by alloc.  userdata
+ * is passed to both.  Passing a NULL release function restores the C
+ * library allocator.  This function is not thread-safe, and must be
+ * called before any other pakchois function; the allocator must
+ * remain valid until every module has been destroyed.  Session and
+ * slot objects are allocated from per-module slabs and reused, so
+ * opening and closing sessions does not normally call the allocator.
+ *
+ * The C library allocator is still used for buffers returned to the
+ * caller, by pakchois_find_all() and the pakchois_*_alloc()
+ * operations, which must be released with free(); and internally for
+ * provider records, the module path cache, and the temporary buffers
+ * used to complete operations and to save snapshots. */
+void pakchois_set_allocator(void *(*alloc)(void *userdata, size_t size),
+                            void (*release)(void *userdata, void *ptr),
+                            void *userdata);
+
 /* Return the error string corresponding to the given return value.
  * Never returns NULL.  */
 const char *pakchois_error(ck_rv_t rv);
@@ -105,17 +182,29 @@ const char *pakchois_error(ck_rv_t rv);
    pakchois_module_load and pakchois_module_destroy)
 
    5. pakchois_wait_for_slot_event() is thread-safe against other
-   callers of pakchois_wait_for_slot_event(); the call to the
-   underlying provider's WaitForSlotEvent function is protected by a
-   mutex.
+   callers of pakchois_wait_for_slot_event().  Events are read by a
+   dispatcher thread, shared between all modules using the same
+   provider, which makes the only calls to the provider's
+   WaitForSlotEvent function; each module receives every event once,
+   by any of the threads waiting on that module.  Events are queued
+   for a module from when it is loaded, once the dispatcher has been
+   started by any module using the provider.  A call with
+   CKF_DONT_BLOCK returns an event already queued, or CKR_NO_EVENT.
+   A blocking call still waiting when the provider is finalized
+   returns CKR_CRYPTOKI_NOT_INITIALIZED, as C_WaitForSlotEvent would.
+   The reserved argument must be NULL, otherwise CKR_ARGUMENTS_BAD is
+   returned.  See also pakchois_subscribe_slot_events().
 
    6. pakchois_close_all_sessions() only closes sessions associated
    with the given module instance; any sessions opened by other users
    of the underlying provider are unaffected.
 
-   If a module object is used concurrently from separate threads,
-   undefined behaviour results.  If a session object is used
-   concurrently from separate threads, undefined behavioure results.
+   A module object may be used concurrently from separate threads; in
+   particular, sessions may be opened and closed concurrently on the
+   same module.  If a session object is used concurrently from
+   separate threads, undefined behaviour results; this includes
+   calling pakchois_close_all_sessions() for a slot whilst another
+   thread is using a session on that slot.
 
 */
 ck_rv_t pakchois_get_info(pakchois_module_t *module, struct ck_info *info);
@@ -358,4 +447,763 @@ ck_rv_t pakchois_generate_random(pakchois_session_t *session,
 				 unsigned char *random_data,
 				 unsigned long random_len);
 
+/* Session pools.
+
+   A session pool keeps a set of open (and, optionally, logged-in)
+   sessions for one slot of a module, which can be checked out with
+   pakchois_session_pool_acquire() and returned with
+   pakchois_session_pool_release().  A pool object may be used
+   concurrently from separate threads; each session checked out of
+   the pool is owned by the caller until it is released, and must not
+   be closed directly.  All sessions must be released back to the pool
+   before it is destroyed, and all pools must be destroyed before the
+   module they use.  */
+
+typedef struct pakchois_session_pool_s pakchois_session_pool_t;
+
+struct pakchois_pool_params {
+    /* Number of sessions to open when the pool is created, and below
+     * which the pool will not be reaped. */
+    unsigned int min_sessions;
+    /* Maximum number of sessions the pool will open; if zero, the
+     * token's max_session_count is used, up to a limit of 64. */
+    unsigned int max_sessions;
+    /* Idle sessions above min_sessions which have not been used for
+     * this many seconds are closed when the pool is next reaped (see
+     * pakchois_session_pool_reap()); zero disables reaping. */
+    unsigned int idle_timeout;
+    /* Milliseconds for which pakchois_session_pool_acquire() waits
+     * when all sessions are checked out: zero fails immediately, and
+     * a negative value waits indefinitely. */
+    int wait_timeout;
+    /* Flags passed to pakchois_open_session(); CKF_SERIAL_SESSION is
+     * always added. */
+    ck_flags_t flags;
+};
+
+/* Create a session pool for the given slot, opening min_sessions
+ * sessions immediately.  Returns CKR_OK on success.  */
+ck_rv_t pakchois_session_pool_create(pakchois_session_pool_t **pool,
+                                     pakchois_module_t *module,
+                                     ck_slot_id_t slot_id,
+                                     const struct pakchois_pool_params *params);
+
+/* Log in to the token using a pooled session.  On success, the PIN
+ * is retained by the pool and used to log in again if the pool ever
+ * has to open a session with no other pool sessions open.  */
+ck_rv_t pakchois_session_pool_login(pakchois_session_pool_t *pool,
+                                    ck_user_type_t user_type,
+                                    unsigned char *pin,
+                                    unsigned long pin_len);
+
+/* Check out a session from the pool, opening a new session if none
+ * is idle and fewer than max_sessions are open.  If the pool is
+ * exhausted, waits as determined by the wait_timeout parameter, then
+ * returns CKR_SESSION_COUNT.  If the pool has to log in again with
+ * the stored PIN, other callers wait for the login to complete, so
+ * no session is returned before it is logged in.  */
+ck_rv_t pakchois_session_pool_acquire(pakchois_session_pool_t *pool,
+                                      pakchois_session_t **session);
+
+/* Return a session to the pool.  The session must not have an active
+ * operation.  */
+void pakchois_session_pool_release(pakchois_session_pool_t *pool,
+                                   pakchois_session_t *session);
+
+/* Close a checked-out session rather than returning it to the pool,
+ * for example after a failure which leaves the session unusable. */
+void pakchois_session_pool_discard(pakchois_session_pool_t *pool,
+                                   pakchois_session_t *session);
+
+/* Close any sessions which have exceeded the idle timeout.  Idle
+ * sessions are also reaped whenever a session is released, but the
+ * pool has no timer of its own: sessions left idle in a pool which
+ * is no longer used are only closed by calling this function, or
+ * when the pool is destroyed.  */
+void pakchois_session_pool_reap(pakchois_session_pool_t *pool);
+
+/* Close all sessions and destroy the pool. */
+void pakchois_session_pool_destroy(pakchois_session_pool_t *pool);
+
+/* Mechanism cache.
+
+   The following interfaces answer queries about the mechanisms
+   supported by a slot from a per-slot cache, which is filled from
+   the provider on first use (calling C_GetMechanismList, then
+   C_GetMechanismInfo once for each mechanism).  The cache is
+   discarded whenever pakchois_wait_for_slot_event() reports an event
+   for the slot, when pakchois_get_token_info() or
+   pakchois_open_session() first find the token is no longer present,
+   when pakchois_get_token_info() finds it present again or finds a
+   different token, or when a refresh of the cached token information
+   finds a different token (see below).  The token information
+   returned by pakchois_get_token_info() also refreshes the cache.  */
+
+/* As pakchois_get_mechanism_list(), using the cache. */
+ck_rv_t pakchois_get_cached_mechanism_list(pakchois_module_t *module,
+                                           ck_slot_id_t slot_id,
+                                           ck_mechanism_type_t *mechanism_list,
+                                           unsigned long *count);
+
+/* As pakchois_get_mechanism_info(), using the cache; returns
+ * CKR_MECHANISM_INVALID if the mechanism is not supported. */
+ck_rv_t pakchois_get_cached_mechanism_info(pakchois_module_t *module,
+                                           ck_slot_id_t slot_id,
+                                           ck_mechanism_type_t type,
+                                           struct ck_mechanism_info *info);
+
+/* Returns CKR_OK if the slot supports the given mechanism with all
+ * of the given flags (for example, CKF_SIGN|CKF_VERIFY) set in its
+ * mechanism information, or CKR_MECHANISM_INVALID if not.  Once the
+ * cache is filled this is a constant-time lookup. */
+ck_rv_t pakchois_mechanism_supported(pakchois_module_t *module,
+                                     ck_slot_id_t slot_id,
+                                     ck_mechanism_type_t type,
+                                     ck_flags_t flags);
+
+/* Slot and token information cache.
+
+   The following interfaces return slot and token information from a
+   per-slot cache.  Cached information is discarded when a slot event
+   is reported for the slot, and otherwise refreshed from the provider
+   once it is older than the TTL set by pakchois_set_info_ttl().  Note
+   that the dynamic fields of struct ck_token_info (session counts,
+   free memory and the clock) may therefore be stale.
+
+   Each slot has a generation counter, which is incremented whenever
+   a slot event is seen for the slot, or a refresh finds that the
+   identifying fields (label, manufacturer, model, serial number,
+   description or flags) or the presence of the token have changed;
+   in the latter case the slot's other caches are discarded too.
+   Callers can compare generations to detect changes cheaply.  */
+
+/* Set the lifetime of cached slot and token information, in seconds.
+ * The default is one second.  A zero TTL means cached information is
+ * only refreshed after a slot event. */
+void pakchois_set_info_ttl(unsigned int seconds);
+
+/* As pakchois_get_slot_info(), using the cache.  If generation is
+ * non-NULL, the slot generation is stored in *generation. */
+ck_rv_t pakchois_get_cached_slot_info(pakchois_module_t *module,
+                                      ck_slot_id_t slot_id,
+                                      struct ck_slot_info *info,
+                                      unsigned long *generation);
+
+/* As pakchois_get_token_info(), using the cache.  Failures such as
+ * CKR_TOKEN_NOT_PRESENT are cached too.  If generation is non-NULL,
+ * the slot generation is stored in *generation. */
+ck_rv_t pakchois_get_cached_token_info(pakchois_module_t *module,
+                                       ck_slot_id_t slot_id,
+                                       struct ck_token_info *info,
+                                       unsigned long *generation);
+
+/* Store the current generation of the given slot in *generation,
+ * without querying the provider. */
+ck_rv_t pakchois_slot_generation(pakchois_module_t *module,
+                                 ck_slot_id_t slot_id,
+                                 unsigned long *generation);
+
+/* Slot event subscriptions.
+
+   Any number of subscribers may register to receive slot events from
+   a module.  Events are read from the provider by a single dispatcher
+   thread per provider (see the note on pakchois_wait_for_slot_event()
+   above), which is started on first use and runs until the provider
+   is finalized.  Subscriptions must be cancelled before the module is
+   destroyed.  The provider's C_Finalize must unblock any call to
+   C_WaitForSlotEvent in progress, as PKCS#11 requires.
+
+   If the provider does not support blocking C_WaitForSlotEvent
+   calls, the dispatcher polls instead: using non-blocking
+   C_WaitForSlotEvent calls if supported, or otherwise by comparing
+   the list of slots with tokens present, and the token serial
+   numbers, between polls, and reporting an event for each slot where
+   a token was inserted, removed or replaced.
+
+   Errors from the provider are not reported to subscribers: a poll
+   which fails is tried again at the next interval, and a blocking
+   C_WaitForSlotEvent call which fails is retried after a delay
+   within the same bounds.  */
+
+/* Set the bounds on the interval between polls, in milliseconds;
+ * by default 100 and 5000.  May be called at any time.  The interval doubles after each poll
+ * which finds no events, and returns to the minimum once an event is
+ * seen. */
+void pakchois_set_poll_interval(unsigned int min_msec, unsigned int max_msec);
+
+typedef struct pakchois_subscription_s pakchois_subscription_t;
+
+/* Callback invoked by the dispatcher thread for each slot event.  The
+ * callback should return promptly, since the next event is not read
+ * from the provider until all callbacks have run. */
+typedef void (*pakchois_slot_event_t)(pakchois_module_t *module,
+                                      ck_slot_id_t slot_id,
+                                      void *userdata);
+
+/* Subscribe to slot events from the given module.  If callback is
+ * non-NULL, it is invoked with the given userdata for each event;
+ * otherwise, events are queued and can be retrieved with
+ * pakchois_next_slot_event(), with repeated events for a slot which
+ * is already queued coalesced.  Returns CKR_OK on success, or an
+ * error if the subscription or the dispatcher thread could not be
+ * created. */
+ck_rv_t pakchois_subscribe_slot_events(pakchois_module_t *module,
+                                       pakchois_slot_event_t callback,
+                                       void *userdata,
+                                       pakchois_subscription_t **sub);
+
+/* For a subscription without a callback, returns a file descriptor
+ * which becomes readable when events are queued; for use with poll()
+ * or similar.  The descriptor must not be read from or closed by the
+ * caller.  Returns -1 for a callback subscription. */
+int pakchois_subscription_fd(pakchois_subscription_t *sub);
+
+/* Retrieve the next queued event for a subscription without a
+ * callback; never blocks.  Returns CKR_OK and the slot id in
+ * *slot_id, or CKR_NO_EVENT if none is queued. */
+ck_rv_t pakchois_next_slot_event(pakchois_subscription_t *sub,
+                                 ck_slot_id_t *slot_id);
+
+/* Cancel and destroy a subscription.  If the callback is running in
+ * another thread, waits for it to return; may be called from within
+ * the subscription's own callback. */
+void pakchois_cancel_slot_events(pakchois_subscription_t *sub);
+
+/* Output length prediction.
+
+   The following interfaces avoid the usual PKCS#11 call with a NULL
+   output buffer to find the length of the output.  The output length
+   is predicted from a per-slot cache of lengths seen for previous
+   operations with the same mechanism, key and similar input length,
+   or, the first time, from the key's CKA_MODULUS_BITS or
+   CKA_EC_PARAMS attributes or the digest mechanism.  The cache is
+   discarded on slot events.  */
+
+/* Predict the output length for an operation, which is one of
+ * CKF_SIGN, CKF_ENCRYPT, CKF_DECRYPT or CKF_DIGEST (the key is
+ * ignored for the last).  The predicted length is stored in *len; it
+ * is normally an upper bound, but may be too small for operations
+ * whose output length varies with the input.  Returns
+ * CKR_FUNCTION_NOT_SUPPORTED if no prediction can be made. */
+ck_rv_t pakchois_get_output_length(pakchois_session_t *session,
+                                   ck_flags_t operation,
+                                   struct ck_mechanism *mechanism,
+                                   ck_object_handle_t key,
+                                   unsigned long input_len,
+                                   unsigned long *len);
+
+/* One-shot operations.  These run the *_init call and the
+ * single-part operation together, and never leave an operation active
+ * on the session, so are safe to use with pooled sessions.  If the
+ * output buffer is NULL, the output length is stored in *output_len
+ * and CKR_OK returned, using the predicted length where possible
+ * (otherwise the operation is run to find the length).  Otherwise
+ * the buffer is always passed to the provider, and if the provider
+ * reports that it is too small, CKR_BUFFER_TOO_SMALL is returned and
+ * the required length stored in *output_len, after completing the
+ * operation into a scratch buffer.  Only if memory cannot be
+ * allocated for the scratch buffer can the operation remain active;
+ * CKR_HOST_MEMORY is then returned, and the session should be
+ * closed.  */
+ck_rv_t pakchois_sign_oneshot(pakchois_session_t *session,
+                              struct ck_mechanism *mechanism,
+                              ck_object_handle_t key,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char *signature,
+                              unsigned long *signature_len);
+
+ck_rv_t pakchois_verify_oneshot(pakchois_session_t *session,
+                                struct ck_mechanism *mechanism,
+                                ck_object_handle_t key,
+                                unsigned char *data, unsigned long data_len,
+                                unsigned char *signature,
+                                unsigned long signature_len);
+
+ck_rv_t pakchois_encrypt_oneshot(pakchois_session_t *session,
+                                 struct ck_mechanism *mechanism,
+                                 ck_object_handle_t key,
+                                 unsigned char *data, unsigned long data_len,
+                                 unsigned char *encrypted_data,
+                                 unsigned long *encrypted_data_len);
+
+ck_rv_t pakchois_decrypt_oneshot(pakchois_session_t *session,
+                                 struct ck_mechanism *mechanism,
+                                 ck_object_handle_t key,
+                                 unsigned char *encrypted_data,
+                                 unsigned long encrypted_data_len,
+                                 unsigned char *data, unsigned long *data_len);
+
+ck_rv_t pakchois_digest_oneshot(pakchois_session_t *session,
+                                struct ck_mechanism *mechanism,
+                                unsigned char *data, unsigned long data_len,
+                                unsigned char *digest,
+                                unsigned long *digest_len);
+
+/* Single-part operations which allocate the output buffer, sized
+ * using the predicted output length, and retry with a larger buffer
+ * only if the provider returns CKR_BUFFER_TOO_SMALL.  On success, the
+ * output is stored in a buffer allocated with malloc(), which the
+ * caller must free with free().  As for the one-shot operations, the
+ * operation can remain active only if CKR_HOST_MEMORY is
+ * returned. */
+ck_rv_t pakchois_sign_alloc(pakchois_session_t *session,
+                            struct ck_mechanism *mechanism,
+                            ck_object_handle_t key,
+                            unsigned char *data, unsigned long data_len,
+                            unsigned char **signature,
+                            unsigned long *signature_len);
+
+ck_rv_t pakchois_encrypt_alloc(pakchois_session_t *session,
+                               struct ck_mechanism *mechanism,
+                               ck_object_handle_t key,
+                               unsigned char *data, unsigned long data_len,
+                               unsigned char **encrypted_data,
+                               unsigned long *encrypted_data_len);
+
+ck_rv_t pakchois_decrypt_alloc(pakchois_session_t *session,
+                               struct ck_mechanism *mechanism,
+                               ck_object_handle_t key,
+                               unsigned char *encrypted_data,
+                               unsigned long encrypted_data_len,
+                               unsigned char **data, unsigned long *data_len);
+
+ck_rv_t pakchois_digest_alloc(pakchois_session_t *session,
+                              struct ck_mechanism *mechanism,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char **digest,
+                              unsigned long *digest_len);
+
+/* Prepared operations.
+
+   A prepared operation binds an operation, mechanism and key to a
+   session pool, so that repeated single-part operations with the
+   same arguments avoid rebuilding and revalidating them.  The
+   mechanism (including its parameter) is copied, and when the
+   operation is prepared, the mechanism is checked against the slot's
+   mechanism information and the key against its CKA_SIGN (etc.)
+   attribute.
+
+   Each call checks out a session from the pool for the duration of
+   the call only, and runs the operation as by the corresponding
+   pakchois_*_oneshot() function, so no operation is left active on
+   the session.  A prepared operation may be used concurrently from
+   separate threads, and must be destroyed before the pool it
+   uses.  */
+
+typedef struct pakchois_prepared_s pakchois_prepared_t;
+
+/* Prepare an operation, which is one of CKF_SIGN, CKF_VERIFY,
+ * CKF_ENCRYPT, CKF_DECRYPT or CKF_DIGEST (for which the key is
+ * ignored).  Returns CKR_OK on success, CKR_MECHANISM_INVALID if the
+ * slot does not support the mechanism for that operation,
+ * CKR_KEY_HANDLE_INVALID or CKR_KEY_FUNCTION_NOT_PERMITTED if the key
+ * cannot be used for it, or another error from checking the key. */
+ck_rv_t pakchois_prepare(pakchois_prepared_t **prepared,
+                         pakchois_session_pool_t *pool,
+                         ck_flags_t operation,
+                         struct ck_mechanism *mechanism,
+                         ck_object_handle_t key);
+
+/* Run a prepared operation on the given input.  The output arguments
+ * are as for the corresponding single-part function (for verify,
+ * output is the signature and *output_len its length).  If output is
+ * NULL, the output length for this input is returned as by
+ * pakchois_sign_oneshot() (etc.). */
+ck_rv_t pakchois_prepared_run(pakchois_prepared_t *prepared,
+                              unsigned char *input, unsigned long input_len,
+                              unsigned char *output,
+                              unsigned long *output_len);
+
+/* Destroy a prepared operation. */
+void pakchois_prepared_destroy(pakchois_prepared_t *prepared);
+
+/* Asynchronous operations.
+
+   An asynchronous operation context runs single-part cryptographic
+   operations on a set of worker threads, each using a session
+   checked out of a session pool for the duration of the operation.
+   Operations are submitted with the pakchois_async_*() functions
+   below, which return without waiting for the provider; the results
+   are collected later from a completion queue using
+   pakchois_async_poll() or pakchois_async_wait().  Completions are
+   identified by the userdata pointer given on submission, and are
+   delivered in the order that operations complete.
+
+   The mechanism structure is copied on submission, but the mechanism
+   parameter, and the input and output buffers, must remain valid
+   until the operation completes.  Each operation is run as by the
+   corresponding pakchois_*_oneshot() function, so no operation is
+   left active on the pooled session if it fails.  An asynchronous
+   context may be used concurrently from separate threads, and must
+   be destroyed before the session pool it uses.  */
+
+typedef struct pakchois_async_s pakchois_async_t;
+
+struct pakchois_completion {
+    /* As passed on submission. */
+    void *userdata;
+    /* Result of the operation. */
+    ck_rv_t rv;
+    /* Length of the output (zero for verify operations); if rv is
+     * CKR_BUFFER_TOO_SMALL, the length required. */
+    unsigned long output_len;
+};
+
+/* Create an asynchronous operation context using sessions from the
+ * given pool, with the given number of worker threads; if threads is
+ * zero, or more than the pool's max_sessions, one thread is used per
+ * pool session.  */
+ck_rv_t pakchois_async_create(pakchois_async_t **async,
+                              pakchois_session_pool_t *pool,
+                              unsigned int threads);
+
+/* Submit operations; each returns CKR_OK if the operation was
+ * queued, in which case exactly one completion will be delivered for
+ * it.  These are equivalent to the corresponding *_init call followed
+ * by a single-part call on a pooled session. */
+ck_rv_t pakchois_async_sign(pakchois_async_t *async,
+                            struct ck_mechanism *mechanism,
+                            ck_object_handle_t key,
+                            unsigned char *data, unsigned long data_len,
+                            unsigned char *signature,
+                            unsigned long signature_len,
+                            void *userdata);
+
+ck_rv_t pakchois_async_verify(pakchois_async_t *async,
+                              struct ck_mechanism *mechanism,
+                              ck_object_handle_t key,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char *signature,
+                              unsigned long signature_len,
+                              void *userdata);
+
+ck_rv_t pakchois_async_encrypt(pakchois_async_t *async,
+                               struct ck_mechanism *mechanism,
+                               ck_object_handle_t key,
+                               unsigned char *data, unsigned long data_len,
+                               unsigned char *encrypted_data,
+                               unsigned long encrypted_data_len,
+                               void *userdata);
+
+ck_rv_t pakchois_async_decrypt(pakchois_async_t *async,
+                               struct ck_mechanism *mechanism,
+                               ck_object_handle_t key,
+                               unsigned char *encrypted_data,
+                               unsigned long encrypted_data_len,
+                               unsigned char *data, unsigned long data_len,
+                               void *userdata);
+
+ck_rv_t pakchois_async_digest(pakchois_async_t *async,
+                              struct ck_mechanism *mechanism,
+                              unsigned char *data, unsigned long data_len,
+                              unsigned char *digest, unsigned long digest_len,
+                              void *userdata);
+
+/* Retrieve up to max completions without blocking; returns the
+ * number stored in the completions array. */
+unsigned int pakchois_async_poll(pakchois_async_t *async,
+                                 struct pakchois_completion *completions,
+                                 unsigned int max);
+
+/* As pakchois_async_poll(), but if no completions are available,
+ * waits up to timeout milliseconds for one; a negative timeout waits
+ * indefinitely. */
+unsigned int pakchois_async_wait(pakchois_async_t *async,
+                                 struct pakchois_completion *completions,
+                                 unsigned int max, int timeout);
+
+/* Batch signing. */
+struct pakchois_sign_item {
+    /* Message to sign. */
+    unsigned char *data;
+    unsigned long data_len;
+    /* Result: the signature is stored at offset bytes into the
+     * signatures buffer, and is length bytes long. */
+    unsigned long offset, length;
+    ck_rv_t rv;
+};
+
+/* Sign each of count messages with the given key and mechanism,
+ * spreading the operations across the worker threads (and so the
+ * pooled sessions) of the asynchronous context, and wait for all of
+ * them to complete.  The signatures are packed contiguously into the
+ * signatures buffer, in item order, and their positions and lengths
+ * stored in the items; the buffer must have room for count times the
+ * largest signature.  If signatures is NULL, nothing is signed, and
+ * the length field of each item is set to the length required for its
+ * signature, which may be more than is used.  The result of each
+ * operation is stored in the rv field of the item; for
+ * CKR_BUFFER_TOO_SMALL, the length field gives the length required.
+ * Returns CKR_OK if the batch was run, in which case the individual
+ * results must be checked, or an error if it could not be submitted.
+ * No completions are queued for batch operations. */
+ck_rv_t pakchois_sign_batch(pakchois_async_t *async,
+                            struct ck_mechanism *mechanism,
+                            ck_object_handle_t key,
+                            struct pakchois_sign_item *items,
+                            unsigned long count,
+                            unsigned char *signatures,
+                            unsigned long signatures_len);
+
+/* Batch verification. */
+struct pakchois_verify_item {
+    /* Message and signature to verify. */
+    unsigned char *data;
+    unsigned long data_len;
+    unsigned char *signature;
+    unsigned long signature_len;
+    /* Result: CKR_OK if the signature is valid. */
+    ck_rv_t rv;
+};
+
+/* Verify each of count signatures with the given key and mechanism,
+ * in parallel as for pakchois_sign_batch(), and wait for all of them
+ * to complete; the result of each verification is stored in the rv
+ * field of the item.  To use as many sessions in parallel as the
+ * token allows, create the pool with a max_sessions of zero and the
+ * context with zero threads. */
+ck_rv_t pakchois_verify_batch(pakchois_async_t *async,
+                              struct ck_mechanism *mechanism,
+                              ck_object_handle_t key,
+                              struct pakchois_verify_item *items,
+                              unsigned long count);
+
+/* Returns a file descriptor which is readable whilst completions are
+ * queued, for use with poll(), epoll or similar event loops, or -1 on
+ * failure.  The descriptor is created on first call (an eventfd where
+ * available, otherwise a pipe) and remains owned by the context; it
+ * must not be read from or closed by the caller.  When it becomes
+ * readable, retrieve completions with pakchois_async_poll() until
+ * none remain, which also resets the descriptor.  */
+int pakchois_async_fd(pakchois_async_t *async);
+
+/* Wait for all submitted operations to complete, then destroy the
+ * context; any completions not yet retrieved are discarded. */
+void pakchois_async_destroy(pakchois_async_t *async);
+
+/* Object search.
+
+   The following interfaces wrap the C_FindObjectsInit,
+   C_FindObjects and C_FindObjectsFinal sequence, fetching object
+   handles from the provider in chunks which grow from 16 to 1024
+   handles, so that large searches need few provider calls.  As with
+   the underlying functions, only one search can be active on a
+   session at a time.  */
+
+typedef struct pakchois_find_iter_s pakchois_find_iter_t;
+
+/* Start a search for objects matching the given template. */
+ck_rv_t pakchois_find_iter_init(pakchois_find_iter_t **iter,
+                                pakchois_session_t *session,
+                                struct ck_attribute *templ,
+                                unsigned long count);
+
+/* Retrieve the next matching object handle; at the end of the
+ * search, CK_INVALID_HANDLE is stored in *object.  The search is
+ * finalized as soon as the provider has returned all the handles, so
+ * the session can be used for another search once the end has been
+ * reached, even before the iterator is destroyed. */
+ck_rv_t pakchois_find_iter_next(pakchois_find_iter_t *iter,
+                                ck_object_handle_t *object);
+
+/* Destroy the iterator, finalizing the search if necessary. */
+void pakchois_find_iter_destroy(pakchois_find_iter_t *iter);
+
+/* Find all objects matching the given template.  On success, an
+ * array of the matching handles, allocated with malloc(), is stored
+ * in *objects and the number found in *nobjects; the caller must free
+ * the array with free(). */
+ck_rv_t pakchois_find_all(pakchois_session_t *session,
+                          struct ck_attribute *templ, unsigned long count,
+                          ck_object_handle_t **objects,
+                          unsigned long *nobjects);
+
+/* Attribute arenas.
+
+   An arena is a bump allocator which holds attribute values fetched
+   by pakchois_get_attributes(); the values remain valid until the
+   arena is reset or destroyed, which frees all of them at once.  An
+   arena is not thread-safe.  */
+
+typedef struct pakchois_arena_s pakchois_arena_t;
+
+/* Create an arena whose first block holds at least 'size' bytes. */
+ck_rv_t pakchois_arena_create(pakchois_arena_t **arena, size_t size);
+
+/* Allocate 'size' bytes from the arena, aligned suitably for any
+ * attribute value; returns NULL if out of memory. */
+void *pakchois_arena_alloc(pakchois_arena_t *arena, size_t size);
+
+/* Free everything allocated from the arena.  The memory is kept for
+ * reuse, so an arena reset between fetches of a similar size does
+ * not allocate again. */
+void pakchois_arena_reset(pakchois_arena_t *arena);
+
+/* Destroy the arena and everything allocated from it. */
+void pakchois_arena_destroy(pakchois_arena_t *arena);
+
+/* Fetch the values of the attributes in the template, allocating
+ * the value buffers from the arena; any value pointers already in
+ * the template are ignored.  A non-zero value_len in the template is
+ * taken as a hint of the expected length.  Most templates are
+ * fetched with a single provider call; any attribute whose value
+ * does not fit its guessed buffer costs one call to query lengths
+ * and one more to fetch.
+
+ * Returns CKR_OK if all attributes were fetched.  As with
+ * pakchois_get_attribute_value(), CKR_ATTRIBUTE_SENSITIVE or
+ * CKR_ATTRIBUTE_TYPE_INVALID is returned if some could not be, in
+ * which case their value is NULL and their value_len is
+ * CK_UNAVAILABLE_INFORMATION, and all others are fetched. */
+ck_rv_t pakchois_get_attributes(pakchois_session_t *session,
+                                ck_object_handle_t object,
+                                struct ck_attribute *templ,
+                                unsigned long count,
+                                pakchois_arena_t *arena);
+
+/* Immutable attribute cache.
+
+   If enabled for a slot, the values of attributes which cannot
+   change are cached for token objects, and pakchois_get_attribute_value()
+   answers a template made up entirely of cached attributes without
+   calling the provider.  The attributes cached are CKA_CLASS,
+   CKA_TOKEN, CKA_KEY_TYPE, CKA_CERTIFICATE_TYPE, CKA_MODULUS,
+   CKA_MODULUS_BITS, CKA_PUBLIC_EXPONENT, CKA_EC_PARAMS and
+   CKA_EC_POINT, and for certificates also CKA_VALUE, CKA_SUBJECT,
+   CKA_ISSUER and CKA_SERIAL_NUMBER.
+
+   An object is forgotten when it is destroyed, or any of its
+   attributes set, through the pakchois_*_object() and
+   pakchois_set_attribute_value() functions; the whole cache is
+   discarded when a slot event is seen for the slot.  Objects
+   destroyed or modified by another application are not noticed.
+   Cached values are returned regardless of the login state of the
+   session.  */
+
+/* Enable or disable the attribute cache for the given slot; it is
+ * disabled by default.  Disabling it discards anything cached. */
+ck_rv_t pakchois_set_attribute_cache(pakchois_module_t *module,
+                                     ck_slot_id_t slot_id, int enable);
+
+/* Object index.
+
+   The following interfaces find a token object by class and CKA_ID
+   or CKA_LABEL using a per-slot index, which is built on first use
+   by enumerating the token objects visible to the session, after
+   which lookups are constant-time and need no provider calls.
+   Objects created, copied, destroyed or relabelled through the
+   pakchois_*_object() and pakchois_set_attribute_value() functions,
+   and keys created by the key generation, unwrapping and derivation
+   functions, are reflected in the index; it is discarded when a slot
+   event is seen for the slot.
+
+   An object not in the index is searched for with
+   C_FindObjects, and added if found, so objects which were not
+   visible when the index was built, such as private objects before
+   login, are still found.  A search which finds nothing is
+   remembered, so repeated lookups of a missing object need no
+   provider calls, until an object or key is created, copied or
+   relabelled through this library, pakchois_login() or
+   pakchois_logout() succeeds, or a slot event is seen; an object
+   created by another application meanwhile is not found.  If several objects match,
+   any one of them may be returned.  A handle found may belong to an
+   object destroyed by another application.  */
+
+/* Find a token object by class and CKA_ID.  The handle is stored in
+ * *object, or CK_INVALID_HANDLE if there is no such object. */
+ck_rv_t pakchois_lookup_object(pakchois_session_t *session,
+                               ck_object_class_t class,
+                               const unsigned char *id, unsigned long id_len,
+                               ck_object_handle_t *object);
+
+/* As pakchois_lookup_object(), by class and a NUL-terminated
+ * CKA_LABEL. */
+ck_rv_t pakchois_lookup_object_by_label(pakchois_session_t *session,
+                                        ck_object_class_t class,
+                                        const char *label,
+                                        ck_object_handle_t *object);
+
+/* Certificate index.
+
+   The following interfaces find certificates on a token through a
+   per-slot index of the CKA_SUBJECT, CKA_ISSUER and CKA_SERIAL_NUMBER
+   attributes of its token certificate objects, built on first use.
+   Names and serial numbers are given, and compared, as the
+   DER-encoded attribute values.
+
+   After a certificate is created or modified through
+   pakchois_create_object() and similar, or after pakchois_login()
+   or pakchois_logout() change whether private certificates are
+   visible, the index is refreshed on next use: the certificates on
+   the token are listed again, and the attributes fetched only for
+   those not already indexed.  After a slot event, the attributes of
+   every certificate are fetched again, since handles may have been
+   reused for other objects.  */
+
+/* Find the certificate with the given issuer and serial number.  The
+ * handle is stored in *object, or CK_INVALID_HANDLE if there is no
+ * such certificate. */
+ck_rv_t pakchois_find_certificate(pakchois_session_t *session,
+                                  const unsigned char *issuer,
+                                  unsigned long issuer_len,
+                                  const unsigned char *serial,
+                                  unsigned long serial_len,
+                                  ck_object_handle_t *object);
+
+/* Find the certificates with the given subject.  On entry, *count
+ * gives the size of the objects array; on return it gives the number
+ * of certificates found.  If objects is NULL, only the number is
+ * returned; if it is too small, CKR_BUFFER_TOO_SMALL is returned and
+ * the array holds as many handles as fit. */
+ck_rv_t pakchois_find_certificates_by_subject(pakchois_session_t *session,
+                                              const unsigned char *subject,
+                                              unsigned long subject_len,
+                                              ck_object_handle_t *objects,
+                                              unsigned long *count);
+
+/* Build the chain of certificates on the token starting from the
+ * given certificate, following each issuer name to a certificate
+ * with that subject, and ending at a self-issued certificate or one
+ * whose issuer is not on the token.  Where several certificates
+ * share a subject, the first one not already in the chain is used;
+ * signatures and key identifiers are not checked.  On entry, *count
+ * gives the size of the chain array; on return, the number of
+ * handles stored, starting with the given certificate.
+ * CKR_BUFFER_TOO_SMALL is returned if the chain was truncated, and
+ * CKR_OBJECT_HANDLE_INVALID if the handle is not an indexed
+ * certificate. */
+ck_rv_t pakchois_build_chain(pakchois_session_t *session,
+                             ck_object_handle_t cert,
+                             ck_object_handle_t *chain,
+                             unsigned long *count);
+
+/* Cache snapshots.
+
+   The mechanism caches, object indexes and attribute caches of a
+   module's slots can be saved to a file, and the file loaded by a
+   later process to avoid fetching them all again from the provider.
+   Each slot's caches are keyed in the file by the serial number,
+   label, and hardware and firmware versions of its token.  Loading
+   only maps the file; the caches for a slot are adopted from it on
+   first use, or first use after a slot event, if the slot then holds
+   a token with the same serial number, label and versions.  The object index
+   and attribute cache are adopted only if a few of the objects also
+   match on the token.  Anything not adopted is fetched from the
+   provider as usual.  */
+
+/* Save the caches of all slots with a token present to the named
+ * file, replacing it atomically.  Returns CKR_OK on success, or
+ * CKR_FUNCTION_FAILED if the file could not be written. */
+ck_rv_t pakchois_save_snapshot(pakchois_module_t *module,
+                               const char *filename);
+
+/* Map the named snapshot file for use by the module.  This should be
+ * called before the module is otherwise used, and at most once per
+ * module; the attribute cache must already be enabled for any slot
+ * whose attributes are to be adopted.  Returns CKR_OK on success, or
+ * CKR_FUNCTION_FAILED if the file is missing, malformed, or was
+ * written by an incompatible version or host. */
+ck_rv_t pakchois_load_snapshot(pakchois_module_t *module,
+                               const char *filename);
+
 #endif /* PAKCHOIS_H */
@@ -0,0 +1,848 @@
+/* Stub PKCS#11 provider for the pakchois test suite. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "stub-pkcs11.h"
+
+struct stub_state stub_state;
+
+pthread_mutex_t stub_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define STATE (&stub_state)
+
+static ck_mechanism_type_t stub_mechs[] = { CKM_RSA_PKCS, CKM_SHA_1 };
+
+static int slot_index(ck_slot_id_t id)
+{
+    return id >= 1 && id <= STUB_SLOTS ? (int)id - 1 : -1;
+}
+
+static struct stub_session *get_session(ck_session_handle_t handle)
+{
+    if (handle < 1 || handle > STUB_SESSIONS
+        || !STATE->sessions[handle - 1].open) {
+        return NULL;
+    }
+    return &STATE->sessions[handle - 1];
+}
+
+static struct stub_object *get_object(ck_object_handle_t handle)
+{
+    if (handle < 1 || handle > STUB_OBJECTS
+        || !STATE->objects[handle - 1].used) {
+        return NULL;
+    }
+    return &STATE->objects[handle - 1];
+}
+
+static struct stub_attr *find_attr(struct stub_object *obj,
+                                   ck_attribute_type_t type)
+{
+    unsigned int n;
+
+    for (n = 0; n < obj->count; n++) {
+        if (obj->attrs[n].type == type) {
+            return &obj->attrs[n];
+        }
+    }
+    return NULL;
+}
+
+static ck_rv_t set_attrs(struct stub_object *obj,
+                         struct ck_attribute *templ, unsigned long count)
+{
+    unsigned long n;
+
+    for (n = 0; n < count; n++) {
+        struct stub_attr *a = find_attr(obj, templ[n].type);
+
+        if (templ[n].value_len > sizeof a->value) {
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        if (a == NULL) {
+            if (obj->count == STUB_ATTRS) {
+                return CKR_TEMPLATE_INCONSISTENT;
+            }
+            a = &obj->attrs[obj->count++];
+            a->type = templ[n].type;
+        }
+        memcpy(a->value, templ[n].value, templ[n].value_len);
+        a->len = templ[n].value_len;
+    }
+
+    return CKR_OK;
+}
+
+static int matches(struct stub_session *sess, struct stub_object *obj)
+{
+    unsigned int n;
+
+    for (n = 0; n < sess->find_count; n++) {
+        struct stub_attr *a = find_attr(obj, sess->find[n].type);
+
+        if (a == NULL || a->len != sess->find[n].len
+            || memcmp(a->value, sess->find[n].value, a->len)) {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* Returns the output length of the active operation for given input
+ * length. */
+static unsigned long output_len(struct stub_session *sess,
+                                unsigned long input_len)
+{
+    struct stub_object *key;
+    struct stub_attr *bits;
+    unsigned long modulus_bits = 1024;
+
+    switch (sess->op) {
+    case STUB_OP_DIGEST:
+        return 20;
+    case STUB_OP_ENCRYPT:
+        return input_len;
+    case STUB_OP_DECRYPT:
+        /* Deliberately unrelated to the size of the key. */
+        return input_len / 2;
+    default:
+        break;
+    }
+
+    key = get_object(sess->key);
+    if (key && (bits = find_attr(key, CKA_MODULUS_BITS)) != NULL
+        && bits->len == sizeof modulus_bits) {
+        memcpy(&modulus_bits, bits->value, sizeof modulus_bits);
+    }
+
+    return modulus_bits / 8;
+}
+
+static void transform(unsigned char *in, unsigned long in_len,
+                      unsigned char *out, unsigned long out_len)
+{
+    unsigned long n;
+
+    for (n = 0; n < out_len; n++) {
+        out[n] = (in_len ? in[n % in_len] : 0) ^ (unsigned char)n;
+    }
+}
+
+static ck_rv_t stub_initialize(void *args)
+{
+    int n;
+
+    pthread_mutex_lock(&stub_mutex);
+    memset(STATE, 0, sizeof *STATE);
+    STATE->initialized = 1;
+    for (n = 0; n < STUB_SLOTS; n++) {
+        STATE->present[n] = 1;
+        memset(STATE->serial[n], ' ', sizeof STATE->serial[n]);
+        STATE->serial[n][0] = '1' + n;
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return CKR_OK;
+}
+
+static ck_rv_t stub_finalize(void *reserved)
+{
+    pthread_mutex_lock(&stub_mutex);
+    STATE->initialized = 0;
+    pthread_mutex_unlock(&stub_mutex);
+    return CKR_OK;
+}
+
+static ck_rv_t stub_get_info(struct ck_info *info)
+{
+    memset(info, ' ', sizeof *info);
+    info->cryptoki_version.major = 2;
+    info->cryptoki_version.minor = 20;
+    info->flags = 0;
+    memcpy(info->manufacturer_id, "pakchois", 8);
+    memcpy(info->library_description, "stub", 4);
+    return CKR_OK;
+}
+
+static ck_rv_t stub_get_slot_list(unsigned char token_present,
+                                  ck_slot_id_t *slot_list,
+                                  unsigned long *count)
+{
+    unsigned long n = 0;
+    int i;
+    ck_rv_t rv = CKR_OK;
+
+    pthread_mutex_lock(&stub_mutex);
+    for (i = 0; i < STUB_SLOTS; i++) {
+        if (!token_present || STATE->present[i]) {
+            if (slot_list && n < *count) {
+                slot_list[n] = i + 1;
+            }
+            else if (slot_list) {
+                rv = CKR_BUFFER_TOO_SMALL;
+            }
+            n++;
+        }
+    }
+    pthread_mutex_unlock(&stub_mutex);
+
+    *count = n;
+    return rv;
+}
+
+static ck_rv_t stub_get_slot_info(ck_slot_id_t slot_id,
+                                  struct ck_slot_info *info)
+{
+    int n = slot_index(slot_id);
+
+    if (n < 0) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    memset(info, ' ', sizeof *info);
+    memcpy(info->slot_description, "stub slot", 9);
+    pthread_mutex_lock(&stub_mutex);
+    info->flags = STATE->present[n] ? CKF_TOKEN_PRESENT : 0;
+    info->hardware_version = STATE->hardware[n];
+    info->firmware_version = STATE->firmware[n];
+    pthread_mutex_unlock(&stub_mutex);
+    return CKR_OK;
+}
+
+static ck_rv_t stub_get_token_info(ck_slot_id_t slot_id,
+                                   struct ck_token_info *info)
+{
+    int n = slot_index(slot_id);
+    ck_rv_t rv = CKR_OK;
+
+    if (n < 0) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    STATE->calls_token_info++;
+    if (STATE->token_info_rv) {
+        rv = STATE->token_info_rv;
+    }
+    else if (STATE->present[n]) {
+        memset(info, ' ', sizeof *info);
+        memcpy(info->label, "stub token", 10);
+        memcpy(info->serial_number, STATE->serial[n],
+               sizeof info->serial_number);
+        info->flags = CKF_TOKEN_INITIALIZED | CKF_LOGIN_REQUIRED;
+        info->max_session_count = STUB_SESSIONS / STUB_SLOTS;
+        info->hardware_version = STATE->hardware[n];
+        info->firmware_version = STATE->firmware[n];
+    }
+    else {
+        rv = CKR_TOKEN_NOT_PRESENT;
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return rv;
+}
+
+static ck_rv_t stub_wait_for_slot_event(ck_flags_t flags,
+                                        ck_slot_id_t *slot,
+                                        void *reserved)
+{
+    ck_rv_t rv = CKR_NO_EVENT;
+
+    if (!STATE->events || !(flags & CKF_DONT_BLOCK)) {
+        return CKR_FUNCTION_NOT_SUPPORTED;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    if (STATE->npending) {
+        *slot = STATE->pending[0];
+        memmove(STATE->pending, STATE->pending + 1,
+                --STATE->npending * sizeof STATE->pending[0]);
+        rv = CKR_OK;
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return rv;
+}
+
+static ck_rv_t stub_get_mechanism_list(ck_slot_id_t slot_id,
+                                       ck_mechanism_type_t *list,
+                                       unsigned long *count)
+{
+    unsigned long n = sizeof stub_mechs / sizeof stub_mechs[0];
+
+    if (slot_index(slot_id) < 0) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    if (list && *count < n) {
+        *count = n;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+    if (list) {
+        memcpy(list, stub_mechs, sizeof stub_mechs);
+        pthread_mutex_lock(&stub_mutex);
+        STATE->calls_mechanism_list++;
+        pthread_mutex_unlock(&stub_mutex);
+        if (STATE->mechanism_hook) {
+            STATE->mechanism_hook(slot_id);
+        }
+    }
+    *count = n;
+    return CKR_OK;
+}
+
+static ck_rv_t stub_get_mechanism_info(ck_slot_id_t slot_id,
+                                       ck_mechanism_type_t type,
+                                       struct ck_mechanism_info *info)
+{
+    if (slot_index(slot_id) < 0) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    switch (type) {
+    case CKM_RSA_PKCS:
+        info->min_key_size = 512;
+        info->max_key_size = 4096;
+        info->flags = CKF_SIGN | CKF_VERIFY | CKF_ENCRYPT | CKF_DECRYPT;
+        return CKR_OK;
+    case CKM_SHA_1:
+        info->min_key_size = info->max_key_size = 0;
+        info->flags = CKF_DIGEST;
+        return CKR_OK;
+    default:
+        return CKR_MECHANISM_INVALID;
+    }
+}
+
+static ck_rv_t stub_open_session(ck_slot_id_t slot_id, ck_flags_t flags,
+                                 void *application, ck_notify_t notify,
+                                 ck_session_handle_t *session)
+{
+    int n = slot_index(slot_id), i;
+    ck_rv_t rv = CKR_SESSION_COUNT;
+
+    if (n < 0) {
+        return CKR_SLOT_ID_INVALID;
+    }
+
+    if (STATE->open_delay) {
+        usleep(STATE->open_delay * 1000);
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    STATE->calls_open++;
+    if (!STATE->present[n]) {
+        rv = CKR_TOKEN_NOT_PRESENT;
+    }
+    else {
+        for (i = 0; i < STUB_SESSIONS; i++) {
+            if (!STATE->sessions[i].open) {
+                memset(&STATE->sessions[i], 0, sizeof STATE->sessions[i]);
+                STATE->sessions[i].open = 1;
+                STATE->sessions[i].slot = slot_id;
+                *session = i + 1;
+                rv = CKR_OK;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return rv;
+}
+
+static ck_rv_t stub_close_session(ck_session_handle_t session)
+{
+    struct stub_session *sess;
+    ck_rv_t rv = CKR_SESSION_HANDLE_INVALID;
+
+    pthread_mutex_lock(&stub_mutex);
+    if ((sess = get_session(session)) != NULL) {
+        int n, others = 0;
+
+        sess->open = 0;
+        for (n = 0; n < STUB_SESSIONS; n++) {
+            if (STATE->sessions[n].open
+                && STATE->sessions[n].slot == sess->slot) {
+                others = 1;
+            }
+        }
+        if (!others) {
+            STATE->logged_in[slot_index(sess->slot)] = 0;
+        }
+        rv = CKR_OK;
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return rv;
+}
+
+static ck_rv_t stub_get_session_info(ck_session_handle_t session,
+                                     struct ck_session_info *info)
+{
+    struct stub_session *sess = get_session(session);
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    info->slot_id = sess->slot;
+    pthread_mutex_lock(&stub_mutex);
+    info->state = STATE->logged_in[slot_index(sess->slot)]
+        ? CKS_RO_USER_FUNCTIONS : CKS_RO_PUBLIC_SESSION;
+    pthread_mutex_unlock(&stub_mutex);
+    info->flags = CKF_SERIAL_SESSION;
+    info->device_error = 0;
+    return CKR_OK;
+}
+
+static ck_rv_t stub_login(ck_session_handle_t session,
+                          ck_user_type_t user_type,
+                          unsigned char *pin, unsigned long pin_len)
+{
+    struct stub_session *sess = get_session(session);
+    unsigned int delay;
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    STATE->calls_login++;
+    delay = STATE->login_delay;
+    pthread_mutex_unlock(&stub_mutex);
+
+    if (delay) {
+        usleep(delay * 1000);
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    STATE->logged_in[slot_index(sess->slot)] = 1;
+    pthread_mutex_unlock(&stub_mutex);
+    return CKR_OK;
+}
+
+static ck_rv_t stub_logout(ck_session_handle_t session)
+{
+    struct stub_session *sess = get_session(session);
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    STATE->logged_in[slot_index(sess->slot)] = 0;
+    pthread_mutex_unlock(&stub_mutex);
+    return CKR_OK;
+}
+
+static ck_rv_t stub_create_object(ck_session_handle_t session,
+                                  struct ck_attribute *templ,
+                                  unsigned long count,
+                                  ck_object_handle_t *object)
+{
+    ck_rv_t rv = CKR_DEVICE_MEMORY;
+    int n;
+
+    if (get_session(session) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    for (n = 0; n < STUB_OBJECTS; n++) {
+        struct stub_object *obj = &STATE->objects[n];
+
+        if (!obj->used) {
+            obj->count = 0;
+            rv = set_attrs(obj, templ, count);
+            if (rv == CKR_OK) {
+                obj->used = 1;
+                *object = n + 1;
+            }
+            break;
+        }
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return rv;
+}
+
+static ck_rv_t stub_destroy_object(ck_session_handle_t session,
+                                   ck_object_handle_t object)
+{
+    struct stub_object *obj;
+    ck_rv_t rv = CKR_OBJECT_HANDLE_INVALID;
+
+    if (get_session(session) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    if ((obj = get_object(object)) != NULL) {
+        obj->used = 0;
+        rv = CKR_OK;
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return rv;
+}
+
+/* Creates the two objects from the templates; no key material is
+ * generated. */
+static ck_rv_t stub_generate_key_pair(ck_session_handle_t session,
+                                      struct ck_mechanism *mechanism,
+                                      struct ck_attribute *public_templ,
+                                      unsigned long public_count,
+                                      struct ck_attribute *private_templ,
+                                      unsigned long private_count,
+                                      ck_object_handle_t *public_key,
+                                      ck_object_handle_t *private_key)
+{
+    ck_rv_t rv;
+
+    rv = stub_create_object(session, public_templ, public_count, public_key);
+    if (rv == CKR_OK) {
+        rv = stub_create_object(session, private_templ, private_count,
+                                private_key);
+        if (rv != CKR_OK) {
+            stub_destroy_object(session, *public_key);
+        }
+    }
+
+    return rv;
+}
+
+static ck_rv_t stub_get_attribute_value(ck_session_handle_t session,
+                                        ck_object_handle_t object,
+                                        struct ck_attribute *templ,
+                                        unsigned long count)
+{
+    struct stub_object *obj;
+    ck_rv_t rv = CKR_OK;
+    unsigned long n;
+
+    if (get_session(session) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    STATE->calls_get_attribute++;
+    obj = get_object(object);
+    for (n = 0; obj && n < count; n++) {
+        struct stub_attr *a = find_attr(obj, templ[n].type);
+
+        if (a == NULL) {
+            templ[n].value_len = (unsigned long)-1;
+            rv = CKR_ATTRIBUTE_TYPE_INVALID;
+        }
+        else if (templ[n].value == NULL) {
+            templ[n].value_len = a->len;
+        }
+        else if (templ[n].value_len < a->len) {
+            templ[n].value_len = (unsigned long)-1;
+            rv = CKR_BUFFER_TOO_SMALL;
+        }
+        else {
+            memcpy(templ[n].value, a->value, a->len);
+            templ[n].value_len = a->len;
+        }
+    }
+    pthread_mutex_unlock(&stub_mutex);
+
+    return obj ? rv : CKR_OBJECT_HANDLE_INVALID;
+}
+
+static ck_rv_t stub_set_attribute_value(ck_session_handle_t session,
+                                        ck_object_handle_t object,
+                                        struct ck_attribute *templ,
+                                        unsigned long count)
+{
+    struct stub_object *obj;
+    ck_rv_t rv = CKR_OBJECT_HANDLE_INVALID;
+
+    if (get_session(session) == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    if ((obj = get_object(object)) != NULL) {
+        rv = set_attrs(obj, templ, count);
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return rv;
+}
+
+static ck_rv_t stub_find_objects_init(ck_session_handle_t session,
+                                      struct ck_attribute *templ,
+                                      unsigned long count)
+{
+    struct stub_session *sess = get_session(session);
+    unsigned long n;
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (sess->finding) {
+        return CKR_OPERATION_ACTIVE;
+    }
+    if (count > STUB_ATTRS) {
+        return CKR_TEMPLATE_INCONSISTENT;
+    }
+
+    for (n = 0; n < count; n++) {
+        if (templ[n].value_len > sizeof sess->find[n].value) {
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+        }
+        sess->find[n].type = templ[n].type;
+        memcpy(sess->find[n].value, templ[n].value, templ[n].value_len);
+        sess->find[n].len = templ[n].value_len;
+    }
+
+    sess->find_count = count;
+    sess->find_next = 1;
+    sess->finding = 1;
+    return CKR_OK;
+}
+
+static ck_rv_t stub_find_objects(ck_session_handle_t session,
+                                 ck_object_handle_t *objects,
+                                 unsigned long max, unsigned long *count)
+{
+    struct stub_session *sess = get_session(session);
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (!sess->finding) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    pthread_mutex_lock(&stub_mutex);
+    STATE->calls_find++;
+    if (STATE->find_page && max > STATE->find_page) {
+        max = STATE->find_page;
+    }
+
+    *count = 0;
+    while (*count < max && sess->find_next <= STUB_OBJECTS) {
+        struct stub_object *obj = &STATE->objects[sess->find_next - 1];
+
+        if (obj->used && matches(sess, obj)) {
+            objects[(*count)++] = sess->find_next;
+        }
+        sess->find_next++;
+    }
+    pthread_mutex_unlock(&stub_mutex);
+    return CKR_OK;
+}
+
+static ck_rv_t stub_find_objects_final(ck_session_handle_t session)
+{
+    struct stub_session *sess = get_session(session);
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (!sess->finding) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    sess->finding = 0;
+    return CKR_OK;
+}
+
+static ck_rv_t op_init(ck_session_handle_t session, int op,
+                       ck_object_handle_t key)
+{
+    struct stub_session *sess = get_session(session);
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (sess->op) {
+        return CKR_OPERATION_ACTIVE;
+    }
+    if (op != STUB_OP_DIGEST && get_object(key) == NULL) {
+        return CKR_KEY_HANDLE_INVALID;
+    }
+
+    sess->op = op;
+    sess->key = key;
+    return CKR_OK;
+}
+
+/* Single-part operation with the usual PKCS#11 conventions for
+ * output buffers: the operation remains active after a size query or
+ * CKR_BUFFER_TOO_SMALL, and is otherwise finished. */
+static ck_rv_t op_run(ck_session_handle_t session, int op,
+                      unsigned char *in, unsigned long in_len,
+                      unsigned char *out, unsigned long *out_len)
+{
+    struct stub_session *sess = get_session(session);
+    unsigned long len;
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (sess->op != op) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    len = output_len(sess, in_len);
+    if (op == STUB_OP_SIGN && in_len > len) {
+        /* As for RSA, the input must fit in the modulus. */
+        sess->op = STUB_OP_NONE;
+        return CKR_DATA_LEN_RANGE;
+    }
+    if (out == NULL) {
+        *out_len = len;
+        return CKR_OK;
+    }
+    if (*out_len < len) {
+        *out_len = len;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    transform(in, in_len, out, len);
+    *out_len = len;
+    sess->op = STUB_OP_NONE;
+    return CKR_OK;
+}
+
+static ck_rv_t stub_sign_init(ck_session_handle_t session,
+                              struct ck_mechanism *mechanism,
+                              ck_object_handle_t key)
+{
+    return op_init(session, STUB_OP_SIGN, key);
+}
+
+static ck_rv_t stub_sign(ck_session_handle_t session,
+                         unsigned char *data, unsigned long data_len,
+                         unsigned char *signature,
+                         unsigned long *signature_len)
+{
+    return op_run(session, STUB_OP_SIGN, data, data_len,
+                  signature, signature_len);
+}
+
+static ck_rv_t stub_verify_init(ck_session_handle_t session,
+                                struct ck_mechanism *mechanism,
+                                ck_object_handle_t key)
+{
+    return op_init(session, STUB_OP_VERIFY, key);
+}
+
+static ck_rv_t stub_verify(ck_session_handle_t session,
+                           unsigned char *data, unsigned long data_len,
+                           unsigned char *signature,
+                           unsigned long signature_len)
+{
+    struct stub_session *sess = get_session(session);
+    unsigned char expect[512];
+    unsigned long len;
+
+    if (sess == NULL) {
+        return CKR_SESSION_HANDLE_INVALID;
+    }
+    if (sess->op != STUB_OP_VERIFY) {
+        return CKR_OPERATION_NOT_INITIALIZED;
+    }
+
+    len = output_len(sess, data_len);
+    sess->op = STUB_OP_NONE;
+    if (signature_len != len || len > sizeof expect) {
+        return CKR_SIGNATURE_LEN_RANGE;
+    }
+
+    transform(data, data_len, expect, len);
+    return memcmp(expect, signature, len) ? CKR_SIGNATURE_INVALID : CKR_OK;
+}
+
+static ck_rv_t stub_encrypt_init(ck_session_handle_t session,
+                                 struct ck_mechanism *mechanism,
+                                 ck_object_handle_t key)
+{
+    return op_init(session, STUB_OP_ENCRYPT, key);
+}
+
+static ck_rv_t stub_encrypt(ck_session_handle_t session,
+                            unsigned char *data, unsigned long data_len,
+                            unsigned char *encrypted_data,
+                            unsigned long *encrypted_data_len)
+{
+    return op_run(session, STUB_OP_ENCRYPT, data, data_len,
+                  encrypted_data, encrypted_data_len);
+}
+
+static ck_rv_t stub_decrypt_init(ck_session_handle_t session,
+                                 struct ck_mechanism *mechanism,
+                                 ck_object_handle_t key)
+{
+    return op_init(session, STUB_OP_DECRYPT, key);
+}
+
+static ck_rv_t stub_decrypt(ck_session_handle_t session,
+                            unsigned char *encrypted_data,
+                            unsigned long encrypted_data_len,
+                            unsigned char *data, unsigned long *data_len)
+{
+    return op_run(session, STUB_OP_DECRYPT, encrypted_data,
+                  encrypted_data_len, data, data_len);
+}
+
+static ck_rv_t stub_digest_init(ck_session_handle_t session,
+                                struct ck_mechanism *mechanism)
+{
+    return op_init(session, STUB_OP_DIGEST, 0);
+}
+
+static ck_rv_t stub_digest(ck_session_handle_t session,
+                           unsigned char *data, unsigned long data_len,
+                           unsigned char *digest, unsigned long *digest_len)
+{
+    return op_run(session, STUB_OP_DIGEST, data, data_len,
+                  digest, digest_len);
+}
+
+static struct ck_function_list stub_functions;
+
+ck_rv_t C_GetFunctionList(struct ck_function_list **list)
+{
+    struct ck_function_list *fns = &stub_functions;
+
+    fns->version.major = 2;
+    fns->version.minor = 20;
+    fns->C_Initialize = stub_initialize;
+    fns->C_Finalize = stub_finalize;
+    fns->C_GetInfo = stub_get_info;
+    fns->C_GetFunctionList = C_GetFunctionList;
+    fns->C_GetSlotList = stub_get_slot_list;
+    fns->C_GetSlotInfo = stub_get_slot_info;
+    fns->C_GetTokenInfo = stub_get_token_info;
+    fns->C_WaitForSlotEvent = stub_wait_for_slot_event;
+    fns->C_GetMechanismList = stub_get_mechanism_list;
+    fns->C_GetMechanismInfo = stub_get_mechanism_info;
+    fns->C_OpenSession = stub_open_session;
+    fns->C_CloseSession = stub_close_session;
+    fns->C_GetSessionInfo = stub_get_session_info;
+    fns->C_Login = stub_login;
+    fns->C_Logout = stub_logout;
+    fns->C_CreateObject = stub_create_object;
+    fns->C_DestroyObject = stub_destroy_object;
+    fns->C_GetAttributeValue = stub_get_attribute_value;
+    fns->C_SetAttributeValue = stub_set_attribute_value;
+    fns->C_GenerateKeyPair = stub_generate_key_pair;
+    fns->C_FindObjectsInit = stub_find_objects_init;
+    fns->C_FindObjects = stub_find_objects;
+    fns->C_FindObjectsFinal = stub_find_objects_final;
+    fns->C_SignInit = stub_sign_init;
+    fns->C_Sign = stub_sign;
+    fns->C_VerifyInit = stub_verify_init;
+    fns->C_Verify = stub_verify;
+    fns->C_EncryptInit = stub_encrypt_init;
+    fns->C_Encrypt = stub_encrypt;
+    fns->C_DecryptInit = stub_decrypt_init;
+    fns->C_Decrypt = stub_decrypt;
+    fns->C_DigestInit = stub_digest_init;
+    fns->C_Digest = stub_digest;
+
+    *list = fns;
+    return CKR_OK;
+}
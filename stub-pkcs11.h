@@ -0,0 +1,102 @@
+/* Stub PKCS#11 provider for the pakchois test suite. */
+
+#ifndef STUB_PKCS11_H
+#define STUB_PKCS11_H
+
+#ifndef CRYPTOKI_GNU
+#define CRYPTOKI_GNU
+#endif
+
+#include "pakchois11.h"
+
+/* The stub provider has STUB_SLOTS slots, with ids 1 to STUB_SLOTS,
+ * each holding a token by default.  All slots share one set of
+ * objects.  Its state is exported as the "stub_state" symbol, and is
+ * reset by C_Initialize; tests may change it between calls into the
+ * provider, or whilst holding the mutex exported as "stub_mutex". */
+#define STUB_SLOTS (2)
+#define STUB_OBJECTS (256)
+#define STUB_SESSIONS (64)
+#define STUB_ATTRS (8)
+#define STUB_EVENTS (8)
+
+struct stub_attr {
+    ck_attribute_type_t type;
+    unsigned char value[64];
+    unsigned long len;
+};
+
+struct stub_object {
+    int used;
+    struct stub_attr attrs[STUB_ATTRS];
+    unsigned int count;
+};
+
+struct stub_session {
+    int open;
+    ck_slot_id_t slot;
+    /* Active operation, one of the STUB_OP_* values, and its key. */
+    int op;
+    ck_object_handle_t key;
+    /* Active search: template and next object handle to test. */
+    int finding;
+    struct stub_attr find[STUB_ATTRS];
+    unsigned int find_count;
+    ck_object_handle_t find_next;
+};
+
+enum {
+    STUB_OP_NONE = 0,
+    STUB_OP_SIGN,
+    STUB_OP_VERIFY,
+    STUB_OP_ENCRYPT,
+    STUB_OP_DECRYPT,
+    STUB_OP_DIGEST
+};
+
+struct stub_state {
+    /* Non-zero between C_Initialize and C_Finalize. */
+    int initialized;
+
+    /* Per-slot token presence, serial number and versions. */
+    int present[STUB_SLOTS];
+    char serial[STUB_SLOTS][16];
+    struct ck_version hardware[STUB_SLOTS], firmware[STUB_SLOTS];
+
+    /* If non-zero, C_GetTokenInfo fails with this error. */
+    ck_rv_t token_info_rv;
+
+    /* If non-zero, C_WaitForSlotEvent supports CKF_DONT_BLOCK calls,
+     * returning the queued events in turn; otherwise it is not
+     * supported. */
+    int events;
+    ck_slot_id_t pending[STUB_EVENTS];
+    unsigned int npending;
+
+    /* Maximum number of handles returned by one call to
+     * C_FindObjects, if non-zero. */
+    unsigned long find_page;
+
+    /* If non-NULL, called by C_GetMechanismList after it returns the
+     * list, without the stub's lock held. */
+    void (*mechanism_hook)(ck_slot_id_t slot_id);
+
+    /* Milliseconds for which C_OpenSession sleeps. */
+    unsigned int open_delay;
+
+    /* Milliseconds for which C_Login sleeps before the token is
+     * logged in; the token is logged out again when its last session
+     * is closed. */
+    unsigned int login_delay;
+    int logged_in[STUB_SLOTS];
+
+    struct stub_object objects[STUB_OBJECTS];
+    struct stub_session sessions[STUB_SESSIONS];
+
+    /* Number of calls made to each function; for C_GetMechanismList,
+     * only those which return the list. */
+    unsigned long calls_find, calls_mechanism_list, calls_token_info,
+        calls_open, calls_login, calls_get_attribute;
+};
+
+#endif /* STUB_PKCS11_H */
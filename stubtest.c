@@ -0,0 +1,1728 @@
+/* Tests for pakchois using the stub provider.  The library is built
+ * into the test program with the module path set to the directory
+ * holding the stub provider, which is then loaded as module "stub".
+ * Internal structures of the library may be used by the tests. */
+
+#undef PAKCHOIS_MODPATH
+#define PAKCHOIS_MODPATH STUB_MODPATH
+#include "pakchois.c"
+
+#include <poll.h>
+
+#include "stub-pkcs11.h"
+
+static struct stub_state *stub;
+static pthread_mutex_t *stub_mutex;
+
+#define CHECK(cond) do {                                        \
+        if (!(cond)) {                                          \
+            printf("%s:%d: check failed: %s\n", __FILE__,       \
+                   __LINE__, #cond);                            \
+            return 1;                                           \
+        }                                                       \
+    } while (0)
+
+#define CHECK_RV(expr, expect) do {                             \
+        ck_rv_t rv_ = (expr);                                   \
+        if (rv_ != (expect)) {                                  \
+            printf("%s:%d: %s returned %s, expected %s\n",      \
+                   __FILE__, __LINE__, #expr,                   \
+                   pakchois_error(rv_), pakchois_error(expect));\
+            return 1;                                           \
+        }                                                       \
+    } while (0)
+
+/* Load the stub provider, whose state is reset each time it is
+ * initialized. */
+static int load(pakchois_module_t **mod)
+{
+    static void *handle;
+
+    if (pakchois_module_load(mod, "stub") != CKR_OK) {
+        printf("could not load stub provider from %s\n", STUB_MODPATH);
+        return 1;
+    }
+
+    /* Hold a reference to the provider so its state stays mapped
+     * across module destruction. */
+    if (handle == NULL) {
+        handle = dlopen(STUB_MODPATH "/stub-pkcs11.so", RTLD_NOW);
+        stub = handle ? dlsym(handle, "stub_state") : NULL;
+        stub_mutex = handle ? dlsym(handle, "stub_mutex") : NULL;
+        if (stub == NULL || stub_mutex == NULL) {
+            printf("could not find stub state: %s\n", dlerror());
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* Returns the number of provider sessions with an operation or
+ * search active. */
+static int active_operations(void)
+{
+    int n, count = 0;
+
+    for (n = 0; n < STUB_SESSIONS; n++) {
+        if (stub->sessions[n].open
+            && (stub->sessions[n].op || stub->sessions[n].finding)) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+/* Create a token object with given class and label. */
+static ck_rv_t add_object(pakchois_session_t *sess, ck_object_class_t class,
+                          const char *label, ck_object_handle_t *object)
+{
+    unsigned char token = 1;
+    struct ck_attribute a[3];
+
+    a[0].type = CKA_CLASS;
+    a[0].value = &class;
+    a[0].value_len = sizeof class;
+    a[1].type = CKA_LABEL;
+    a[1].value = (void *)label;
+    a[1].value_len = strlen(label);
+    a[2].type = CKA_TOKEN;
+    a[2].value = &token;
+    a[2].value_len = sizeof token;
+
+    return pakchois_create_object(sess, a, 3, object);
+}
+
+static ck_rv_t add_cert(pakchois_session_t *sess, const char *subject,
+                        const char *issuer, const char *serial,
+                        ck_object_handle_t *object)
+{
+    ck_object_class_t class = CKO_CERTIFICATE;
+    unsigned char token = 1;
+    struct ck_attribute a[5];
+
+    a[0].type = CKA_CLASS;
+    a[0].value = &class;
+    a[0].value_len = sizeof class;
+    a[1].type = CKA_TOKEN;
+    a[1].value = &token;
+    a[1].value_len = sizeof token;
+    a[2].type = CKA_SUBJECT;
+    a[2].value = (void *)subject;
+    a[2].value_len = strlen(subject);
+    a[3].type = CKA_ISSUER;
+    a[3].value = (void *)issuer;
+    a[3].value_len = strlen(issuer);
+    a[4].type = CKA_SERIAL_NUMBER;
+    a[4].value = (void *)serial;
+    a[4].value_len = strlen(serial);
+
+    return pakchois_create_object(sess, a, 5, object);
+}
+
+static ck_rv_t add_key(pakchois_session_t *sess, unsigned long bits,
+                       ck_object_handle_t *object)
+{
+    ck_object_class_t class = CKO_PRIVATE_KEY;
+    ck_key_type_t type = CKK_RSA;
+    struct ck_attribute a[3];
+
+    a[0].type = CKA_CLASS;
+    a[0].value = &class;
+    a[0].value_len = sizeof class;
+    a[1].type = CKA_KEY_TYPE;
+    a[1].value = &type;
+    a[1].value_len = sizeof type;
+    a[2].type = CKA_MODULUS_BITS;
+    a[2].value = &bits;
+    a[2].value_len = sizeof bits;
+
+    return pakchois_create_object(sess, a, 3, object);
+}
+
+/* Generate a token key pair with the given label. */
+static ck_rv_t add_key_pair(pakchois_session_t *sess, const char *label,
+                            ck_object_handle_t *public_key,
+                            ck_object_handle_t *private_key)
+{
+    ck_object_class_t pub = CKO_PUBLIC_KEY, priv = CKO_PRIVATE_KEY;
+    struct ck_mechanism mech = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    unsigned char token = 1;
+    struct ck_attribute a[3], b[3];
+
+    a[0].type = CKA_CLASS;
+    a[0].value = &pub;
+    a[0].value_len = sizeof pub;
+    a[1].type = CKA_TOKEN;
+    a[1].value = &token;
+    a[1].value_len = sizeof token;
+    a[2].type = CKA_LABEL;
+    a[2].value = (void *)label;
+    a[2].value_len = strlen(label);
+    b[0] = a[0];
+    b[0].value = &priv;
+    b[1] = a[1];
+    b[2] = a[2];
+
+    return pakchois_generate_key_pair(sess, &mech, a, 3, b, 3,
+                                      public_key, private_key);
+}
+
+static int slots(void)
+{
+    pakchois_module_t *mod;
+    ck_slot_id_t list[STUB_SLOTS];
+    unsigned long count = STUB_SLOTS;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_get_slot_list(mod, 1, list, &count), CKR_OK);
+    CHECK(count == STUB_SLOTS);
+    CHECK(list[0] == 1 && list[1] == 2);
+
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+static int find_all(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    pakchois_find_iter_t *iter;
+    ck_object_class_t class = CKO_DATA;
+    struct ck_attribute a;
+    ck_object_handle_t *objects, obj;
+    unsigned long count, n;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION,
+                                   NULL, NULL, &sess), CKR_OK);
+    for (n = 0; n < 100; n++) {
+        CHECK_RV(add_object(sess, n % 2 ? CKO_DATA : CKO_CERTIFICATE,
+                            "obj", &obj), CKR_OK);
+    }
+
+    a.type = CKA_CLASS;
+    a.value = &class;
+    a.value_len = sizeof class;
+
+    CHECK_RV(pakchois_find_all(sess, &a, 1, &objects, &count), CKR_OK);
+    CHECK(count == 50);
+    for (n = 0; n < count; n++) {
+        CHECK(objects[n] == 2 * n + 2);
+    }
+    free(objects);
+
+    CHECK_RV(pakchois_find_iter_init(&iter, sess, &a, 1), CKR_OK);
+    for (n = 0; ; n++) {
+        CHECK_RV(pakchois_find_iter_next(iter, &obj), CKR_OK);
+        if (obj == CK_INVALID_HANDLE) break;
+        CHECK(obj == 2 * n + 2);
+    }
+    pakchois_find_iter_destroy(iter);
+    CHECK(n == 50);
+    CHECK(active_operations() == 0);
+
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* C_FindObjects may return fewer handles than requested before the
+ * end of the search. */
+static int find_short_pages(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    pakchois_find_iter_t *iter;
+    ck_object_class_t class = CKO_DATA;
+    struct ck_attribute a;
+    ck_object_handle_t *objects, obj, handle, pub;
+    unsigned long count, n, calls;
+    char label[16];
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION,
+                                   NULL, NULL, &sess), CKR_OK);
+    for (n = 0; n < 100; n++) {
+        snprintf(label, sizeof label, "obj%lu", n);
+        CHECK_RV(add_object(sess, CKO_DATA, label, &obj), CKR_OK);
+    }
+    stub->find_page = 3;
+
+    a.type = CKA_CLASS;
+    a.value = &class;
+    a.value_len = sizeof class;
+
+    CHECK_RV(pakchois_find_all(sess, &a, 1, &objects, &count), CKR_OK);
+    CHECK(count == 100);
+    free(objects);
+
+    CHECK_RV(pakchois_find_iter_init(&iter, sess, &a, 1), CKR_OK);
+    for (n = 0; ; n++) {
+        CHECK_RV(pakchois_find_iter_next(iter, &obj), CKR_OK);
+        if (obj == CK_INVALID_HANDLE) break;
+        CHECK(obj == n + 1);
+    }
+    pakchois_find_iter_destroy(iter);
+    CHECK(n == 100);
+    CHECK(active_operations() == 0);
+
+    /* The object index is built using pakchois_find_all(), so holds
+     * every object without further searches. */
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_DATA, "obj0", &obj),
+             CKR_OK);
+    CHECK(obj == 1);
+    calls = stub->calls_find;
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_DATA, "obj99", &obj),
+             CKR_OK);
+    CHECK(obj == 100);
+    CHECK(stub->calls_find == calls);
+
+    /* A miss is searched for once, and remembered until an object is
+     * created. */
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_DATA, "new", &obj),
+             CKR_OK);
+    CHECK(obj == CK_INVALID_HANDLE);
+    CHECK(stub->calls_find > calls);
+    calls = stub->calls_find;
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_DATA, "new", &obj),
+             CKR_OK);
+    CHECK(obj == CK_INVALID_HANDLE);
+    CHECK(stub->calls_find == calls);
+    CHECK_RV(add_object(sess, CKO_DATA, "new", &handle), CKR_OK);
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_DATA, "new", &obj),
+             CKR_OK);
+    CHECK(obj == handle);
+
+    /* Likewise for generated keys. */
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_PRIVATE_KEY, "pair",
+                                             &obj), CKR_OK);
+    CHECK(obj == CK_INVALID_HANDLE);
+    CHECK_RV(add_key_pair(sess, "pair", &pub, &handle), CKR_OK);
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_PRIVATE_KEY, "pair",
+                                             &obj), CKR_OK);
+    CHECK(obj == handle);
+    CHECK_RV(pakchois_lookup_object_by_label(sess, CKO_PUBLIC_KEY, "pair",
+                                             &obj), CKR_OK);
+    CHECK(obj == pub);
+
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+static int size_query(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    ck_object_handle_t key;
+    unsigned char data[20] = "hello, world", sig[256];
+    unsigned long len;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION,
+                                   NULL, NULL, &sess), CKR_OK);
+    CHECK_RV(add_key(sess, 1024, &key), CKR_OK);
+
+    len = 0;
+    CHECK_RV(pakchois_sign_oneshot(sess, &mech, key, data, sizeof data,
+                                   NULL, &len), CKR_OK);
+    CHECK(len == 128);
+    CHECK(active_operations() == 0);
+
+    len = 10;
+    CHECK_RV(pakchois_sign_oneshot(sess, &mech, key, data, sizeof data,
+                                   sig, &len), CKR_BUFFER_TOO_SMALL);
+    CHECK(len == 128);
+    CHECK(active_operations() == 0);
+
+    len = sizeof sig;
+    CHECK_RV(pakchois_sign_oneshot(sess, &mech, key, data, sizeof data,
+                                   sig, &len), CKR_OK);
+    CHECK(len == 128);
+    CHECK_RV(pakchois_verify_oneshot(sess, &mech, key, data, sizeof data,
+                                     sig, len), CKR_OK);
+    CHECK(active_operations() == 0);
+
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* CKR_BUFFER_TOO_SMALL is returned only when the provider says so,
+ * not when the buffer is smaller than the predicted length. */
+static int buffer_too_small(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    ck_object_handle_t key, big;
+    unsigned char in[20] = "hello, world", out[16], *buf;
+    unsigned long len;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION,
+                                   NULL, NULL, &sess), CKR_OK);
+    CHECK_RV(add_key(sess, 1024, &key), CKR_OK);
+    CHECK_RV(add_key(sess, 8192, &big), CKR_OK);
+
+    CHECK_RV(pakchois_get_output_length(sess, CKF_DECRYPT, &mech, key,
+                                        sizeof in, &len), CKR_OK);
+    CHECK(len == 128);
+
+    len = sizeof out;
+    CHECK_RV(pakchois_decrypt_oneshot(sess, &mech, key, in, sizeof in,
+                                      out, &len), CKR_OK);
+    CHECK(len == 10);
+    CHECK(active_operations() == 0);
+
+    /* The operation is completed into a scratch buffer larger than
+     * the stack buffer. */
+    len = sizeof out;
+    CHECK_RV(pakchois_sign_oneshot(sess, &mech, big, in, sizeof in,
+                                   out, &len), CKR_BUFFER_TOO_SMALL);
+    CHECK(len == 1024);
+    CHECK(active_operations() == 0);
+
+    CHECK_RV(pakchois_sign_alloc(sess, &mech, big, in, sizeof in,
+                                 &buf, &len), CKR_OK);
+    CHECK(len == 1024);
+    free(buf);
+
+    CHECK_RV(pakchois_verify_oneshot(sess, &mech, key, in, sizeof in,
+                                     NULL, 0), CKR_ARGUMENTS_BAD);
+    CHECK(active_operations() == 0);
+
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Lengths which cannot be derived are not looked up again, and
+ * lengths are forgotten when a key's handle is reused. */
+static int output_length(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    ck_object_handle_t key, other;
+    unsigned long len, calls;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION,
+                                   NULL, NULL, &sess), CKR_OK);
+
+    CHECK_RV(add_object(sess, CKO_PRIVATE_KEY, "key", &key), CKR_OK);
+    calls = stub->calls_get_attribute;
+    CHECK_RV(pakchois_get_output_length(sess, CKF_SIGN, &mech, key, 20, &len),
+             CKR_FUNCTION_NOT_SUPPORTED);
+    CHECK(stub->calls_get_attribute == calls + 1);
+    CHECK_RV(pakchois_get_output_length(sess, CKF_SIGN, &mech, key, 20, &len),
+             CKR_FUNCTION_NOT_SUPPORTED);
+    CHECK(stub->calls_get_attribute == calls + 1);
+    CHECK_RV(pakchois_destroy_object(sess, key), CKR_OK);
+
+    CHECK_RV(add_key(sess, 1024, &other), CKR_OK);
+    CHECK(other == key);
+    CHECK_RV(pakchois_get_output_length(sess, CKF_SIGN, &mech, key, 20, &len),
+             CKR_OK);
+    CHECK(len == 128);
+    CHECK_RV(pakchois_destroy_object(sess, key), CKR_OK);
+
+    CHECK_RV(add_key(sess, 2048, &other), CKR_OK);
+    CHECK(other == key);
+    CHECK_RV(pakchois_get_output_length(sess, CKF_SIGN, &mech, key, 20, &len),
+             CKR_OK);
+    CHECK(len == 256);
+
+    /* Learned lengths only grow. */
+    len_store(sess->slot, OP_SIGN, CKM_RSA_PKCS, key, LEN_ANY, 300);
+    len_store(sess->slot, OP_SIGN, CKM_RSA_PKCS, key, LEN_ANY, 200);
+    CHECK_RV(pakchois_get_output_length(sess, CKF_SIGN, &mech, key, 20, &len),
+             CKR_OK);
+    CHECK(len == 300);
+
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Allocations too large to round up or to hold in a block fail
+ * rather than wrapping around. */
+static int arena_limits(void)
+{
+    pakchois_arena_t *arena;
+    unsigned char *p;
+
+    CHECK_RV(pakchois_arena_create(&arena, SIZE_MAX), CKR_HOST_MEMORY);
+    CHECK_RV(pakchois_arena_create(&arena, 0), CKR_OK);
+    CHECK(pakchois_arena_alloc(arena, SIZE_MAX) == NULL);
+    CHECK(pakchois_arena_alloc(arena, SIZE_MAX - ARENA_ALIGN) == NULL);
+    CHECK(pakchois_arena_alloc(arena, ARENA_MAX + 1) == NULL);
+    p = pakchois_arena_alloc(arena, 3 * ARENA_MIN);
+    CHECK(p != NULL);
+    memset(p, 0, 3 * ARENA_MIN);
+    pakchois_arena_destroy(arena);
+    return 0;
+}
+
+/* Values larger than their hinted buffers are fetched with one
+ * query and one more fetch; invalid attributes are reported
+ * without failing the others. */
+static int get_attributes(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    pakchois_arena_t *arena;
+    struct ck_attribute a[3];
+    ck_object_handle_t obj;
+    char label[41];
+    unsigned long calls;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION,
+                                   NULL, NULL, &sess), CKR_OK);
+    CHECK_RV(pakchois_arena_create(&arena, 0), CKR_OK);
+
+    memset(label, 'l', sizeof label - 1);
+    label[sizeof label - 1] = '\0';
+    CHECK_RV(add_object(sess, CKO_DATA, label, &obj), CKR_OK);
+
+    memset(a, 0, sizeof a);
+    a[0].type = CKA_CLASS;
+    a[1].type = CKA_LABEL;
+    a[1].value_len = 4;
+    a[2].type = CKA_MODULUS;
+
+    calls = stub->calls_get_attribute;
+    CHECK_RV(pakchois_get_attributes(sess, obj, a, 3, arena),
+             CKR_ATTRIBUTE_TYPE_INVALID);
+    CHECK(stub->calls_get_attribute == calls + 3);
+    CHECK(a[0].value_len == sizeof(ck_object_class_t));
+    CHECK(*(ck_object_class_t *)a[0].value == CKO_DATA);
+    CHECK(a[1].value_len == strlen(label));
+    CHECK(memcmp(a[1].value, label, strlen(label)) == 0);
+    CHECK(a[2].value == NULL);
+    CHECK(a[2].value_len == CK_UNAVAILABLE_INFORMATION);
+
+    /* With a large enough hint, and nothing invalid, one call
+     * suffices. */
+    pakchois_arena_reset(arena);
+    memset(a, 0, sizeof a);
+    a[0].type = CKA_CLASS;
+    a[1].type = CKA_LABEL;
+    a[1].value_len = sizeof label;
+    calls = stub->calls_get_attribute;
+    CHECK_RV(pakchois_get_attributes(sess, obj, a, 2, arena), CKR_OK);
+    CHECK(stub->calls_get_attribute == calls + 1);
+    CHECK(a[1].value_len == strlen(label));
+    CHECK(memcmp(a[1].value, label, strlen(label)) == 0);
+
+    /* Only invalid attributes need no fetch after the query. */
+    pakchois_arena_reset(arena);
+    memset(a, 0, sizeof a);
+    a[0].type = CKA_CLASS;
+    a[1].type = CKA_MODULUS;
+    calls = stub->calls_get_attribute;
+    CHECK_RV(pakchois_get_attributes(sess, obj, a, 2, arena),
+             CKR_ATTRIBUTE_TYPE_INVALID);
+    CHECK(stub->calls_get_attribute == calls + 2);
+    CHECK(*(ck_object_class_t *)a[0].value == CKO_DATA);
+    CHECK(a[1].value == NULL);
+
+    pakchois_arena_destroy(arena);
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+static int prepared(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_pool_t *pool;
+    pakchois_session_t *sess;
+    pakchois_prepared_t *prep;
+    struct pakchois_pool_params params;
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    struct ck_attribute a;
+    ck_object_handle_t key;
+    unsigned char in[200], out[256], no = 0;
+    unsigned long len;
+
+    if (load(&mod)) return 1;
+
+    memset(&params, 0, sizeof params);
+    params.max_sessions = 4;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess), CKR_OK);
+    CHECK_RV(add_key(sess, 1024, &key), CKR_OK);
+    pakchois_session_pool_release(pool, sess);
+
+    CHECK_RV(pakchois_prepare(&prep, pool, CKF_DECRYPT, &mech, 999),
+             CKR_KEY_HANDLE_INVALID);
+    CHECK_RV(pakchois_prepare(&prep, pool, CKF_DECRYPT, &mech, key), CKR_OK);
+
+    /* The stub's decrypt output is half the input length, so sizes
+     * must follow the input. */
+    memset(in, 'x', sizeof in);
+    CHECK_RV(pakchois_prepared_run(prep, in, 200, NULL, &len), CKR_OK);
+    CHECK(len >= 100);
+    len = sizeof out;
+    CHECK_RV(pakchois_prepared_run(prep, in, 200, out, &len), CKR_OK);
+    CHECK(len == 100);
+    len = sizeof out;
+    CHECK_RV(pakchois_prepared_run(prep, in, 20, out, &len), CKR_OK);
+    CHECK(len == 10);
+    CHECK_RV(pakchois_prepared_run(prep, in, 20, NULL, &len), CKR_OK);
+    CHECK(len >= 10);
+
+    /* No session is held between calls. */
+    CHECK(active_operations() == 0);
+    CHECK(pool->nidle == pool->total);
+    pakchois_prepared_destroy(prep);
+
+    /* A key which may not be used for the operation is rejected. */
+    a.type = CKA_DECRYPT;
+    a.value = &no;
+    a.value_len = sizeof no;
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess), CKR_OK);
+    CHECK_RV(pakchois_set_attribute_value(sess, key, &a, 1), CKR_OK);
+    pakchois_session_pool_release(pool, sess);
+    CHECK_RV(pakchois_prepare(&prep, pool, CKF_DECRYPT, &mech, key),
+             CKR_KEY_FUNCTION_NOT_PERMITTED);
+
+    pakchois_session_pool_destroy(pool);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Size queries through asynchronous operations and batches leave no
+ * operation active on the pooled sessions. */
+static int async_size_query(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_pool_t *pool;
+    pakchois_session_t *sess;
+    pakchois_async_t *async;
+    struct pakchois_pool_params params;
+    struct pakchois_completion done[2];
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    ck_object_handle_t key, plain;
+    struct pakchois_sign_item items[3];
+    struct pakchois_verify_item vitems[3];
+    unsigned char in[20] = "hello, world", sigs[3 * 128 + 10];
+    unsigned int n;
+
+    if (load(&mod)) return 1;
+
+    memset(&params, 0, sizeof params);
+    params.max_sessions = 2;
+    params.wait_timeout = -1;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess), CKR_OK);
+    CHECK_RV(add_key(sess, 1024, &key), CKR_OK);
+    /* No key type, so the length cannot be predicted. */
+    CHECK_RV(add_object(sess, CKO_PRIVATE_KEY, "key", &plain), CKR_OK);
+    pakchois_session_pool_release(pool, sess);
+
+    CHECK_RV(pakchois_async_create(&async, pool, 2), CKR_OK);
+    CHECK_RV(pakchois_async_sign(async, &mech, key, in, sizeof in,
+                                 NULL, 0, &key), CKR_OK);
+    CHECK_RV(pakchois_async_sign(async, &mech, plain, in, sizeof in,
+                                 NULL, 0, &plain), CKR_OK);
+
+    for (n = 0; n < 2; ) {
+        n += pakchois_async_wait(async, done + n, 2 - n, -1);
+    }
+    for (n = 0; n < 2; n++) {
+        CHECK_RV(done[n].rv, CKR_OK);
+        CHECK(done[n].output_len == 128);
+    }
+
+    /* Likewise for a batch without a signature buffer. */
+    for (n = 0; n < 3; n++) {
+        items[n].data = in;
+        items[n].data_len = sizeof in;
+    }
+    CHECK_RV(pakchois_sign_batch(async, &mech, key, items, 3, NULL, 0),
+             CKR_OK);
+    for (n = 0; n < 3; n++) {
+        CHECK_RV(items[n].rv, CKR_OK);
+        CHECK(items[n].length == 128);
+    }
+    CHECK(active_operations() == 0);
+
+    CHECK_RV(pakchois_sign_batch(async, &mech, key, items, 3, sigs,
+                                 sizeof sigs), CKR_OK);
+    for (n = 0; n < 3; n++) {
+        CHECK_RV(items[n].rv, CKR_OK);
+        CHECK(items[n].offset == n * 128 && items[n].length == 128);
+        vitems[n].data = in;
+        vitems[n].data_len = sizeof in;
+        vitems[n].signature = sigs + items[n].offset;
+        vitems[n].signature_len = items[n].length;
+    }
+    CHECK_RV(pakchois_verify_batch(async, &mech, key, vitems, 3), CKR_OK);
+    for (n = 0; n < 3; n++) {
+        CHECK_RV(vitems[n].rv, CKR_OK);
+    }
+
+    pakchois_async_destroy(async);
+    CHECK(active_operations() == 0);
+    CHECK(pool->nidle == pool->total);
+
+    pakchois_session_pool_destroy(pool);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Workers beyond the pool size are not created, so a pool which
+ * does not wait for sessions does not fail their operations. */
+static int async_workers(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_pool_t *pool;
+    pakchois_session_t *sess;
+    pakchois_async_t *async;
+    struct pakchois_pool_params params;
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    struct pakchois_sign_item items[16];
+    ck_object_handle_t key;
+    unsigned char in[20] = "hello, world", sigs[16 * 128];
+    unsigned int n;
+
+    if (load(&mod)) return 1;
+
+    memset(&params, 0, sizeof params);
+    params.max_sessions = 2;
+    params.wait_timeout = 0;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess), CKR_OK);
+    CHECK_RV(add_key(sess, 1024, &key), CKR_OK);
+    pakchois_session_pool_release(pool, sess);
+
+    CHECK_RV(pakchois_async_create(&async, pool, 8), CKR_OK);
+    CHECK(async->nthreads == 2);
+
+    for (n = 0; n < 16; n++) {
+        items[n].data = in;
+        items[n].data_len = sizeof in;
+    }
+    CHECK_RV(pakchois_sign_batch(async, &mech, key, items, 16, sigs,
+                                 sizeof sigs), CKR_OK);
+    for (n = 0; n < 16; n++) {
+        CHECK_RV(items[n].rv, CKR_OK);
+    }
+
+    pakchois_async_destroy(async);
+    pakchois_session_pool_destroy(pool);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+static int open_sessions(void)
+{
+    int n, count = 0;
+
+    for (n = 0; n < STUB_SESSIONS; n++) {
+        count += stub->sessions[n].open != 0;
+    }
+
+    return count;
+}
+
+static long elapsed_ms(const struct timespec *since)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000
+        + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+/* Pools open min_sessions up front and no more than max_sessions,
+ * or the token's limit, reap idle sessions down to min_sessions, and
+ * wait for the wait_timeout when exhausted. */
+static int pool_sizing(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_pool_t *pool;
+    pakchois_session_t *sess[4];
+    struct pakchois_pool_params params;
+    struct timespec start;
+    unsigned int n;
+
+    if (load(&mod)) return 1;
+
+    memset(&params, 0, sizeof params);
+    params.min_sessions = 2;
+    params.max_sessions = 3;
+    params.idle_timeout = 60;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK(stub->calls_open == 2 && open_sessions() == 2);
+
+    for (n = 0; n < 3; n++) {
+        CHECK_RV(pakchois_session_pool_acquire(pool, &sess[n]), CKR_OK);
+    }
+    CHECK(stub->calls_open == 3);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess[3]),
+             CKR_SESSION_COUNT);
+    for (n = 0; n < 3; n++) {
+        pakchois_session_pool_release(pool, sess[n]);
+    }
+
+    /* Nothing has been idle for long enough. */
+    pakchois_session_pool_reap(pool);
+    CHECK(open_sessions() == 3);
+
+    for (n = 0; n < pool->nidle; n++) {
+        pool->idle[n].idle_since -= 120;
+    }
+    pakchois_session_pool_reap(pool);
+    CHECK(open_sessions() == 2 && pool->total == 2);
+
+    pakchois_session_pool_destroy(pool);
+    CHECK(open_sessions() == 0);
+
+    /* Without a maximum, the pool is sized to the token's limit. */
+    params.max_sessions = 0;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK(pool->params.max_sessions == STUB_SESSIONS / STUB_SLOTS);
+    pakchois_session_pool_destroy(pool);
+
+    /* An exhausted pool waits for the timeout before failing. */
+    params.min_sessions = 0;
+    params.max_sessions = 1;
+    params.wait_timeout = 100;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess[0]), CKR_OK);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess[1]),
+             CKR_SESSION_COUNT);
+    CHECK(elapsed_ms(&start) >= 90);
+    pakchois_session_pool_release(pool, sess[0]);
+
+    pakchois_session_pool_destroy(pool);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Returns non-zero if the descriptor becomes readable within the
+ * timeout. */
+static int readable(int fd, int timeout)
+{
+    struct pollfd pfd;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    return poll(&pfd, 1, timeout) == 1 && (pfd.revents & POLLIN);
+}
+
+/* The completion descriptor is readable exactly while completions
+ * are queued. */
+static int async_fd(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_pool_t *pool;
+    pakchois_session_t *sess;
+    pakchois_async_t *async;
+    struct pakchois_pool_params params;
+    struct pakchois_completion done[2];
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    ck_object_handle_t key;
+    unsigned char in[20] = "hello, world", out[2][128];
+    unsigned long len;
+    int fd;
+
+    if (load(&mod)) return 1;
+
+    memset(&params, 0, sizeof params);
+    params.max_sessions = 2;
+    params.wait_timeout = -1;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess), CKR_OK);
+    CHECK_RV(add_key(sess, 1024, &key), CKR_OK);
+    pakchois_session_pool_release(pool, sess);
+    CHECK_RV(pakchois_async_create(&async, pool, 2), CKR_OK);
+
+    fd = pakchois_async_fd(async);
+    CHECK(fd >= 0);
+    CHECK(pakchois_async_fd(async) == fd);
+    CHECK(!readable(fd, 0));
+
+    len = sizeof out[0];
+    CHECK_RV(pakchois_async_sign(async, &mech, key, in, sizeof in,
+                                 out[0], len, NULL), CKR_OK);
+    CHECK(readable(fd, 2000));
+    CHECK(pakchois_async_poll(async, done, 2) == 1);
+    CHECK_RV(done[0].rv, CKR_OK);
+    CHECK(!readable(fd, 0));
+
+    /* Completions queued when the descriptor is created make it
+     * readable at once. */
+    pakchois_async_destroy(async);
+    CHECK_RV(pakchois_async_create(&async, pool, 2), CKR_OK);
+    CHECK_RV(pakchois_async_sign(async, &mech, key, in, sizeof in,
+                                 out[1], len, NULL), CKR_OK);
+    CHECK(pakchois_async_wait(async, done, 0, 2000) == 0);
+    fd = pakchois_async_fd(async);
+    CHECK(readable(fd, 0));
+    CHECK(pakchois_async_poll(async, done, 2) == 1);
+    CHECK(!readable(fd, 0));
+
+    pakchois_async_destroy(async);
+    pakchois_session_pool_destroy(pool);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Items of a batch which fail do not affect the others, and failed
+ * signatures take no space in the packed buffer. */
+static int batch_failures(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_pool_t *pool;
+    pakchois_session_t *sess;
+    pakchois_async_t *async;
+    struct pakchois_pool_params params;
+    struct pakchois_sign_item items[3];
+    struct pakchois_verify_item vitems[3];
+    struct ck_mechanism mech = { CKM_RSA_PKCS, NULL, 0 };
+    ck_object_handle_t key;
+    unsigned char in[200], sigs[3 * 128];
+    unsigned int n;
+
+    if (load(&mod)) return 1;
+
+    memset(&params, 0, sizeof params);
+    params.max_sessions = 2;
+    params.wait_timeout = -1;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess), CKR_OK);
+    CHECK_RV(add_key(sess, 1024, &key), CKR_OK);
+    pakchois_session_pool_release(pool, sess);
+    CHECK_RV(pakchois_async_create(&async, pool, 2), CKR_OK);
+
+    /* The middle message is too long for the key. */
+    memset(in, 'x', sizeof in);
+    for (n = 0; n < 3; n++) {
+        items[n].data = in + n;
+        items[n].data_len = n == 1 ? sizeof in : 20;
+    }
+    CHECK_RV(pakchois_sign_batch(async, &mech, key, items, 3, sigs,
+                                 sizeof sigs), CKR_OK);
+    CHECK_RV(items[0].rv, CKR_OK);
+    CHECK_RV(items[1].rv, CKR_DATA_LEN_RANGE);
+    CHECK_RV(items[2].rv, CKR_OK);
+    CHECK(items[0].offset == 0 && items[0].length == 128);
+    CHECK(items[1].length == 0);
+    CHECK(items[2].offset == 128 && items[2].length == 128);
+    CHECK(active_operations() == 0);
+
+    /* The signatures were packed intact; the middle one is
+     * corrupted. */
+    for (n = 0; n < 3; n++) {
+        vitems[n].data = items[n ? 2 : 0].data;
+        vitems[n].data_len = 20;
+        vitems[n].signature = sigs + items[n ? 2 : 0].offset;
+        vitems[n].signature_len = 128;
+    }
+    sigs[300] ^= 1;
+    vitems[1].signature = sigs + 256;
+    CHECK_RV(pakchois_verify_batch(async, &mech, key, vitems, 3), CKR_OK);
+    CHECK_RV(vitems[0].rv, CKR_OK);
+    CHECK_RV(vitems[1].rv, CKR_SIGNATURE_INVALID);
+    CHECK_RV(vitems[2].rv, CKR_OK);
+
+    /* A buffer too small for the signatures fails every item, with
+     * the length required. */
+    CHECK_RV(pakchois_sign_batch(async, &mech, key, items, 3, sigs, 3 * 64),
+             CKR_OK);
+    for (n = 0; n < 3; n++) {
+        CHECK_RV(items[n].rv, n == 1 ? CKR_DATA_LEN_RANGE
+                 : CKR_BUFFER_TOO_SMALL);
+        CHECK(items[n].length == (n == 1 ? 0 : 128));
+    }
+    CHECK(active_operations() == 0);
+
+    pakchois_async_destroy(async);
+    pakchois_session_pool_destroy(pool);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+struct acquirer {
+    pakchois_session_pool_t *pool;
+    pthread_t thread;
+    ck_rv_t rv;
+    ck_state_t state;
+};
+
+static void *acquire_thread(void *arg)
+{
+    struct acquirer *a = arg;
+    pakchois_session_t *sess;
+    struct ck_session_info info;
+
+    a->rv = pakchois_session_pool_acquire(a->pool, &sess);
+    if (a->rv == CKR_OK) {
+        a->rv = pakchois_get_session_info(sess, &info);
+        a->state = info.state;
+        pakchois_session_pool_release(a->pool, sess);
+    }
+
+    return NULL;
+}
+
+static int pool_login(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_pool_t *pool;
+    pakchois_session_t *sess;
+    struct pakchois_pool_params params;
+    struct acquirer a[4];
+    unsigned char pin[] = "1234";
+    int n;
+
+    if (load(&mod)) return 1;
+
+    memset(&params, 0, sizeof params);
+    params.max_sessions = 8;
+    params.wait_timeout = -1;
+    CHECK_RV(pakchois_session_pool_create(&pool, mod, 1, &params), CKR_OK);
+    CHECK_RV(pakchois_session_pool_login(pool, CKU_USER, pin, 4), CKR_OK);
+    CHECK(stub->logged_in[0]);
+
+    /* Closing the pool's only session logs the token out. */
+    CHECK_RV(pakchois_session_pool_acquire(pool, &sess), CKR_OK);
+    pakchois_session_pool_discard(pool, sess);
+    CHECK(!stub->logged_in[0]);
+
+    /* While the first session is logged in again, no other session
+     * is handed out. */
+    stub->open_delay = 20;
+    stub->login_delay = 100;
+    for (n = 0; n < 4; n++) {
+        a[n].pool = pool;
+        CHECK(pthread_create(&a[n].thread, NULL,
+                             acquire_thread, &a[n]) == 0);
+    }
+    for (n = 0; n < 4; n++) {
+        pthread_join(a[n].thread, NULL);
+        CHECK_RV(a[n].rv, CKR_OK);
+        CHECK(a[n].state == CKS_RO_USER_FUNCTIONS);
+    }
+    CHECK(stub->calls_login == 2);
+
+    pakchois_session_pool_destroy(pool);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+static int invalidation(void)
+{
+    pakchois_module_t *mod;
+    struct ck_token_info info;
+    unsigned long count, gen1, gen2;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(count == 2);
+    CHECK(stub->calls_mechanism_list == 1);
+    CHECK_RV(pakchois_slot_generation(mod, 1, &gen1), CKR_OK);
+
+    /* Finding the same token present again changes nothing. */
+    CHECK_RV(pakchois_get_token_info(mod, 1, &info), CKR_OK);
+    CHECK_RV(pakchois_get_token_info(mod, 1, &info), CKR_OK);
+    CHECK_RV(pakchois_slot_generation(mod, 1, &gen2), CKR_OK);
+    CHECK(gen2 == gen1);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(stub->calls_mechanism_list == 1);
+
+    /* Removal of the token is noticed by pakchois_get_token_info(),
+     * which discards the slot's caches. */
+    stub->present[0] = 0;
+    CHECK_RV(pakchois_get_token_info(mod, 1, &info), CKR_TOKEN_NOT_PRESENT);
+    stub->present[0] = 1;
+
+    CHECK_RV(pakchois_slot_generation(mod, 1, &gen2), CKR_OK);
+    CHECK(gen2 != gen1);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(stub->calls_mechanism_list == 2);
+
+    /* Only a change in presence invalidates the slot. */
+    stub->present[0] = 0;
+    CHECK_RV(pakchois_get_token_info(mod, 1, &info), CKR_TOKEN_NOT_PRESENT);
+    CHECK_RV(pakchois_slot_generation(mod, 1, &gen1), CKR_OK);
+    CHECK_RV(pakchois_get_token_info(mod, 1, &info), CKR_TOKEN_NOT_PRESENT);
+    CHECK_RV(pakchois_slot_generation(mod, 1, &gen2), CKR_OK);
+    CHECK(gen2 == gen1);
+    stub->present[0] = 1;
+    CHECK_RV(pakchois_get_token_info(mod, 1, &info), CKR_OK);
+    CHECK_RV(pakchois_slot_generation(mod, 1, &gen2), CKR_OK);
+    CHECK(gen2 != gen1);
+
+    /* A different token seen in the cached token information discards
+     * the caches of the old one. */
+    CHECK_RV(pakchois_get_cached_token_info(mod, 1, &info, &gen1), CKR_OK);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(stub->calls_mechanism_list == 3);
+    stub->serial[0][1] = 'x';
+    find_slot(mod, 1)->token_info.fetched -= 10;
+    CHECK_RV(pakchois_get_cached_token_info(mod, 1, &info, &gen2), CKR_OK);
+    CHECK(gen2 != gen1);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(stub->calls_mechanism_list == 4);
+
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+static pakchois_module_t *hook_module;
+
+/* Invalidates the slot while its mechanism list is being fetched,
+ * once. */
+static void invalidate_once(ck_slot_id_t slot_id)
+{
+    stub->mechanism_hook = NULL;
+    invalidate_slot(hook_module, slot_id);
+}
+
+/* A mechanism list fetched across an invalidation of the slot is not
+ * cached. */
+static int invalidation_race(void)
+{
+    pakchois_module_t *mod;
+    unsigned long count;
+
+    if (load(&mod)) return 1;
+
+    hook_module = mod;
+    stub->mechanism_hook = invalidate_once;
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(count == 2);
+    CHECK(stub->calls_mechanism_list == 2);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(stub->calls_mechanism_list == 2);
+
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Certificates whose handles are reused while the token is away
+ * are fetched again. */
+static int cert_reuse(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    ck_object_handle_t cert, found;
+    struct stub_object *obj;
+    unsigned int n;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION, NULL, NULL,
+                                   &sess), CKR_OK);
+    CHECK_RV(add_cert(sess, "leaf", "ca", "1", &cert), CKR_OK);
+    CHECK_RV(pakchois_find_certificate(sess, (unsigned char *)"ca", 2,
+                                       (unsigned char *)"1", 1, &found),
+             CKR_OK);
+    CHECK(found == cert);
+
+    /* Replace the certificate behind the library's back, as if the
+     * token had been removed and reinserted with another one. */
+    obj = &stub->objects[cert - 1];
+    for (n = 0; n < obj->count; n++) {
+        if (obj->attrs[n].type == CKA_ISSUER) {
+            memcpy(obj->attrs[n].value, "cb", 2);
+        }
+    }
+    invalidate_slot(mod, 1);
+
+    CHECK_RV(pakchois_find_certificate(sess, (unsigned char *)"ca", 2,
+                                       (unsigned char *)"1", 1, &found),
+             CKR_OK);
+    CHECK(found == CK_INVALID_HANDLE);
+    CHECK_RV(pakchois_find_certificate(sess, (unsigned char *)"cb", 2,
+                                       (unsigned char *)"1", 1, &found),
+             CKR_OK);
+    CHECK(found == cert);
+
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Mutable attributes are not cached, and attributes read while an
+ * object is forgotten are not stored. */
+static int attr_cache(void)
+{
+    pakchois_module_t *mod;
+    pakchois_session_t *sess;
+    ck_object_handle_t key, pub, priv;
+    ck_object_class_t class;
+    unsigned long calls, generation, changes;
+    struct stub_object *obj;
+    struct ck_attribute a[2];
+    unsigned char id[4];
+    ck_rv_t rv;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_set_attribute_cache(mod, 1, 1), CKR_OK);
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION, NULL, NULL,
+                                   &sess), CKR_OK);
+    CHECK_RV(add_object(sess, CKO_PRIVATE_KEY, "key", &key), CKR_OK);
+    obj = &stub->objects[key - 1];
+    obj->attrs[obj->count].type = CKA_ID;
+    memcpy(obj->attrs[obj->count].value, "a", 1);
+    obj->attrs[obj->count++].len = 1;
+
+    a[0].type = CKA_CLASS;
+    a[0].value = &class;
+    a[0].value_len = sizeof class;
+    a[1].type = CKA_ID;
+    a[1].value = id;
+    a[1].value_len = sizeof id;
+    CHECK_RV(pakchois_get_attribute_value(sess, key, a, 2), CKR_OK);
+    CHECK(a[1].value_len == 1 && id[0] == 'a');
+
+    /* The class is answered from the cache, but CKA_ID may change. */
+    calls = stub->calls_get_attribute;
+    CHECK_RV(pakchois_get_attribute_value(sess, key, a, 1), CKR_OK);
+    CHECK(stub->calls_get_attribute == calls);
+    obj->attrs[obj->count - 1].value[0] = 'b';
+    a[1].value_len = sizeof id;
+    CHECK_RV(pakchois_get_attribute_value(sess, key, a, 2), CKR_OK);
+    CHECK(a[1].value_len == 1 && id[0] == 'b');
+
+    /* Forget the object between reading the cache and storing what
+     * the provider returned. */
+    attr_cache_forget(sess->slot, key);
+    CHECK(!attr_cache_get(sess->slot, key, a, 1, &generation, &changes,
+                          &rv));
+    attr_cache_forget(sess->slot, key);
+    attr_cache_put(sess, key, a, 1, generation, changes);
+    calls = stub->calls_get_attribute;
+    CHECK_RV(pakchois_get_attribute_value(sess, key, a, 1), CKR_OK);
+    CHECK(stub->calls_get_attribute > calls);
+
+    /* A key generated onto the handle of an object destroyed behind
+     * the library's back is not served the old object's attributes. */
+    CHECK(class == CKO_PRIVATE_KEY);
+    obj->used = 0;
+    CHECK_RV(add_key_pair(sess, "pair", &pub, &priv), CKR_OK);
+    CHECK(pub == key);
+    CHECK_RV(pakchois_get_attribute_value(sess, key, a, 1), CKR_OK);
+    CHECK(class == CKO_PUBLIC_KEY);
+
+    pakchois_close_session(sess);
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Waits up to two seconds for an event from the module. */
+static ck_rv_t next_event(pakchois_module_t *mod, ck_slot_id_t *slot)
+{
+    ck_rv_t rv;
+    int n;
+
+    for (n = 0; n < 2000; n++) {
+        rv = pakchois_wait_for_slot_event(mod, CKF_DONT_BLOCK, slot, NULL);
+        if (rv != CKR_NO_EVENT) {
+            break;
+        }
+        usleep(1000);
+    }
+
+    return rv;
+}
+
+/* Events are read only by the dispatcher, and queued for every
+ * module from when it is loaded. */
+static int slot_events(void)
+{
+    pakchois_module_t *mod1, *mod2;
+    ck_slot_id_t slot;
+    int dummy;
+
+    if (load(&mod1) || load(&mod2)) return 1;
+
+    pakchois_set_poll_interval(1, 10);
+    stub->events = 1;
+    stub->pending[0] = 2;
+    stub->npending = 1;
+
+    CHECK_RV(pakchois_wait_for_slot_event(mod1, CKF_DONT_BLOCK, &slot, NULL),
+             CKR_NO_EVENT);
+    CHECK_RV(next_event(mod2, &slot), CKR_OK);
+    CHECK(slot == 2);
+    CHECK_RV(next_event(mod1, &slot), CKR_OK);
+    CHECK(slot == 2);
+    CHECK_RV(pakchois_wait_for_slot_event(mod1, CKF_DONT_BLOCK, &slot,
+                                          &dummy), CKR_ARGUMENTS_BAD);
+
+    pakchois_module_destroy(mod2);
+    pakchois_module_destroy(mod1);
+    pakchois_set_poll_interval(100, 5000);
+    return 0;
+}
+
+/* Returns the number of C_GetTokenInfo calls made. */
+static unsigned long token_info_calls(void)
+{
+    unsigned long calls;
+
+    pthread_mutex_lock(stub_mutex);
+    calls = stub->calls_token_info;
+    pthread_mutex_unlock(stub_mutex);
+    return calls;
+}
+
+/* The polling dispatcher survives provider errors, and synthesizes
+ * events for non-blocking waits. */
+static int event_errors(void)
+{
+    pakchois_module_t *mod;
+    ck_slot_id_t slot;
+    unsigned long calls;
+    int n;
+
+    if (load(&mod)) return 1;
+
+    pakchois_set_poll_interval(1, 10);
+    pthread_mutex_lock(stub_mutex);
+    stub->token_info_rv = CKR_DEVICE_ERROR;
+    pthread_mutex_unlock(stub_mutex);
+
+    CHECK_RV(pakchois_wait_for_slot_event(mod, CKF_DONT_BLOCK, &slot, NULL),
+             CKR_NO_EVENT);
+    usleep(50000);
+
+    pthread_mutex_lock(stub_mutex);
+    stub->token_info_rv = CKR_OK;
+    pthread_mutex_unlock(stub_mutex);
+
+    /* Wait for a complete snapshot of both slots. */
+    calls = token_info_calls();
+    for (n = 0; n < 2000 && token_info_calls() < calls + 4; n++) {
+        usleep(1000);
+    }
+
+    pthread_mutex_lock(stub_mutex);
+    stub->present[0] = 0;
+    pthread_mutex_unlock(stub_mutex);
+
+    CHECK_RV(next_event(mod, &slot), CKR_OK);
+    CHECK(slot == 1);
+
+    pakchois_module_destroy(mod);
+    pakchois_set_poll_interval(100, 5000);
+    return 0;
+}
+
+static void *blocking_wait(void *arg)
+{
+    ck_slot_id_t slot;
+
+    return (void *)(uintptr_t)
+        pakchois_wait_for_slot_event(arg, 0, &slot, NULL);
+}
+
+/* A blocking wait in progress when the dispatcher stops fails,
+ * rather than reporting that there is no event. */
+static int event_stop(void)
+{
+    pakchois_module_t *mod;
+    struct provider *prov;
+    ck_slot_id_t slot;
+    pthread_t thread;
+    void *ret;
+
+    if (load(&mod)) return 1;
+    prov = mod->provider;
+
+    CHECK_RV(pakchois_wait_for_slot_event(mod, CKF_DONT_BLOCK, &slot, NULL),
+             CKR_NO_EVENT);
+    CHECK(pthread_create(&thread, NULL, blocking_wait, mod) == 0);
+    usleep(50000);
+
+    /* Stop the dispatcher as finalize_provider() would. */
+    pthread_mutex_lock(&prov->mutex);
+    prov->dispatch_stop = 1;
+    pthread_cond_broadcast(&prov->event_cond);
+    pthread_mutex_unlock(&prov->mutex);
+    stop_dispatcher(prov);
+
+    pthread_join(thread, &ret);
+    CHECK_RV((ck_rv_t)(uintptr_t)ret, CKR_CRYPTOKI_NOT_INITIALIZED);
+
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Saves a snapshot holding the mechanism cache of slot 1 to the given
+ * file. */
+static int save_snapshot(const char *path)
+{
+    pakchois_module_t *mod;
+    unsigned long count;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK_RV(pakchois_save_snapshot(mod, path), CKR_OK);
+
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+/* Saving a snapshot over a directory fails cleanly. */
+static int snapshot_failure(void)
+{
+    pakchois_module_t *mod;
+    char path[64];
+    unsigned long count;
+    int ret = 1;
+
+    snprintf(path, sizeof path, "stubtest-%ld.dir", (long)getpid());
+    if (mkdir(path, 0700) || load(&mod)) goto out;
+
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK_RV(pakchois_save_snapshot(mod, path), CKR_FUNCTION_FAILED);
+
+    pakchois_module_destroy(mod);
+    ret = 0;
+out:
+    rmdir(path);
+    return ret;
+}
+
+/* Rewrites the uint64_t at given offset in the file. */
+static int patch_file(const char *path, off_t offset, uint64_t value)
+{
+    int fd = open(path, O_WRONLY);
+
+    CHECK(fd >= 0);
+    CHECK(pwrite(fd, &value, sizeof value, offset) == sizeof value);
+    close(fd);
+    return 0;
+}
+
+/* Loads the snapshot from the given file, expecting given result,
+ * and checks the mechanism list of slot 1 is still correct. */
+static int load_snapshot(const char *path, ck_rv_t expect)
+{
+    pakchois_module_t *mod;
+    ck_mechanism_type_t list[4];
+    unsigned long count = 4;
+
+    if (load(&mod)) return 1;
+
+    CHECK_RV(pakchois_load_snapshot(mod, path), expect);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, list, &count),
+             CKR_OK);
+    CHECK(count == 2 && list[0] == CKM_RSA_PKCS && list[1] == CKM_SHA_1);
+
+    pakchois_module_destroy(mod);
+    return 0;
+}
+
+static int stub_initialized(void)
+{
+    int initialized;
+
+    pthread_mutex_lock(stub_mutex);
+    initialized = stub->initialized;
+    pthread_mutex_unlock(stub_mutex);
+
+    return initialized;
+}
+
+struct alloc_count {
+    unsigned long allocs, frees;
+};
+
+static void *count_alloc(void *userdata, size_t size)
+{
+    struct alloc_count *c = userdata;
+
+    __atomic_add_fetch(&c->allocs, 1, __ATOMIC_RELAXED);
+    return malloc(size);
+}
+
+static void count_free(void *userdata, void *ptr)
+{
+    struct alloc_count *c = userdata;
+
+    if (ptr) {
+        __atomic_add_fetch(&c->frees, 1, __ATOMIC_RELAXED);
+    }
+    free(ptr);
+}
+
+/* Module and session memory comes from the custom allocator, all of
+ * it is released when the module is destroyed, and closed sessions
+ * are reused from the slab without further allocations.  The
+ * allocator is changed with no module loaded, and wraps malloc(), so
+ * nothing allocated before is freed with the wrong allocator. */
+static int allocator(void)
+{
+    struct alloc_count c = { 0, 0 };
+    pakchois_module_t *mod;
+    pakchois_session_t *sess, *again;
+    unsigned long allocs;
+
+    pakchois_set_allocator(count_alloc, count_free, &c);
+    if (load(&mod)) return 1;
+    CHECK(c.allocs > 0);
+
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION, NULL, NULL,
+                                   &sess), CKR_OK);
+    CHECK_RV(pakchois_close_session(sess), CKR_OK);
+    allocs = __atomic_load_n(&c.allocs, __ATOMIC_RELAXED);
+    CHECK_RV(pakchois_open_session(mod, 1, CKF_SERIAL_SESSION, NULL, NULL,
+                                   &again), CKR_OK);
+    CHECK(again == sess);
+    CHECK_RV(pakchois_close_session(again), CKR_OK);
+    CHECK(__atomic_load_n(&c.allocs, __ATOMIC_RELAXED) == allocs);
+
+    pakchois_module_destroy(mod);
+    pakchois_set_allocator(NULL, NULL, NULL);
+    CHECK(c.allocs == c.frees);
+
+    return 0;
+}
+
+/* Lingering providers are reused without reinitialization, and
+ * finalized once the timeout expires, or the timeout is set to
+ * zero. */
+static int linger(void)
+{
+    pakchois_module_t *mod;
+    int n;
+
+    CHECK_RV(pakchois_set_linger(1, 0), CKR_OK);
+    if (load(&mod)) return 1;
+    stub->find_page = 3;
+    pakchois_module_destroy(mod);
+    CHECK(stub_initialized());
+
+    if (load(&mod)) return 1;
+    CHECK(stub->find_page == 3);
+    pakchois_module_destroy(mod);
+
+    for (n = 0; n < 400 && stub_initialized(); n++) {
+        usleep(10000);
+    }
+    CHECK(!stub_initialized());
+
+    CHECK_RV(pakchois_set_linger(60, 0), CKR_OK);
+    if (load(&mod)) return 1;
+    CHECK(stub->find_page == 0);
+    pakchois_module_destroy(mod);
+    CHECK(stub_initialized());
+    CHECK_RV(pakchois_set_linger(0, 0), CKR_OK);
+    CHECK(!stub_initialized());
+
+    return 0;
+}
+
+/* Names which cannot be written to the module cache file are left
+ * out of it. */
+static int module_cache(void)
+{
+    char path[64], line[256];
+    int bad = 0, good = 0;
+    FILE *f;
+
+    snprintf(path, sizeof path, "stubtest-%ld.cache", (long)getpid());
+    CHECK_RV(pakchois_set_module_cache(path), CKR_OK);
+
+    pthread_mutex_lock(&modpath_mutex);
+    modpath_insert("bad\tname", "/nonexistent/bad", 0, 1, 0);
+    modpath_insert("good", "/nonexistent/good", 0, 1, 0);
+    modpath_write();
+    pthread_mutex_unlock(&modpath_mutex);
+    CHECK_RV(pakchois_set_module_cache(NULL), CKR_OK);
+
+    f = fopen(path, "r");
+    CHECK(f != NULL);
+    while (fgets(line, sizeof line, f)) {
+        bad |= strstr(line, "bad") != NULL;
+        good |= strncmp(line, "good\t", 5) == 0;
+    }
+    fclose(f);
+    unlink(path);
+
+    CHECK(good && !bad);
+    return 0;
+}
+
+/* A snapshot is adopted again after the slot is invalidated. */
+static int snapshot_reuse(void)
+{
+    pakchois_module_t *mod;
+    char path[64];
+    unsigned long count;
+    int ret = 1;
+
+    snprintf(path, sizeof path, "stubtest-%ld.snap", (long)getpid());
+    if (save_snapshot(path) || load(&mod)) goto out;
+
+    CHECK_RV(pakchois_load_snapshot(mod, path), CKR_OK);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    invalidate_slot(mod, 1);
+    CHECK_RV(pakchois_get_cached_mechanism_list(mod, 1, NULL, &count),
+             CKR_OK);
+    CHECK(count == 2);
+    CHECK(stub->calls_mechanism_list == 0);
+
+    pakchois_module_destroy(mod);
+    ret = 0;
+out:
+    unlink(path);
+    return ret;
+}
+
+static int bad_snapshot(void)
+{
+    char path[64];
+    off_t slot = sizeof(struct snap_header);
+    int fd, ret = 1;
+
+    snprintf(path, sizeof path, "stubtest-%ld.snap", (long)getpid());
+
+    /* A good snapshot is used in place of the provider. */
+    if (save_snapshot(path) || load_snapshot(path, CKR_OK)) goto out;
+    if (stub->calls_mechanism_list != 0) {
+        printf("snapshot not used\n");
+        goto out;
+    }
+
+    /* Mechanism list out of range of the file. */
+    if (patch_file(path, slot + offsetof(struct snap_slot, mechs),
+                   UINT64_C(1) << 40)
+        || load_snapshot(path, CKR_OK)) goto out;
+    if (stub->calls_mechanism_list != 1) {
+        printf("bad mechanism list used\n");
+        goto out;
+    }
+
+    /* Misaligned mechanism list. */
+    if (save_snapshot(path)
+        || patch_file(path, slot + offsetof(struct snap_slot, mechs),
+                      sizeof(struct snap_header) + sizeof(struct snap_slot)
+                      + 4)
+        || load_snapshot(path, CKR_OK)) goto out;
+    if (stub->calls_mechanism_list != 1) {
+        printf("misaligned mechanism list used\n");
+        goto out;
+    }
+
+    /* Token versions do not match. */
+    if (save_snapshot(path)
+        || patch_file(path, slot + offsetof(struct snap_slot, hardware), 1)
+        || load_snapshot(path, CKR_OK)) goto out;
+    if (stub->calls_mechanism_list != 1) {
+        printf("snapshot for other token version used\n");
+        goto out;
+    }
+
+    /* Header size does not match the file. */
+    if (save_snapshot(path)
+        || patch_file(path, offsetof(struct snap_header, size), 8)
+        || load_snapshot(path, CKR_FUNCTION_FAILED)) goto out;
+
+    /* Slot count larger than the file. */
+    if (save_snapshot(path)
+        || patch_file(path, offsetof(struct snap_header, nslots),
+                      UINT64_C(1) << 60)
+        || load_snapshot(path, CKR_FUNCTION_FAILED)) goto out;
+
+    /* Truncated file. */
+    fd = open(path, O_WRONLY | O_TRUNC);
+    if (fd < 0 || write(fd, SNAP_MAGIC, 8) != 8) goto out;
+    close(fd);
+    if (load_snapshot(path, CKR_FUNCTION_FAILED)) goto out;
+
+    ret = 0;
+out:
+    unlink(path);
+    return ret;
+}
+
+static const struct {
+    const char *name;
+    int (*fn)(void);
+} tests[] = {
+    { "slots", slots },
+    { "find_all", find_all },
+    { "find_short_pages", find_short_pages },
+    { "size_query", size_query },
+    { "buffer_too_small", buffer_too_small },
+    { "output_length", output_length },
+    { "arena_limits", arena_limits },
+    { "get_attributes", get_attributes },
+    { "prepared", prepared },
+    { "async_size_query", async_size_query },
+    { "async_workers", async_workers },
+    { "pool_sizing", pool_sizing },
+    { "async_fd", async_fd },
+    { "batch_failures", batch_failures },
+    { "pool_login", pool_login },
+    { "invalidation", invalidation },
+    { "invalidation_race", invalidation_race },
+    { "slot_events", slot_events },
+    { "event_errors", event_errors },
+    { "event_stop", event_stop },
+    { "cert_reuse", cert_reuse },
+    { "attr_cache", attr_cache },
+    { "allocator", allocator },
+    { "linger", linger },
+    { "module_cache", module_cache },
+    { "snapshot_reuse", snapshot_reuse },
+    { "snapshot_failure", snapshot_failure },
+    { "bad_snapshot", bad_snapshot },
+    { NULL, NULL }
+};
+
+int main(int argc, char **argv)
+{
+    int n, failed = 0;
+
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    for (n = 0; tests[n].name; n++) {
+        int ret = tests[n].fn();
+
+        printf("%s: %s\n", tests[n].name, ret ? "FAIL" : "ok");
+        failed += ret;
+    }
+
+    return failed ? 1 : 0;
+}